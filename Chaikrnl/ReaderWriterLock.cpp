@@ -1,5 +1,6 @@
 #include "ReadersWriterLock.h"
 #include <arch/cpu.h>
+#include <chaiatomic.h>
 
 typedef volatile struct _sharedlock {
 	size_t writersTicket;
@@ -123,4 +124,84 @@ EXTERN CHAIKRNL_FUNC void SharedSpinlockRelease(sharespinlock_t lock, cpu_status
 
 		arch_restore_state(status);
 	}
-}
\ No newline at end of file
+}
+
+//Readers are hashed into slots by CPU ID, CPUs sharing a slot still work, just contend
+static const size_t BRLOCK_SLOTS = 64;
+//Reader status carries the slot, so a migrated reader releases the right counter
+static const cpu_status_t BRLOCK_READER = (cpu_status_t)1 << 63;
+
+struct __declspec(align(64)) brlock_slot {
+	std::atomic<size_t> readers;
+};
+
+struct brlock {
+	brlock_slot slots[BRLOCK_SLOTS];
+	__declspec(align(64)) std::atomic<size_t> writer;
+};
+
+EXTERN CHAIKRNL_FUNC brlock_t BigReaderLockCreate()
+{
+	brlock* lock = new brlock;
+	if (!lock)
+		return nullptr;
+	for (size_t n = 0; n < BRLOCK_SLOTS; ++n)
+		lock->slots[n].readers.store(0, std::memory_order_relaxed);
+	lock->writer.store(0, std::memory_order_relaxed);
+	return (brlock_t)lock;
+}
+EXTERN CHAIKRNL_FUNC void BigReaderLockDelete(brlock_t lock)
+{
+	delete (brlock*)lock;
+}
+EXTERN CHAIKRNL_FUNC cpu_status_t BigReaderLockAcquire(brlock_t lock, BOOL exclusive)
+{
+	brlock* block = (brlock*)lock;
+	if (exclusive)
+	{
+		cpu_status_t v = arch_disable_interrupts();
+		//Claiming the writer flag turns new readers away
+		size_t expected = 0;
+		while (!block->writer.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+		{
+			expected = 0;
+			arch_pause();
+		}
+		//Wait for existing readers to drain
+		for (size_t n = 0; n < BRLOCK_SLOTS; ++n)
+		{
+			while (block->slots[n].readers.load(std::memory_order_acquire) != 0)
+				arch_pause();
+		}
+		return v;
+	}
+	else
+	{
+		size_t slot = pcpu_data.cpuid % BRLOCK_SLOTS;
+		std::atomic<size_t>& readers = block->slots[slot].readers;
+		while (true)
+		{
+			//Locked add orders our count before the writer check, pairs with the writer's sweep
+			readers.fetch_add(1);
+			if (block->writer.load(std::memory_order_acquire) == 0)
+				break;
+			readers.fetch_sub(1);
+			while (block->writer.load(std::memory_order_relaxed) != 0)
+				arch_pause();
+		}
+		return BRLOCK_READER | slot;
+	}
+}
+EXTERN CHAIKRNL_FUNC void BigReaderLockRelease(brlock_t lock, cpu_status_t status)
+{
+	brlock* block = (brlock*)lock;
+	if (status & BRLOCK_READER)
+	{
+		block->slots[status & ~BRLOCK_READER].readers.fetch_sub(1, std::memory_order_release);
+	}
+	else
+	{
+		block->writer.store(0, std::memory_order_release);
+		arch_restore_state(status);
+	}
+}
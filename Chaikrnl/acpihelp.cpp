@@ -11,6 +11,9 @@
 #include <pciexpress.h>
 #include <scheduler.h>
 #include <semaphore.h>
+#include <mutex.h>
+#include <redblack.h>
+#include <linkedlist.h>
 
 static void* RSDP = 0;
 static acpi_system_timer sys_timer = nullptr;
@@ -25,8 +28,36 @@ void set_acpi_timer(acpi_system_timer timer)
 	sys_timer = timer;
 }
 
+//Mappings handed to ACPICA, kept once unmapped so tables and operation regions aren't remapped on every access
+struct acpi_mapping {
+	paddr_t base;
+	size_t length;
+	void* vaddr;
+	size_t refs;
+	//Still the mapping handed out for base, rather than one a longer mapping replaced
+	bool cached;
+	linked_list_node<acpi_mapping*> lrunode;
+};
+
+static linked_list_node<acpi_mapping*>& get_mapping_node(acpi_mapping* map)
+{
+	return map->lrunode;
+}
+
+//Unreferenced mappings kept for reuse
+static const size_t ACPI_MAP_CACHE_IDLE = 32;
+
+static spinlock_t acpi_map_lock = nullptr;
+static lock_class_key acpi_map_lock_key = { "acpi_map" };
+static RedBlackTree<paddr_t, acpi_mapping*> acpi_maps_by_phys;
+static RedBlackTree<size_t, acpi_mapping*> acpi_maps_by_virt;
+//Least recently used first
+static LinkedList<acpi_mapping*> acpi_idle_maps;
+
 void start_acpi_tables()
 {
+	acpi_map_lock = create_spinlock_class(&acpi_map_lock_key);
+	acpi_idle_maps.init(&get_mapping_node);
 	ACPI_STATUS Status;
 	Status = AcpiInitializeSubsystem();
 	if (ACPI_FAILURE(Status))
@@ -105,20 +136,104 @@ CHAIKRNL_FUNC ACPI_STATUS AcpiOsPhysicalTableOverride(ACPI_TABLE_HEADER *Existin
 	*NewTableLength = 0;
 	return AE_OK;
 }
+static void release_mapping(acpi_mapping* map)
+{
+	paging_free(map->vaddr, map->length, false);
+	delete map;
+}
+
 CHAIKRNL_FUNC void *AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS PhysicalAddress, ACPI_SIZE Length)
 {
 	//Handle unaligned addresses
 	size_t align_off = PhysicalAddress & (PAGESIZE - 1);
-	void* loc = find_free_paging(Length + align_off);
-	if (!paging_map(loc, PhysicalAddress - align_off, Length + align_off, PAGE_ATTRIBUTE_WRITABLE))
+	paddr_t base = PhysicalAddress - align_off;
+	size_t length = DIV_ROUND_UP(Length + align_off, PAGESIZE) * PAGESIZE;
+	auto st = acquire_spinlock(acpi_map_lock);
+	auto it = acpi_maps_by_phys.find(base);
+	if (it != acpi_maps_by_phys.end() && it->second->length >= length)
+	{
+		acpi_mapping* map = it->second;
+		if (map->refs++ == 0)
+			acpi_idle_maps.remove(map);
+		release_spinlock(acpi_map_lock, st);
+		return raw_offset<void*>(map->vaddr, align_off);
+	}
+	release_spinlock(acpi_map_lock, st);
+
+	void* loc = find_free_paging(length);
+	if (!paging_map(loc, base, length, PAGE_ATTRIBUTE_WRITABLE))
 	{
 		return nullptr;
 	}
+	acpi_mapping* map = new acpi_mapping;
+	map->base = base;
+	map->length = length;
+	map->vaddr = loc;
+	map->refs = 1;
+	map->cached = true;
+
+	acpi_mapping* stale = nullptr;
+	st = acquire_spinlock(acpi_map_lock);
+	it = acpi_maps_by_phys.find(base);
+	if (it != acpi_maps_by_phys.end())
+	{
+		acpi_mapping* existing = it->second;
+		if (existing->length >= length)
+		{
+			//Lost a race with another mapping of the same range
+			if (existing->refs++ == 0)
+				acpi_idle_maps.remove(existing);
+			release_spinlock(acpi_map_lock, st);
+			release_mapping(map);
+			return raw_offset<void*>(existing->vaddr, align_off);
+		}
+		//Too short. Ours takes its place, it goes when its last user unmaps
+		existing->cached = false;
+		if (existing->refs == 0)
+		{
+			acpi_idle_maps.remove(existing);
+			acpi_maps_by_virt.remove((size_t)existing->vaddr);
+			stale = existing;
+		}
+	}
+	acpi_maps_by_phys[base] = map;
+	acpi_maps_by_virt[(size_t)loc] = map;
+	release_spinlock(acpi_map_lock, st);
+	if (stale)
+		release_mapping(stale);
 	return raw_offset<void*>(loc, align_off);
 }
 CHAIKRNL_FUNC void AcpiOsUnmapMemory(void *where, ACPI_SIZE length)
 {
-	paging_free(where, length, false);
+	size_t vbase = (size_t)where & ~(size_t)(PAGESIZE - 1);
+	acpi_mapping* evict = nullptr;
+	auto st = acquire_spinlock(acpi_map_lock);
+	auto it = acpi_maps_by_virt.find(vbase);
+	if (it == acpi_maps_by_virt.end())
+	{
+		release_spinlock(acpi_map_lock, st);
+		return;
+	}
+	acpi_mapping* map = it->second;
+	if (--map->refs == 0)
+	{
+		if (map->cached)
+		{
+			acpi_idle_maps.insert(map);
+			if (acpi_idle_maps.length() > ACPI_MAP_CACHE_IDLE)
+			{
+				evict = acpi_idle_maps.pop();
+				acpi_maps_by_phys.remove(evict->base);
+			}
+		}
+		else
+			evict = map;
+		if (evict)
+			acpi_maps_by_virt.remove((size_t)evict->vaddr);
+	}
+	release_spinlock(acpi_map_lock, st);
+	if (evict)
+		release_mapping(evict);
 }
 CHAIKRNL_FUNC ACPI_STATUS AcpiOsGetPhysicalAddress(void *LogicalAddress, ACPI_PHYSICAL_ADDRESS *PhysicalAddress)
 {
@@ -178,19 +293,31 @@ CHAIKRNL_FUNC void AcpiOsStall(UINT32 Microseconds)
 
 CHAIKRNL_FUNC ACPI_STATUS AcpiOsCreateMutex(ACPI_MUTEX *OutHandle)
 {
-	return AcpiOsCreateSemaphore(1, 1, OutHandle);
+	*OutHandle = create_mutex();
+	if (!*OutHandle)
+		return AE_NO_MEMORY;
+	return AE_OK;
 }
 CHAIKRNL_FUNC void AcpiOsDeleteMutex(ACPI_MUTEX Handle)
 {
-	delete_semaphore(Handle);
+	delete_mutex(Handle);
 }
 CHAIKRNL_FUNC ACPI_STATUS AcpiOsAcquireMutex(ACPI_MUTEX Handle, UINT16 Timeout)
 {
-	return AcpiOsWaitSemaphore(Handle, 1, Timeout);
+	if (!Handle)
+		return AE_BAD_PARAMETER;
+	size_t tout = Timeout;
+	if (Timeout == UINT16_MAX)
+		tout = TIMEOUT_INFINITY;
+	if (acquire_mutex(Handle, tout) == 1)
+		return AE_OK;
+	else
+		return AE_TIME;
 }
 CHAIKRNL_FUNC void AcpiOsReleaseMutex(ACPI_MUTEX Handle)
 {
-	AcpiOsSignalSemaphore(Handle, 1);
+	if (Handle)
+		release_mutex(Handle);
 }
 
 CHAIKRNL_FUNC ACPI_STATUS AcpiOsCreateSemaphore(UINT32 MaxUnits, UINT32 InitialUnits, ACPI_SEMAPHORE *OutHandle)
@@ -3,6 +3,8 @@
 #include <kstdio.h>
 #include <string.h>
 #include <spinlock.h>
+#include <xcall.h>
+#include <chaiatomic.h>
 
 static void* pml4ptr = 0;
 static size_t recursive_slot = 0;
@@ -74,6 +76,7 @@ static short PatIndex(PAT_VALUE val)
 }
 
 spinlock_t paging_lock;
+static lock_class_key paging_lock_key = { "paging" };
 
 static void* make_canonical(size_t addr)
 {
@@ -354,16 +357,147 @@ EXTERN bool paging_map(void* vaddr, paddr_t paddr, size_t length, size_t attribu
 	return true;
 }
 
+//Enough for every processor ID xcall can address
+static const size_t SHOOTDOWN_MAX_CPUS = 256;
+#define RFLAGS_IF 0x200
+
+struct tlb_shootdown {
+	void* start;
+	size_t pages;
+	//CPUs yet to flush
+	std::atomic<size_t> pending;
+	//Frames to free once every CPU has flushed, null if there are none
+	paddr_t* frames;
+	tlb_shootdown* next;
+};
+
+//Shootdowns posted by callers that couldn't wait. Reaped by a later paging_free that can
+static std::atomic<tlb_shootdown*> deferred_shootdowns;
+
+static void invalidate_range(void* param)
+{
+	tlb_shootdown* sd = (tlb_shootdown*)param;
+	for (size_t n = 0; n < sd->pages; ++n)
+		arch_flush_tlb(raw_offset<void*>(sd->start, n * PAGESIZE));
+	sd->pending.fetch_sub(1, std::memory_order_release);
+}
+
+//Queues the flush on every online CPU, this one included. One IPI per CPU whose queue was idle
+static void post_shootdown(tlb_shootdown* sd)
+{
+	uint32_t ids[SHOOTDOWN_MAX_CPUS];
+	size_t count = xcall_online_cpu_ids(ids, SHOOTDOWN_MAX_CPUS);
+	if (count == 0)
+	{
+		//Early boot, only this CPU is running
+		sd->pending.store(1, std::memory_order_relaxed);
+		auto st = arch_disable_interrupts();
+		invalidate_range(sd);
+		arch_restore_state(st);
+		return;
+	}
+	sd->pending.store(count, std::memory_order_relaxed);
+	for (size_t n = 0; n < count; ++n)
+	{
+		if (!xcall_async(ids[n], &invalidate_range, sd))
+			sd->pending.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+static void free_shootdown(tlb_shootdown* sd)
+{
+	if (sd->frames)
+	{
+		for (size_t n = 0; n < sd->pages; ++n)
+			pmmngr_free(sd->frames[n], 1);
+		delete[] sd->frames;
+	}
+	delete sd;
+}
+
+static void reap_shootdowns()
+{
+	tlb_shootdown* list = deferred_shootdowns.exchange(nullptr, std::memory_order_acquire);
+	while (list)
+	{
+		tlb_shootdown* sd = list;
+		list = list->next;
+		if (sd->pending.load(std::memory_order_acquire) == 0)
+		{
+			free_shootdown(sd);
+			continue;
+		}
+		sd->next = deferred_shootdowns.load(std::memory_order_relaxed);
+		while (!deferred_shootdowns.compare_exchange_weak(sd->next, sd, std::memory_order_release));
+	}
+}
+
+//Posts a flush of the range and hands its frames to the deferred list, for callers that mustn't wait
+static bool defer_shootdown(PTAB_ENTRY* ptab, size_t first, void* vaddr, size_t pages, bool free_physical)
+{
+	tlb_shootdown* sd = new tlb_shootdown;
+	if (!sd)
+		return false;
+	sd->frames = nullptr;
+	if (free_physical)
+	{
+		sd->frames = new paddr_t[pages];
+		if (!sd->frames)
+		{
+			delete sd;
+			return false;
+		}
+	}
+	sd->start = vaddr;
+	sd->pages = pages;
+	for (size_t offset = 0; offset < pages; ++offset)
+	{
+		PTAB_ENTRY& entry = ptab[first + offset];
+		if (free_physical)
+			sd->frames[offset] = get_paddr(entry);
+		entry = 0;
+	}
+	post_shootdown(sd);
+	sd->next = deferred_shootdowns.load(std::memory_order_relaxed);
+	while (!deferred_shootdowns.compare_exchange_weak(sd->next, sd, std::memory_order_release));
+	return true;
+}
+
 EXTERN void paging_free(void* vaddr, size_t length, bool free_physical)
 {
 	PTAB_ENTRY* ptab = getPTAB(vaddr);
-	for (size_t index = getPTABindex(vaddr), offset = 0; offset < (length + PAGESIZE - 1) / PAGESIZE; ++index, ++offset)
+	size_t pages = (length + PAGESIZE - 1) / PAGESIZE;
+	size_t first = getPTABindex(vaddr);
+	for (size_t offset = 0; offset < pages; ++offset)
+		ptab[first + offset] &= ~(PTAB_ENTRY)PAGING_PRESENT;
+	//Other CPUs may have the old mappings cached. Waiting for them with interrupts off can deadlock:
+	//we might hold a spinlock one of them is spinning on with its interrupts off. So only wait when interrupts are on
+	cpu_status_t st = arch_disable_interrupts();
+	arch_restore_state(st);
+	bool can_wait = (st & RFLAGS_IF) != 0;
+	if (can_wait)
+		reap_shootdowns();
+	else if (defer_shootdown(ptab, first, vaddr, pages, free_physical))
+		return;
+	//Out of memory for a deferred shootdown falls through to waiting, as before
+	tlb_shootdown sd;
+	sd.start = vaddr;
+	sd.pages = pages;
+	sd.frames = nullptr;
+	post_shootdown(&sd);
+	while (sd.pending.load(std::memory_order_acquire) != 0)
+	{
+		//Another CPU may be waiting on us in turn
+		xcall_poll();
+		arch_pause();
+	}
+	//Only now is nobody still using the frames
+	for (size_t offset = 0; offset < pages; ++offset)
 	{
-		paddr_t paddr = ptab[index] & (SIZE_MAX - 0xFFF);
-		ptab[index] = 0;
-		arch_flush_tlb(raw_offset<void*>(vaddr, index * PAGESIZE));
+		PTAB_ENTRY& entry = ptab[first + offset];
 		if (free_physical)
-			pmmngr_free(paddr, length);
+			pmmngr_free(get_paddr(entry), 1);
+		entry = 0;
 	}
 }
 
@@ -507,7 +641,7 @@ void paging_initialize(void*& info)
 	recursive_slot = pinfo->recursive_slot;
 	pml4ptr = pinfo->pml4ptr;
 
-	paging_lock = create_spinlock();
+	paging_lock = create_spinlock_class(&paging_lock_key);
 }
 
 void paging_boot_free()
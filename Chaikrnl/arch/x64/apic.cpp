@@ -5,6 +5,7 @@
 #include <acpi.h>
 #include <redblack.h>
 #include <scheduler.h>
+#include <xcall.h>
 
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_MSR_BSP 0x100 // Processor is a BSP
@@ -73,6 +74,7 @@ static void write_apic_register(uint16_t reg, uint64_t value)
 			*reg_next_addr = high_part;
 			arch_memory_barrier();
 			*reg_addr = low_part;
+			return;
 		}
 		volatile uint32_t* reg_addr = raw_offset<volatile uint32_t*>(apic, reg << 4);
 		*reg_addr = value;
@@ -97,10 +99,14 @@ bool x2apic_supported()
 	return (c & (1 << 21)) != 0;
 }
 
-uint32_t arch_current_processor_id()
+static uint32_t read_apic_id()
 {
 	size_t a, b, c, d;
-	if (x2apic_supported())
+	//CPUID is serialising, don't ask twice
+	static int8_t x2apic = -1;
+	if (x2apic < 0)
+		x2apic = x2apic_supported() ? 1 : 0;
+	if (x2apic)
 	{
 		x64_cpuid(0xB, &a, &b, &c, &d);
 		return d;
@@ -112,6 +118,14 @@ uint32_t arch_current_processor_id()
 	}
 }
 
+uint32_t arch_current_processor_id()
+{
+	uint32_t id = pcpu_data.cpuid;
+	if (id != PCPU_ID_UNSET)
+		return id;
+	return read_apic_id();
+}
+
 static volatile uint64_t pit_ticks = 0;
 
 uint64_t arch_get_system_timer()
@@ -139,6 +153,12 @@ static uint8_t apic_spurious_interrupt(size_t vector, void* param)
 	return 1;
 }
 
+static uint8_t apic_xcall_interrupt(size_t vector, void* param)
+{
+	xcall_interrupt();
+	return 1;
+}
+
 struct ioapic_desc {
 	uint32_t apic_id;
 	uint32_t base_intr;
@@ -350,6 +370,25 @@ void Stall(uint32_t milliseconds)
 	while (arch_get_system_timer() - current < milliseconds);
 }
 
+#define ICR_DELIVERY_ASSERT 0x4000
+#define ICR_SHORTHAND_ALL_EXCLUDING_SELF (3 << 18)
+
+void arch_send_ipi(uint32_t processor, uint32_t vector)
+{
+	//The xAPIC ICR is two writes, which an interrupt sending its own IPI would tear
+	auto st = arch_disable_interrupts();
+	if (!x2apic)
+	{
+		while (icr_busy())
+			arch_pause();
+	}
+	if (processor == (uint32_t)INTERRUPT_ALLCPUS)
+		write_apic_register(LAPIC_REGISTER_ICR, ICR_SHORTHAND_ALL_EXCLUDING_SELF | ICR_DELIVERY_ASSERT | vector);
+	else
+		write_apic_register(LAPIC_REGISTER_ICR, icr_dest(processor) | ICR_DELIVERY_ASSERT | vector);
+	arch_restore_state(st);
+}
+
 uint8_t arch_startup_cpu(uint32_t processor, void* address, volatile size_t* rendezvous, size_t rval)
 {
 	//Send INIT IPI
@@ -474,6 +513,10 @@ void x64_init_apic()
 	write_apic_register(LAPIC_REGISTER_LVT_TIMER, tmrreg);
 	write_apic_register(LAPIC_REGISTER_TMRINITCNT, 0x2000);
 #endif
+	//Cross-calls. The handler goes in first, other CPUs may send to us as soon as our queue is published
+	arch_register_interrupt_handler(INTERRUPT_SUBSYSTEM_DISPATCH, IPI_VECTOR_XCALL, INTERRUPT_CURRENTCPU, &apic_xcall_interrupt, nullptr);
+	arch_install_interrupt_post_event(INTERRUPT_SUBSYSTEM_DISPATCH, IPI_VECTOR_XCALL, INTERRUPT_CURRENTCPU, &apic_eoi);
+	xcall_cpu_init();
 	//
 	if (arch_is_bsp())
 	{
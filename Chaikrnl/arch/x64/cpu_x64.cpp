@@ -4,6 +4,9 @@
 #include <arch/paging.h>
 #include <string.h>
 #include <scheduler.h>
+#include <stddef.h>
+#include <intrin.h>
+#include <percpu.h>
 
 extern "C" size_t x64_read_cr0();
 extern "C" size_t x64_read_cr2();
@@ -348,6 +351,17 @@ static void x64_performance_features()
 
 extern uint64_t x64paging_get_PAT_value();
 
+struct dispatch_table;
+//Full per-CPU block, the public part must stay first
+struct arch_per_cpu_data {
+	per_cpu_data public_data;
+	uint8_t* interruptsavailmap;
+	dispatch_table* dispatch;
+};
+
+//Shared by every CPU from arch_cpu_init until it has its own. Full size, so reads of the arch fields find nullptr
+static arch_per_cpu_data boot_cpu_data;
+
 extern "C" void arch_cpu_init()
 {
 	size_t cr0 = x64_read_cr0();
@@ -369,6 +383,10 @@ extern "C" void arch_cpu_init()
 	x64_lgdt(&the_gdtr);	//Load new GDT
 	//Reload segment registers for the new GDT
 	load_default_sregs();
+	//Per-CPU data reads go to the shared boot block until arch_setup_interrupts
+	boot_cpu_data.public_data.cpu_data = &boot_cpu_data.public_data;
+	boot_cpu_data.public_data.cpu_id = PCPU_ID_UNSET;
+	x64_wrmsr(MSR_IA32_FS_BASE, (size_t)&boot_cpu_data);
 	//Enable SSE if supported
 	size_t a, b, c, d;
 	size_t max_cpuid = max_cpuid_page();
@@ -591,6 +609,7 @@ enum wanted_info {
 	wanted_linesize,
 	wanted_cachesize,
 	wanted_associativity,
+	wanted_sharing,
 	wanted_iterate
 };
 static size_t read_nice_pages(uint8_t cache_level, ARCH_CACHE_TYPE type, CpuVendor vendor, wanted_info info, cpu_cache_callback callback)
@@ -652,6 +671,8 @@ static size_t read_nice_pages(uint8_t cache_level, ARCH_CACHE_TYPE type, CpuVend
 			return linesize;
 		case wanted_associativity:
 			return fullyassociative ? CACHE_FULLY_ASSOCIATIVE : associativity;
+		case wanted_sharing:
+			return ((a >> 14) & 0xFFF) + 1;
 		}
 	}
 	return 0;
@@ -781,6 +802,66 @@ size_t iterate_cpu_caches(cpu_cache_callback callback)
 	return cache_info_dispatch(0, CACHE_TYPE_UNKNOWN, wanted_iterate, callback);
 }
 
+size_t cpu_get_cache_sharing(uint8_t cache_level, ARCH_CACHE_TYPE type)
+{
+	return cache_info_dispatch(cache_level, type, wanted_sharing);
+}
+
+static uint8_t id_bits(size_t count)
+{
+	uint8_t bits = 0;
+	while ((1ui64 << bits) < count)
+		++bits;
+	return bits;
+}
+
+void arch_get_topology_shifts(arch_topology_shifts* shifts)
+{
+	size_t a, b, c, d;
+	shifts->smt_shift = 0;
+	shifts->package_shift = 0;
+	//Extended topology: each level gives the shift to the next one up
+	size_t leaf = max_cpuid_page() >= 0x1F ? 0x1F : 0xB;
+	if (max_cpuid_page() >= leaf)
+	{
+		x64_cpuid(leaf, &a, &b, &c, &d, 0);
+		if (b != 0)
+		{
+			for (size_t level = 0; ; ++level)
+			{
+				x64_cpuid(leaf, &a, &b, &c, &d, level);
+				size_t type = (c >> 8) & 0xFF;
+				if (type == 0)
+					break;
+				if (type == 1)
+					shifts->smt_shift = a & 0x1F;
+				shifts->package_shift = a & 0x1F;
+			}
+			return;
+		}
+	}
+	if (max_cpuid_page() < 1)
+		return;
+	x64_cpuid(1, &a, &b, &c, &d);
+	//No HTT flag means one thread per package
+	if ((d & (1 << 28)) == 0)
+		return;
+	size_t logical = (b >> 16) & 0xFF;
+	size_t cores = 1;
+	if (getCpuVendor() == VENDOR_INTEL && max_cpuid_page() >= 4)
+	{
+		x64_cpuid(4, &a, &b, &c, &d, 0);
+		cores = ((a >> 26) & 0x3F) + 1;
+	}
+	else if (getCpuVendor() == VENDOR_AMD && max_cpuid_page_extended() >= 0x80000008)
+	{
+		x64_cpuid(0x80000008, &a, &b, &c, &d);
+		cores = (c & 0xFF) + 1;
+	}
+	shifts->package_shift = id_bits(logical);
+	shifts->smt_shift = logical > cores ? id_bits(logical / cores) : 0;
+}
+
 void arch_set_paging_root(size_t root)
 {
 	x64_write_cr3(root);
@@ -836,14 +917,27 @@ static void register_irq(IDT* entry, void* fn)
 static RedBlackTree<uint32_t, arch_interrupt_subsystem*> interrupt_subsystems;
 
 extern "C" extern void* default_irq_handlers[];
+//One handler on a vector. Handlers added with arch_register_shared_interrupt_handler chain off the table slot
 struct dispatch_data {
-	void* func;
+	dispatch_interrupt_handler func;
 	void* param;
+	dispatch_data* volatile next;
+};
+//Per CPU, indexed by vector and reached through the per-CPU data, so entry is two loads
+struct dispatch_slot {
+	dispatch_data handler;
 	void(*post_event)();
+	//Only written by the owning CPU with interrupts off
+	uint64_t count;
+	uint64_t ticks;
+};
+struct dispatch_table {
+	dispatch_slot slots[256];
 };
-typedef RedBlackTree<uint32_t, dispatch_data*> dispatch_tree;
-typedef dispatch_tree* cpu_dispatch;
-static cpu_dispatch dispatch_funcs[256] = { nullptr };
+//Only used to register for other CPUs
+static dispatch_table* volatile cpu_dispatch_tables[256] = { nullptr };
+
+static dispatch_table* current_dispatch_table();
 
 #define DBG_IRPT 0
 extern "C" void x64_interrupt_dispatcher(size_t vector, interrupt_stack_frame* istack_frame)
@@ -851,12 +945,10 @@ extern "C" void x64_interrupt_dispatcher(size_t vector, interrupt_stack_frame* i
 #if !DBG_IRPT
 	uint32_t previrql = pcpu_data.irql;
 	pcpu_data.irql = IRQL_INTERRUPT;
-	auto treeptr = dispatch_funcs[vector];
-	bool valid = (treeptr != nullptr);
-	if (valid)
-	{
-		valid = (treeptr->find(pcpu_data.cpuid) != treeptr->end());
-	}
+	//No table until arch_setup_interrupts has run on this CPU
+	dispatch_table* table = current_dispatch_table();
+	dispatch_slot* slot = table ? &table->slots[vector & 0xFF] : nullptr;
+	bool valid = (slot && slot->handler.func != nullptr);
 #else
 	kputsWnd(u"Unknown Interrupt", NULL);
 	while (1);
@@ -882,14 +974,19 @@ extern "C" void x64_interrupt_dispatcher(size_t vector, interrupt_stack_frame* i
 		while (1);
 	}
 #if !DBG_IRPT
-	dispatch_data* dispdata = (*treeptr)[pcpu_data.cpuid];
-	dispatch_interrupt_handler handler = reinterpret_cast<dispatch_interrupt_handler>(dispdata->func);
-	void* param = dispdata->param;
-	if (!param)
-		param = istack_frame;
-	handler(vector, param);
-	if (dispdata->post_event)
-		dispdata->post_event();
+	uint64_t start = arch_get_cpu_ticks();
+	//Every handler on a shared vector gets a look, level triggered sources stay asserted otherwise
+	for (dispatch_data* dispdata = &slot->handler; dispdata; dispdata = dispdata->next)
+	{
+		void* param = dispdata->param;
+		if (!param)
+			param = istack_frame;
+		dispdata->func(vector, param);
+	}
+	++slot->count;
+	slot->ticks += arch_get_cpu_ticks() - start;
+	if (slot->post_event)
+		slot->post_event();
 	pcpu_data.irql = previrql;
 #endif
 }
@@ -932,6 +1029,13 @@ static arch_interrupt_subsystem subsystem_native
 	&register_native_postevt
 };
 
+static dispatch_table* target_dispatch_table(uint32_t processor)
+{
+	if (processor == INTERRUPT_CURRENTCPU || processor == pcpu_data.cpuid)
+		return current_dispatch_table();
+	return cpu_dispatch_tables[processor & 0xFF];
+}
+
 void register_dispatch_irq(size_t vector, uint32_t processor, void* fn, void* param)
 {
 	uint32_t cpuid = pcpu_data.cpuid;
@@ -944,28 +1048,63 @@ void register_dispatch_irq(size_t vector, uint32_t processor, void* fn, void* pa
 	{
 		arch_reserve_interrupt_range(vector, vector);
 	}
-	dispatch_tree*& disptree = dispatch_funcs[vector];
-	if (!disptree)
-		disptree = new dispatch_tree;
-	dispatch_data* disp;
-	if (disptree->find(cpuid) == disptree->end())
-		disp = (*disptree)[cpuid] = new dispatch_data;
-	else
-		disp = (*disptree)[cpuid];
+	dispatch_table* table = target_dispatch_table(processor);
+	if (!table)
+		return;
+	//Replaces the vector's handler. Handlers shared onto it stay
+	dispatch_slot* slot = &table->slots[vector & 0xFF];
+	auto st = arch_disable_interrupts();
+	slot->handler.param = param;
+	slot->post_event = nullptr;
+	//Publish last, the dispatcher may already be looking at this slot
+	_ReadWriteBarrier();
+	slot->handler.func = reinterpret_cast<dispatch_interrupt_handler>(fn);
+	arch_restore_state(st);
+}
+
+CHAIKRNL_FUNC uint8_t arch_register_shared_interrupt_handler(size_t vector, uint32_t processor, dispatch_interrupt_handler fn, void* param)
+{
+	dispatch_table* table = target_dispatch_table(processor);
+	if (!table)
+		return 0;
+	dispatch_data* head = &table->slots[vector & 0xFF].handler;
+	if (!head->func)
+	{
+		register_dispatch_irq(vector, processor, (void*)fn, param);
+		return 1;
+	}
+	dispatch_data* disp = new dispatch_data;
+	if (!disp)
+		return 0;
 	disp->func = fn;
 	disp->param = param;
-	disp->post_event = nullptr;
+	disp->next = nullptr;
+	auto st = arch_disable_interrupts();
+	dispatch_data* last = head;
+	while (last->next)
+		last = last->next;
+	_ReadWriteBarrier();
+	last->next = disp;
+	arch_restore_state(st);
+	return 1;
+}
+
+CHAIKRNL_FUNC uint8_t arch_interrupt_stats(uint32_t processor, size_t vector, uint64_t* count, uint64_t* ticks)
+{
+	dispatch_table* table = cpu_dispatch_tables[processor & 0xFF];
+	if (!table || vector > 0xFF)
+		return 0;
+	*count = table->slots[vector].count;
+	*ticks = table->slots[vector].ticks;
+	return 1;
 }
 
 void register_dispatch_postevt(size_t vector, uint32_t processor, void(*evt)())
 {
-	uint32_t cpuid = pcpu_data.cpuid;
-	if (processor != cpuid && processor != INTERRUPT_CURRENTCPU)
+	dispatch_table* table = target_dispatch_table(processor);
+	if (!table)
 		return;
-	dispatch_tree*& disptree = dispatch_funcs[vector];
-	if (!disptree)
-		disptree = new dispatch_tree;
-	(*disptree)[cpuid]->post_event = evt;
+	table->slots[vector & 0xFF].post_event = evt;
 }
 
 static arch_interrupt_subsystem subsystem_dispatch
@@ -1097,17 +1236,23 @@ void arch_write_tls(uint32_t offset, uint8_t user, uint64_t value, uint8_t width
 	}
 }
 
-struct arch_per_cpu_data {
-	per_cpu_data public_data;
-	uint8_t* interruptsavailmap;
-};
-
 struct arch_tls_data {
 	arch_tls_data* selfptr;
 };
 
 static_assert(sizeof(per_cpu_data) <= 0x30, "Please reallocate");
+//Must match the offsets pcpu_data uses
+static_assert(offsetof(per_cpu_data, cpu_id) == 0x18 && offsetof(per_cpu_data, irql) == 0x1C, "Per-CPU layout mismatch");
+static_assert(offsetof(per_cpu_data, kstack) == 0x20 && offsetof(per_cpu_data, percpu_offset) == 0x28, "Per-CPU layout mismatch");
 #define PCPU_DATA_AVAILINTS 0x30
+#define PCPU_DATA_DISPATCH 0x38
+static_assert(offsetof(arch_per_cpu_data, interruptsavailmap) == PCPU_DATA_AVAILINTS, "Per-CPU layout mismatch");
+static_assert(offsetof(arch_per_cpu_data, dispatch) == PCPU_DATA_DISPATCH, "Per-CPU layout mismatch");
+
+static dispatch_table* current_dispatch_table()
+{
+	return (dispatch_table*)arch_read_per_cpu_data(PCPU_DATA_DISPATCH, 64);
+}
 
 void arch_write_kstack(stack_t stack)
 {
@@ -1149,7 +1294,10 @@ void arch_setup_interrupts()
 	x64_ltr(SEGVAL(GDT_ENTRY_TSS, 3));
 	//Create per-cpu structure
 	arch_per_cpu_data* cpu_data = new arch_per_cpu_data;
+	memset(cpu_data, 0, sizeof(arch_per_cpu_data));
 	cpu_data->public_data.cpu_data = &cpu_data->public_data;
+	//So arch_current_processor_id asks the hardware for the ID to cache
+	cpu_data->public_data.cpu_id = PCPU_ID_UNSET;
 	//Hidden per CPU interrupt vector map
 	uint8_t* interruptsavailmap = new uint8_t[256 / 8];
 	memset(interruptsavailmap, 0xFF, 256 / 8);
@@ -1158,7 +1306,12 @@ void arch_setup_interrupts()
 	x64_wrmsr(MSR_IA32_KERNELGS_BASE, 0);
 	pcpu_data.cpuid = arch_current_processor_id();
 	pcpu_data.runningthread = 0;
+	percpu_setup_cpu();
 	arch_write_per_cpu_data(PCPU_DATA_AVAILINTS, 64, (size_t)interruptsavailmap);
+	dispatch_table* dispatch = new dispatch_table;
+	memset(dispatch, 0, sizeof(dispatch_table));
+	cpu_dispatch_tables[pcpu_data.cpuid & 0xFF] = dispatch;
+	arch_write_per_cpu_data(PCPU_DATA_DISPATCH, 64, (size_t)dispatch);
 	pcpu_data.irql = IRQL_KERNEL;
 	//Setup an IDT. We maintain a seperate IDT for each CPU, so allocation is dynamic
 	IDT* the_idt = new IDT[256];
@@ -1248,6 +1401,21 @@ end:
 	arch_restore_state(st);
 	return ret;
 }
+CHAIKRNL_FUNC void arch_free_interrupt_vector(uint32_t vector)
+{
+	auto st = arch_disable_interrupts();
+	dispatch_table* table = current_dispatch_table();
+	uint8_t* availints = (uint8_t*)arch_read_per_cpu_data(PCPU_DATA_AVAILINTS, 64);
+	if (table && availints && vector < 256)
+	{
+		dispatch_slot* slot = &table->slots[vector];
+		slot->handler.func = nullptr;
+		slot->handler.param = nullptr;
+		slot->post_event = nullptr;
+		availints[vector / 8] |= (1 << (vector % 8));
+	}
+	arch_restore_state(st);
+}
 CHAIKRNL_FUNC void arch_reserve_interrupt_range(uint32_t start, uint32_t end)
 {
 	auto st = arch_disable_interrupts();		//So we don't get interfered with
@@ -0,0 +1,12 @@
+#include <chaiatomic.h>
+#include <waitaddr.h>
+
+EXTERN CHAIKRNL_FUNC void atomic_wait_address(volatile void* addr, const void* expected, size_t size)
+{
+	wait_on_address(addr, expected, size, TIMEOUT_INFINITY);
+}
+
+EXTERN CHAIKRNL_FUNC void atomic_notify_address(volatile void* addr, BOOL all)
+{
+	wake_address(addr, all ? WAKE_ALL : 1);
+}
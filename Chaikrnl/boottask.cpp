@@ -0,0 +1,118 @@
+#include <boottask.h>
+#include <scheduler.h>
+#include <spinlock.h>
+#include <waitaddr.h>
+#include <redblack.h>
+#include <chaiatomic.h>
+
+static const size_t BOOT_CAP_BITS = sizeof(boot_cap_t) * 8;
+
+struct boot_task {
+	boot_task_registration reg;
+	bool started;
+};
+
+static spinlock_t boot_lock = nullptr;
+static lock_class_key boot_lock_key = { "boot_tasks" };
+static RedBlackTree<size_t, boot_task*> boot_tasks;
+static size_t boot_task_count = 0;
+//Unfinished providers of each capability
+static size_t providers[BOOT_CAP_BITS] = { 0 };
+static std::atomic<boot_cap_t> caps_up;
+static bool graph_running = false;
+
+void boottask_init()
+{
+	boot_lock = create_spinlock_class(&boot_lock_key);
+}
+
+static void start_ready_tasks();
+
+static void boot_task_thread(void* param)
+{
+	boot_task* task = (boot_task*)param;
+	task->reg.proc(task->reg.param);
+	auto st = acquire_spinlock(boot_lock);
+	boot_cap_t up = caps_up.load();
+	for (size_t bit = 0; bit < BOOT_CAP_BITS; ++bit)
+	{
+		if ((task->reg.provides & (1u << bit)) && --providers[bit] == 0)
+			up |= (1u << bit);
+	}
+	caps_up.store(up);
+	release_spinlock(boot_lock, st);
+	wake_address(&caps_up, WAKE_ALL);
+	start_ready_tasks();
+}
+
+//Threads are created outside the lock, one ready task at a time
+static void start_ready_tasks()
+{
+	while (true)
+	{
+		boot_task* ready = nullptr;
+		auto st = acquire_spinlock(boot_lock);
+		boot_cap_t up = caps_up.load();
+		for (auto it = boot_tasks.begin(); it != boot_tasks.end(); ++it)
+		{
+			boot_task* task = it->second;
+			if (!task->started && (task->reg.depends & ~up) == 0)
+			{
+				task->started = true;
+				ready = task;
+				break;
+			}
+		}
+		release_spinlock(boot_lock, st);
+		if (!ready)
+			return;
+		create_thread(&boot_task_thread, ready, THREAD_PRIORITY_NORMAL, KERNEL_TASK);
+	}
+}
+
+EXTERN CHAIKRNL_FUNC void register_boot_task(const boot_task_registration* reg)
+{
+	boot_task* task = new boot_task;
+	task->reg = *reg;
+	task->started = false;
+	auto st = acquire_spinlock(boot_lock);
+	boot_cap_t up = caps_up.load();
+	for (size_t bit = 0; bit < BOOT_CAP_BITS; ++bit)
+	{
+		//A capability never goes back down once it's up
+		if ((reg->provides & (1u << bit)) && !(up & (1u << bit)))
+			++providers[bit];
+	}
+	boot_tasks[boot_task_count++] = task;
+	bool running = graph_running;
+	release_spinlock(boot_lock, st);
+	if (running)
+		start_ready_tasks();
+}
+
+void run_boot_tasks()
+{
+	auto st = acquire_spinlock(boot_lock);
+	boot_cap_t up = 0;
+	for (size_t bit = 0; bit < BOOT_CAP_BITS; ++bit)
+	{
+		if (providers[bit] == 0)
+			up |= (1u << bit);
+	}
+	caps_up.store(up);
+	graph_running = true;
+	release_spinlock(boot_lock, st);
+	wake_address(&caps_up, WAKE_ALL);
+	start_ready_tasks();
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t boot_wait_capabilities(boot_cap_t caps, size_t timeout)
+{
+	boot_cap_t current;
+	while (((current = caps_up.load()) & caps) != caps)
+	{
+		if (!wait_on_address(&caps_up, &current, sizeof(boot_cap_t), timeout))
+			return 0;
+	}
+	return 1;
+}
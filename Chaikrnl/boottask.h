@@ -0,0 +1,50 @@
+#ifndef CHAIOS_BOOTTASK_H
+#define CHAIOS_BOOTTASK_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+/*
+Boot phase task graph. Each task declares the capabilities it depends on and those it provides, and runs on its own thread once everything it depends on is up.
+A capability is up when every task providing it has finished, or from the start if nothing provides it. Tasks in a dependency cycle never run.
+Boot drivers register their tasks from their entry points, which all run before the graph is started.
+*/
+typedef uint32_t boot_cap_t;
+
+#define BOOT_CAP_DISPLAY 0x1
+#define BOOT_CAP_PCI 0x2
+#define BOOT_CAP_USB 0x4
+#define BOOT_CAP_INPUT 0x8
+#define BOOT_CAP_BLOCK 0x10
+#define BOOT_CAP_FILESYSTEM 0x20
+#define BOOT_CAP_NETWORK 0x40
+
+typedef void(*boot_task_proc)(void* param);
+
+typedef struct _boot_task_registration {
+	const char16_t* name;
+	boot_task_proc proc;
+	void* param;
+	boot_cap_t depends;
+	boot_cap_t provides;
+}boot_task_registration;
+
+#ifdef __cplusplus
+void boottask_init();
+//Starts every task whose dependencies are up. Tasks registered later start as soon as they can
+void run_boot_tasks();
+#endif
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+CHAIKRNL_FUNC void register_boot_task(const boot_task_registration* task);
+//Returns 0 on timeout
+CHAIKRNL_FUNC uint8_t boot_wait_capabilities(boot_cap_t caps, size_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
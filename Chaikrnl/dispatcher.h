@@ -0,0 +1,41 @@
+#ifndef CHAIOS_DISPATCHER_H
+#define CHAIOS_DISPATCHER_H
+
+#include <stdheaders.h>
+#include <spinlock.h>
+#include <linkedlist.h>
+#include <chaiatomic.h>
+
+/*
+Common header for objects wait_multiple can sleep on, which must be their first member.
+Each wait_multiple caller hangs a wait block on every object it waits for. Signalling an object pokes those callers, who then retry every object.
+*/
+struct dispatch_header;
+struct wait_block;
+
+struct dispatch_ops {
+	//Whether acquire would succeed, without consuming anything
+	bool(*ready)(dispatch_header* hdr);
+	//Consumes one signal if there is one
+	bool(*acquire)(dispatch_header* hdr);
+	//Gives back a signal taken by acquire, when a wait for all objects falls through
+	void(*unacquire)(dispatch_header* hdr);
+	//System time at which the object signals itself, or UINT64_MAX. May be null
+	uint64_t(*deadline)(dispatch_header* hdr);
+};
+
+struct dispatch_header {
+	const dispatch_ops* ops;
+	std::atomic<size_t> watchers;
+	spinlock_t watch_lock;
+	LinkedList<wait_block*> watch_list;
+};
+
+//Class of watch_lock, for objects that have to recreate it
+extern lock_class_key dispatch_watch_key;
+bool dispatch_init(dispatch_header* hdr, const dispatch_ops* ops);
+void dispatch_destroy(dispatch_header* hdr);
+//Call after the object may have become ready
+void dispatch_signal(dispatch_header* hdr);
+
+#endif
@@ -0,0 +1,187 @@
+#include <irqstat.h>
+#include <waitobj.h>
+#include <waitaddr.h>
+#include <scheduler.h>
+#include <spinlock.h>
+#include <linkedlist.h>
+#include <chaiatomic.h>
+#include <arch/cpu.h>
+#include <kstdio.h>
+
+//Rate is measured over windows this many ms long
+static const uint64_t MODERATION_WINDOW = 10;
+
+struct irq_moderation {
+	const char16_t* name;
+	irq_poll_func poll;
+	irq_enable_func enable;
+	void* context;
+	size_t budget;
+	//Interrupts per window that switch the source to polling
+	size_t window_limit;
+	std::atomic<size_t> polling;
+	std::atomic<uint64_t> window_start;
+	std::atomic<size_t> window_count;
+	//Interrupts per second over the last full window
+	std::atomic<size_t> rate;
+	event_t wake;
+	std::atomic<size_t> stopping;
+	std::atomic<size_t> exited;
+	//Statistics
+	std::atomic<uint64_t> interrupts;
+	std::atomic<uint64_t> polls;
+	std::atomic<uint64_t> polled_work;
+	std::atomic<uint64_t> switches;
+	linked_list_node<irq_moderation*> listnode;
+};
+
+static linked_list_node<irq_moderation*>& get_moderation_node(irq_moderation* ent)
+{
+	return ent->listnode;
+}
+
+static spinlock_t sources_lock = nullptr;
+static lock_class_key sources_lock_key = { "irq_moderation" };
+static LinkedList<irq_moderation*> sources;
+
+void irqstat_init()
+{
+	sources_lock = create_spinlock_class(&sources_lock_key);
+	sources.init(&get_moderation_node);
+}
+
+static void moderation_thread(void* param)
+{
+	irq_moderation* mod = (irq_moderation*)param;
+	while (true)
+	{
+		wait_event(mod->wake, TIMEOUT_INFINITY);
+		if (mod->stopping.load())
+			break;
+		//A full budget means more is waiting. The thread is preemptible, so other work still runs
+		size_t done;
+		do {
+			done = mod->poll(mod->context, mod->budget);
+			mod->polls.fetch_add(1, std::memory_order_relaxed);
+			mod->polled_work.fetch_add(done, std::memory_order_relaxed);
+		} while (done >= mod->budget && !mod->stopping.load(std::memory_order_relaxed));
+		//Start counting afresh, or the burst that got us here switches us straight back
+		mod->window_count.store(0);
+		mod->window_start.store(arch_get_system_timer());
+		mod->polling.store(0);
+		mod->enable(mod->context, 1);
+	}
+	mod->exited.store(1);
+	wake_address(&mod->exited, WAKE_ALL);
+}
+
+EXTERN CHAIKRNL_FUNC irq_moderation_t create_irq_moderation(const char16_t* name, irq_poll_func poll, irq_enable_func enable, void* context, size_t budget, size_t threshold)
+{
+	irq_moderation* mod = new irq_moderation;
+	if (!mod)
+		return nullptr;
+	mod->name = name;
+	mod->poll = poll;
+	mod->enable = enable;
+	mod->context = context;
+	mod->budget = budget ? budget : IRQ_MODERATION_DEFAULT_BUDGET;
+	if (!threshold)
+		threshold = IRQ_MODERATION_DEFAULT_THRESHOLD;
+	mod->window_limit = threshold * MODERATION_WINDOW / 1000;
+	if (mod->window_limit == 0)
+		mod->window_limit = 1;
+	mod->polling.store(0, std::memory_order_relaxed);
+	mod->window_start.store(arch_get_system_timer(), std::memory_order_relaxed);
+	mod->window_count.store(0, std::memory_order_relaxed);
+	mod->rate.store(0, std::memory_order_relaxed);
+	mod->stopping.store(0, std::memory_order_relaxed);
+	mod->exited.store(0, std::memory_order_relaxed);
+	mod->interrupts.store(0, std::memory_order_relaxed);
+	mod->polls.store(0, std::memory_order_relaxed);
+	mod->polled_work.store(0, std::memory_order_relaxed);
+	mod->switches.store(0, std::memory_order_relaxed);
+	mod->wake = create_event(0, 0);
+	if (!mod->wake)
+	{
+		delete mod;
+		return nullptr;
+	}
+	auto st = acquire_spinlock(sources_lock);
+	sources.insert(mod);
+	release_spinlock(sources_lock, st);
+	create_thread(&moderation_thread, mod, THREAD_PRIORITY_NORMAL, DRIVER_EVENT);
+	return mod;
+}
+
+EXTERN CHAIKRNL_FUNC void delete_irq_moderation(irq_moderation_t moderation)
+{
+	irq_moderation* mod = (irq_moderation*)moderation;
+	auto st = acquire_spinlock(sources_lock);
+	sources.remove(mod);
+	release_spinlock(sources_lock, st);
+	mod->stopping.store(1);
+	set_event(mod->wake);
+	size_t running = 0;
+	while (mod->exited.load() == 0)
+		wait_on_address(&mod->exited, &running, sizeof(size_t), TIMEOUT_INFINITY);
+	delete_event(mod->wake);
+	delete mod;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t irq_moderation_interrupt(irq_moderation_t moderation)
+{
+	irq_moderation* mod = (irq_moderation*)moderation;
+	mod->interrupts.fetch_add(1, std::memory_order_relaxed);
+	//Raced with the switch to polling, the poll thread will see this work
+	if (mod->polling.load(std::memory_order_acquire))
+		return 0;
+	uint64_t now = arch_get_system_timer();
+	uint64_t start = mod->window_start.load(std::memory_order_relaxed);
+	size_t count = mod->window_count.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (now - start >= MODERATION_WINDOW)
+	{
+		//Whoever moves the window on records its rate. Vectors of one source may fire on several CPUs
+		if (mod->window_start.compare_exchange_strong(start, now, std::memory_order_relaxed))
+		{
+			mod->rate.store(count * 1000 / (size_t)(now - start), std::memory_order_relaxed);
+			mod->window_count.store(0, std::memory_order_relaxed);
+		}
+		return 1;
+	}
+	if (count < mod->window_limit)
+		return 1;
+	if (mod->polling.exchange(1) != 0)
+		return 0;
+	mod->switches.fetch_add(1, std::memory_order_relaxed);
+	mod->enable(mod->context, 0);
+	set_event(mod->wake);
+	return 0;
+}
+
+EXTERN CHAIKRNL_FUNC void irq_stats_report()
+{
+	kprintf(u"Interrupts by CPU and vector:\n");
+	for (uint32_t cpu = 0; cpu < 256; ++cpu)
+	{
+		for (size_t vector = 0; vector < 256; ++vector)
+		{
+			uint64_t count, ticks;
+			if (!arch_interrupt_stats(cpu, vector, &count, &ticks))
+				break;
+			if (count == 0)
+				continue;
+			kprintf(u"  CPU %d vector %x: %d interrupts, %d ticks (%d per interrupt)\n", cpu, vector, count, ticks, ticks / count);
+		}
+	}
+	if (!sources_lock)
+		return;
+	kprintf(u"Moderated sources:\n");
+	auto st = acquire_spinlock(sources_lock);
+	for (auto it = sources.begin(); it != sources.end(); ++it)
+	{
+		irq_moderation* mod = *it;
+		kprintf(u"  %s: %d interrupts, %d/s, %s, %d switches to polling, %d polls doing %d work\n", mod->name, mod->interrupts.load(), mod->rate.load(),
+			mod->polling.load() ? u"polling" : u"interrupts", mod->switches.load(), mod->polls.load(), mod->polled_work.load());
+	}
+	release_spinlock(sources_lock, st);
+}
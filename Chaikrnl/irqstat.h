@@ -0,0 +1,42 @@
+#ifndef CHAIOS_IRQSTAT_H
+#define CHAIOS_IRQSTAT_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+/*
+Interrupt moderation, in the style of NAPI. The driver's interrupt handler reports each interrupt here.
+While the rate stays below the threshold the handler does its work as usual. Above it the source's interrupts are turned off,
+and a poll thread calls poll with a budget until a pass comes back with less than a full budget. Interrupts are then turned back on.
+*/
+typedef void* irq_moderation_t;
+//Does up to budget units of work (packets, completions), returns how many were done
+typedef size_t(*irq_poll_func)(void* context, size_t budget);
+//Turns the device's interrupt generation on or off. Turning it on must raise an interrupt for work that arrived meanwhile
+typedef void(*irq_enable_func)(void* context, uint8_t enable);
+
+#define IRQ_MODERATION_DEFAULT_BUDGET 64
+#define IRQ_MODERATION_DEFAULT_THRESHOLD 20000
+
+#ifdef __cplusplus
+void irqstat_init();
+#endif
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+//threshold is in interrupts per second
+CHAIKRNL_FUNC irq_moderation_t create_irq_moderation(const char16_t* name, irq_poll_func poll, irq_enable_func enable, void* context, size_t budget, size_t threshold);
+CHAIKRNL_FUNC void delete_irq_moderation(irq_moderation_t moderation);
+//Call first thing in the interrupt handler. Returns 1 if the handler should do its work, 0 if polling has it
+CHAIKRNL_FUNC uint8_t irq_moderation_interrupt(irq_moderation_t moderation);
+
+//Prints interrupt counts and handler time per CPU and vector, then each moderated source
+CHAIKRNL_FUNC void irq_stats_report();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
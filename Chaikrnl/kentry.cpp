@@ -19,6 +19,10 @@
 #include <lwip/api.h>
 #include <vds.h>
 #include <vfs.h>
+#include <irqstat.h>
+#include <topology.h>
+#include <lockdep.h>
+#include <boottask.h>
 
 #define CHAIOS_KERNEL_VERSION_MAJOR 0
 #define CHAIOS_KERNEL_VERSION_MINOR 9
@@ -228,6 +232,35 @@ static void DisplayPerf(PerformanceElement& perfel, uint64_t elapsed)
 
 extern bool CallConstructors();
 
+static void pci_boot_task(void* param)
+{
+	initialize_pci_drivers();
+}
+
+static void usb_boot_task(void* param)
+{
+	pci_wait_probes(PCI_BASECLASS_SERIAL, TIMEOUT_INFINITY);
+	usb_run();
+}
+
+static void storage_boot_task(void* param)
+{
+	pci_wait_probes(PCI_BASECLASS_STORAGE, TIMEOUT_INFINITY);
+}
+
+static void filesystem_boot_task(void* param)
+{
+	vfsInit();
+	vds_start_filesystem_matching();
+}
+
+static boot_task_registration kernel_boot_tasks[] = {
+	{u"PCI", &pci_boot_task, nullptr, 0, BOOT_CAP_PCI},
+	{u"USB", &usb_boot_task, nullptr, BOOT_CAP_PCI, BOOT_CAP_USB | BOOT_CAP_INPUT},
+	{u"Storage", &storage_boot_task, nullptr, BOOT_CAP_PCI, BOOT_CAP_BLOCK},
+	{u"Filesystems", &filesystem_boot_task, nullptr, BOOT_CAP_BLOCK, BOOT_CAP_FILESYSTEM}
+};
+
 
 void _kentry(PKERNEL_BOOT_INFO bootinfo)
 {
@@ -268,11 +301,14 @@ void _kentry(PKERNEL_BOOT_INFO bootinfo)
 	startup_pmmngr(bootinfo->boottype, bootinfo->memory_map);
 	kputs(u"complete\n");
 	initialize_pci_express();
+	topology_init();
+	topology_report();
 	//Set up the VMMNGR
 	//paging_boot_free();
 	//We're now fully in the higher half and standalone
 	kputs(u"mulitprocessor init\n");
 	arch_setup_interrupts();
+	irqstat_init();
 	//Scheduler is now running
 	//startup_acpi();
 	//startup_multiprocessor();
@@ -283,6 +319,9 @@ void _kentry(PKERNEL_BOOT_INFO bootinfo)
 	setup_usb();
 	//Start Virtual Disk System
 	init_vds();
+	boottask_init();
+	for (auto& task : kernel_boot_tasks)
+		register_boot_task(&task);
 
 	PIMAGE_DESCRIPTOR image = *reinterpret_cast<PIMAGE_DESCRIPTOR*>(bootinfo->modloader_info);
 	while (image)
@@ -322,10 +361,13 @@ void _kentry(PKERNEL_BOOT_INFO bootinfo)
 
 	//create_thread(network_outputter, nullptr, THREAD_PRIORITY_NORMAL, KERNEL_TASK);
 	
-	initialize_pci_drivers();
-	usb_run();
-	vfsInit();
-	vds_start_filesystem_matching();
+	//Boot drivers have registered their tasks. Only wait for the critical path, filesystems come up in the background
+	run_boot_tasks();
+	boot_wait_capabilities(BOOT_CAP_INPUT, TIMEOUT_INFINITY);
+	//Worst lock classes over boot. Prints nothing unless built with LOCKDEP (Debug)
+	lockdep_report(8);
+	//Interrupt load and moderation over boot
+	irq_stats_report();
 #if 0
 	kprintf(u"VDS Information:\n");
 	enumerate_disks(&vds_enum);
@@ -0,0 +1,308 @@
+#include <lockdep.h>
+#include <arch/cpu.h>
+#include <kstdio.h>
+
+#if LOCKDEP
+#include <chaiatomic.h>
+#include <string.h>
+#include <percpu.h>
+
+static const size_t LOCKDEP_MAX_CLASSES = 512;
+//Deeper nesting is counted but not validated
+static const size_t LOCKDEP_MAX_HELD = 16;
+
+struct _lock_class {
+	std::atomic<size_t> key;
+	const char* name;
+	std::atomic<uint64_t> acquisitions;
+	std::atomic<uint64_t> contended;
+	std::atomic<uint64_t> wait_total;
+	std::atomic<uint64_t> wait_max;
+	std::atomic<uint64_t> hold_total;
+	std::atomic<uint64_t> hold_max;
+};
+
+static lock_class classes[LOCKDEP_MAX_CLASSES];
+//Bit b of deps[a] is set once class b has been taken while holding class a
+static const size_t DEP_WORDS = LOCKDEP_MAX_CLASSES / 64;
+static volatile uint64_t deps[LOCKDEP_MAX_CLASSES][DEP_WORDS];
+//Raw flag rather than a spinlock, which would recurse into us
+static volatile size_t graph_lock = 0;
+
+struct held_lock {
+	lock_class* cls;
+	void* lock;
+	uint64_t acquired;
+};
+
+//Spinlocks disable interrupts, so a CPU's held locks are a stack
+struct __declspec(align(64)) lockdep_cpu {
+	size_t depth;
+	held_lock held[LOCKDEP_MAX_HELD];
+};
+static DEFINE_PER_CPU(lockdep_cpu, lockdep_cpus) = {};
+
+//Null until this CPU has its own copy. Before that CPUs share the template, and would mix up each other's held locks
+static lockdep_cpu* this_lockdep_cpu()
+{
+	if (pcpu_data.percpuoffset == 0)
+		return nullptr;
+	return this_cpu_ptr(lockdep_cpus);
+}
+
+static size_t class_index(lock_class* cls)
+{
+	return cls - classes;
+}
+
+static bool has_dep(size_t from, size_t to)
+{
+	return (deps[from][to / 64] & (1ui64 << (to % 64))) != 0;
+}
+
+//Breadth-first search of the dependency graph
+static bool reachable(size_t from, size_t to)
+{
+	uint64_t visited[DEP_WORDS];
+	uint16_t queue[LOCKDEP_MAX_CLASSES];
+	memset(visited, 0, sizeof(visited));
+	size_t head = 0, tail = 0;
+	queue[tail++] = from;
+	visited[from / 64] |= 1ui64 << (from % 64);
+	while (head != tail)
+	{
+		size_t node = queue[head++];
+		if (node == to)
+			return true;
+		for (size_t w = 0; w < DEP_WORDS; ++w)
+		{
+			uint64_t next = deps[node][w] & ~visited[w];
+			visited[w] |= next;
+			while (next)
+			{
+				unsigned long bit;
+				_BitScanForward64(&bit, next);
+				next &= next - 1;
+				queue[tail++] = w * 64 + bit;
+			}
+		}
+	}
+	return false;
+}
+
+static void update_max(std::atomic<uint64_t>& max, uint64_t value)
+{
+	uint64_t current = max.load(std::memory_order_relaxed);
+	while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed));
+}
+
+lock_class* lockdep_register(const void* key, const char* name)
+{
+	size_t start = ((size_t)key >> 4) % LOCKDEP_MAX_CLASSES;
+	for (size_t n = 0; n < LOCKDEP_MAX_CLASSES; ++n)
+	{
+		lock_class* cls = &classes[(start + n) % LOCKDEP_MAX_CLASSES];
+		size_t existing = cls->key.load(std::memory_order_acquire);
+		if (existing == (size_t)key)
+			return cls;
+		if (existing == 0)
+		{
+			if (cls->key.compare_exchange_strong(existing, (size_t)key))
+			{
+				cls->name = name;
+				return cls;
+			}
+			if (existing == (size_t)key)
+				return cls;
+		}
+	}
+	return nullptr;
+}
+
+//kprintf takes the screen lock, which may be the very lock we're reporting on. kputs takes none
+static void raw_puts_hex(size_t value)
+{
+	char16_t buffer[2 * sizeof(size_t) + 3];
+	size_t pos = sizeof(buffer) / sizeof(char16_t) - 1;
+	buffer[pos] = 0;
+	do {
+		buffer[--pos] = u"0123456789ABCDEF"[value & 0xF];
+		value >>= 4;
+	} while (value);
+	buffer[--pos] = u'x';
+	buffer[--pos] = u'0';
+	kputs(&buffer[pos]);
+}
+
+//Named classes print their name, the rest their key
+static void raw_puts_class(lock_class* cls)
+{
+	if (!cls->name)
+		return raw_puts_hex(cls->key.load(std::memory_order_relaxed));
+	char16_t buffer[33];
+	const char* name = cls->name;
+	while (*name)
+	{
+		size_t n = 0;
+		for (; n < 32 && name[n]; ++n)
+			buffer[n] = name[n];
+		buffer[n] = 0;
+		kputs(buffer);
+		name += n;
+	}
+}
+
+static void report_recursion(lock_class* cls, void* lock)
+{
+	kputs(u"lockdep: recursive acquire of lock ");
+	raw_puts_hex((size_t)lock);
+	kputs(u", class ");
+	raw_puts_class(cls);
+	kputs(u"\n");
+}
+
+static void report_inversion(lock_class* cls, lock_class* held)
+{
+	kputs(u"lockdep: lock order inversion, class ");
+	raw_puts_class(cls);
+	kputs(u" taken while holding class ");
+	raw_puts_class(held);
+	kputs(u", which is elsewhere taken after it\n");
+}
+
+void lockdep_acquire(lock_class* cls, void* lock)
+{
+	lockdep_cpu* cpu = this_lockdep_cpu();
+	if (!cls || !cpu)
+		return;
+	size_t held = cpu->depth < LOCKDEP_MAX_HELD ? cpu->depth : LOCKDEP_MAX_HELD;
+	for (size_t n = 0; n < held; ++n)
+	{
+		held_lock& h = cpu->held[n];
+		if (h.lock == lock)
+		{
+			report_recursion(cls, lock);
+			continue;
+		}
+		if (!h.cls || h.cls == cls)
+			continue;
+		size_t from = class_index(h.cls), to = class_index(cls);
+		if (has_dep(from, to))
+			continue;
+		while (!arch_cas(&graph_lock, 0, 1))
+			arch_pause();
+		bool inversion = false;
+		if (!has_dep(from, to))
+		{
+			inversion = reachable(to, from);
+			//Recorded even on inversion, so each pair is only reported once
+			deps[from][to / 64] |= 1ui64 << (to % 64);
+		}
+		graph_lock = 0;
+		if (inversion)
+			report_inversion(cls, h.cls);
+	}
+	if (cpu->depth < LOCKDEP_MAX_HELD)
+	{
+		held_lock& h = cpu->held[cpu->depth];
+		h.cls = cls;
+		h.lock = lock;
+		h.acquired = 0;
+	}
+	++cpu->depth;
+}
+
+void lockdep_acquired(lock_class* cls, void* lock, uint64_t wait_ticks, bool contended)
+{
+	if (!cls)
+		return;
+	lockdep_cpu* cpu = this_lockdep_cpu();
+	if (cpu && cpu->depth != 0 && cpu->depth <= LOCKDEP_MAX_HELD)
+		cpu->held[cpu->depth - 1].acquired = arch_get_cpu_ticks();
+	cls->acquisitions.fetch_add(1);
+	if (contended)
+	{
+		cls->contended.fetch_add(1);
+		cls->wait_total.fetch_add(wait_ticks);
+		update_max(cls->wait_max, wait_ticks);
+	}
+}
+
+void lockdep_release(lock_class* cls, void* lock)
+{
+	if (!cls)
+		return;
+	lockdep_cpu* cpu = this_lockdep_cpu();
+	if (!cpu || cpu->depth == 0)
+		return;
+	if (cpu->depth > LOCKDEP_MAX_HELD)
+	{
+		--cpu->depth;
+		return;
+	}
+	//Usually the top, but locks needn't be released in order
+	for (size_t n = cpu->depth; n-- > 0;)
+	{
+		if (cpu->held[n].lock != lock)
+			continue;
+		uint64_t hold = arch_get_cpu_ticks() - cpu->held[n].acquired;
+		cls->hold_total.fetch_add(hold);
+		update_max(cls->hold_max, hold);
+		for (; n + 1 < cpu->depth; ++n)
+			cpu->held[n] = cpu->held[n + 1];
+		--cpu->depth;
+		return;
+	}
+}
+
+//Named classes print their name, the rest their key
+static void print_class(lock_class* cls)
+{
+	if (cls->name)
+		kprintf(u"%S", cls->name);
+	else
+		kprintf(u"%x", cls->key.load(std::memory_order_relaxed));
+}
+
+typedef uint64_t(*class_metric)(lock_class* cls);
+
+static void report_worst(size_t worst, class_metric metric, const char16_t* title)
+{
+	kprintf(u"lockdep: worst classes by %s\n", title);
+	uint64_t chosen[DEP_WORDS];
+	memset(chosen, 0, sizeof(chosen));
+	for (size_t rank = 0; rank < worst; ++rank)
+	{
+		lock_class* best = nullptr;
+		for (size_t n = 0; n < LOCKDEP_MAX_CLASSES; ++n)
+		{
+			lock_class* cls = &classes[n];
+			if (cls->key.load(std::memory_order_relaxed) == 0 || (chosen[n / 64] & (1ui64 << (n % 64))))
+				continue;
+			if (!best || metric(cls) > metric(best))
+				best = cls;
+		}
+		if (!best || metric(best) == 0)
+			break;
+		size_t index = class_index(best);
+		chosen[index / 64] |= 1ui64 << (index % 64);
+		kprintf(u"  class ");
+		print_class(best);
+		kprintf(u": %d acquisitions, %d contended, wait %d ticks (max %d), hold %d ticks (max %d)\n",
+			best->acquisitions.load(), best->contended.load(), best->wait_total.load(), best->wait_max.load(), best->hold_total.load(), best->hold_max.load());
+	}
+}
+
+EXTERN CHAIKRNL_FUNC void lockdep_report(size_t worst)
+{
+	report_worst(worst, [](lock_class* cls) { return cls->wait_total.load(std::memory_order_relaxed); }, u"total wait");
+	report_worst(worst, [](lock_class* cls) { return cls->hold_max.load(std::memory_order_relaxed); }, u"longest hold");
+}
+
+#else
+
+EXTERN CHAIKRNL_FUNC void lockdep_report(size_t worst)
+{
+}
+
+#endif
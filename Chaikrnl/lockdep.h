@@ -0,0 +1,37 @@
+#ifndef CHAIOS_LOCKDEP_H
+#define CHAIOS_LOCKDEP_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+/*
+Lock validator and profiler for spinlocks. Locks are grouped into classes by their lock_class_key, or failing that by the code that created them.
+Acquisition order between classes is recorded, and an acquire that closes a cycle or retakes a held lock is reported before it spins.
+Those reports go straight to kputs, since kprintf takes the screen lock and could be the lock being reported.
+Wait and hold times per class are measured with the TSC.
+*/
+#ifndef LOCKDEP
+#define LOCKDEP 0
+#endif
+
+typedef struct _lock_class lock_class;
+
+#ifdef __cplusplus
+//key is a lock_class_key, or the return address of create_spinlock. name may be null. Returns nullptr if the class table is full
+lock_class* lockdep_register(const void* key, const char* name);
+//Before spinning, so an inversion is reported rather than hanging
+void lockdep_acquire(lock_class* cls, void* lock);
+void lockdep_acquired(lock_class* cls, void* lock, uint64_t wait_ticks, bool contended);
+void lockdep_release(lock_class* cls, void* lock);
+#endif
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+//Prints the worst classes by total wait time and by longest hold. Does nothing without LOCKDEP
+CHAIKRNL_FUNC void lockdep_report(size_t worst);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+#include <mpmc_ring.h>
+
+typedef blocking_ring<void*> msg_ring;
+
+EXTERN CHAIKRNL_FUNC msg_ring_t create_msg_ring(size_t capacity)
+{
+	msg_ring* ring = new msg_ring;
+	if (!ring)
+		return nullptr;
+	if (!ring->init(capacity))
+	{
+		delete ring;
+		return nullptr;
+	}
+	return (msg_ring_t)ring;
+}
+
+EXTERN CHAIKRNL_FUNC void delete_msg_ring(msg_ring_t ring)
+{
+	delete (msg_ring*)ring;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t msg_ring_post(msg_ring_t ring, void* msg, size_t timeout)
+{
+	return ((msg_ring*)ring)->enqueue(msg, timeout) ? 1 : 0;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t msg_ring_fetch(msg_ring_t ring, void** msg, size_t timeout)
+{
+	void* value;
+	if (!((msg_ring*)ring)->dequeue(value, timeout))
+		return 0;
+	if (msg)
+		*msg = value;
+	return 1;
+}
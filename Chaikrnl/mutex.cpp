@@ -0,0 +1,399 @@
+#include <mutex.h>
+#include <spinlock.h>
+#include <linkedlist.h>
+#include <scheduler.h>
+#include <arch/cpu.h>
+
+//Bounds the priority chain walk, so a deadlock cycle can't hang us
+static const size_t MAX_PI_CHAIN = 16;
+
+struct pi_mutex;
+
+struct mutex_waiter {
+	thread_t thread;
+	pi_mutex* mutex;
+	bool queued;
+	linked_list_node<mutex_waiter*> listnode;
+};
+
+static linked_list_node<mutex_waiter*>& get_waiter_node(mutex_waiter* waiter)
+{
+	return waiter->listnode;
+}
+
+struct pi_mutex {
+	//Thread objects rather than handles, so PI never takes the thread table lock under pi_lock
+	thread_t owner;
+	LinkedList<mutex_waiter*> waiters;
+	pi_mutex* next_held;
+};
+
+//Protects all mutexes and the PI state of every thread, so chains can be walked without lock ordering issues
+static spinlock_t pi_lock = nullptr;
+static lock_class_key pi_lock_key = { "pi_lock" };
+
+static spinlock_t get_pi_lock()
+{
+	if (!pi_lock)
+	{
+		spinlock_t lock = create_spinlock_class(&pi_lock_key);
+		if (!arch_cas((volatile size_t*)&pi_lock, 0, (size_t)lock))
+			delete_spinlock(lock);
+	}
+	return pi_lock;
+}
+
+static mutex_waiter* top_waiter(pi_mutex* mtx)
+{
+	mutex_waiter* top = nullptr;
+	size_t toppriority = 0;
+	for (auto it = mtx->waiters.begin(); it != mtx->waiters.end(); ++it)
+	{
+		size_t priority = get_thread_priority(it->thread);
+		if (!top || priority > toppriority)
+		{
+			top = *it;
+			toppriority = priority;
+		}
+	}
+	return top;
+}
+
+//Effective priority is the base priority raised to the best waiter on any held mutex
+static void recompute_priority(thread_t thread)
+{
+	thread_pi_state* state = get_thread_pi_state(thread);
+	size_t priority = state->base_priority;
+	for (pi_mutex* held = (pi_mutex*)state->held_locks; held; held = held->next_held)
+	{
+		mutex_waiter* top = top_waiter(held);
+		if (!top)
+			continue;
+		size_t waiterprio = get_thread_priority(top->thread);
+		if (waiterprio > priority)
+			priority = waiterprio;
+	}
+	set_thread_priority(thread, priority);
+}
+
+static void propagate_priority(pi_mutex* mtx)
+{
+	for (size_t depth = 0; mtx && mtx->owner && depth < MAX_PI_CHAIN; ++depth)
+	{
+		thread_t owner = mtx->owner;
+		size_t oldprio = get_thread_priority(owner);
+		recompute_priority(owner);
+		if (get_thread_priority(owner) == oldprio)
+			break;
+		mtx = (pi_mutex*)get_thread_pi_state(owner)->blocked_on;
+	}
+}
+
+static void take_ownership(pi_mutex* mtx, thread_t thread)
+{
+	mtx->owner = thread;
+	thread_pi_state* state = get_thread_pi_state(thread);
+	state->blocked_on = nullptr;
+	mtx->next_held = (pi_mutex*)state->held_locks;
+	state->held_locks = mtx;
+	recompute_priority(thread);
+}
+
+static void drop_ownership(pi_mutex* mtx)
+{
+	thread_t owner = mtx->owner;
+	mtx->owner = nullptr;
+	thread_pi_state* state = get_thread_pi_state(owner);
+	pi_mutex** link = (pi_mutex**)&state->held_locks;
+	while (*link && *link != mtx)
+		link = &(*link)->next_held;
+	if (*link)
+		*link = mtx->next_held;
+	mtx->next_held = nullptr;
+	recompute_priority(owner);
+}
+
+static void dequeue_waiter(mutex_waiter* waiter)
+{
+	if (!waiter->queued)
+		return;
+	waiter->mutex->waiters.remove(waiter);
+	waiter->queued = false;
+	get_thread_pi_state(waiter->thread)->blocked_on = nullptr;
+}
+
+static uint8_t should_sleep_mutex(spinlock_t lock, void* param)
+{
+	mutex_waiter* waiter = (mutex_waiter*)param;
+	pi_mutex* mtx = waiter->mutex;
+	if (mtx->owner == waiter->thread)
+	{
+		//Handed over by release_mutex
+		dequeue_waiter(waiter);
+		return 0;
+	}
+	if (!mtx->owner)
+	{
+		dequeue_waiter(waiter);
+		take_ownership(mtx, waiter->thread);
+		return 0;
+	}
+	if (!waiter->queued)
+	{
+		mtx->waiters.insert(waiter);
+		waiter->queued = true;
+		get_thread_pi_state(waiter->thread)->blocked_on = mtx;
+		propagate_priority(mtx);
+	}
+	return 1;
+}
+
+EXTERN CHAIKRNL_FUNC mutex_t create_mutex()
+{
+	if (!get_pi_lock())
+		return nullptr;
+	pi_mutex* mtx = new pi_mutex;
+	if (!mtx)
+		return nullptr;
+	mtx->owner = nullptr;
+	mtx->next_held = nullptr;
+	mtx->waiters.init(&get_waiter_node);
+	return (mutex_t)mtx;
+}
+
+EXTERN CHAIKRNL_FUNC void delete_mutex(mutex_t mutex)
+{
+	delete (pi_mutex*)mutex;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t acquire_mutex(mutex_t mutex, size_t timeout)
+{
+	pi_mutex* mtx = (pi_mutex*)mutex;
+	cpu_status_t st;
+	if (!isscheduler())
+	{
+		//Nothing can preempt the owner yet, so this only waits on other CPUs
+		uint64_t start = arch_get_system_timer();
+		while (true)
+		{
+			st = acquire_spinlock(pi_lock);
+			if (!mtx->owner)
+				break;
+			release_spinlock(pi_lock, st);
+			if (timeout != TIMEOUT_INFINITY && arch_get_system_timer() > start + timeout)
+				return 0;
+			arch_pause();
+		}
+		mtx->owner = current_thread_object();
+		release_spinlock(pi_lock, st);
+		return 1;
+	}
+	mutex_waiter waiter;
+	waiter.thread = current_thread_object();
+	waiter.mutex = mtx;
+	waiter.queued = false;
+	scheduler_wait(timeout, pi_lock, &should_sleep_mutex, &waiter, &st);
+	//Ownership may have been handed over just as we timed out
+	uint8_t result = (mtx->owner == waiter.thread) ? 1 : 0;
+	if (!result)
+	{
+		dequeue_waiter(&waiter);
+		propagate_priority(mtx);
+	}
+	release_spinlock(pi_lock, st);
+	return result;
+}
+
+EXTERN CHAIKRNL_FUNC void release_mutex(mutex_t mutex)
+{
+	pi_mutex* mtx = (pi_mutex*)mutex;
+	auto st = acquire_spinlock(pi_lock);
+	if (!mtx->owner)
+	{
+		release_spinlock(pi_lock, st);
+		return;
+	}
+	drop_ownership(mtx);
+	//Hand over to the highest priority waiter, so a lower priority thread can't barge in
+	thread_t next = nullptr;
+	mutex_waiter* waiter = top_waiter(mtx);
+	if (waiter)
+	{
+		next = waiter->thread;
+		dequeue_waiter(waiter);
+		take_ownership(mtx, next);
+	}
+	release_spinlock(pi_lock, st);
+	if (next)
+		wake_thread(get_thread_handle(next));
+}
+
+//Adaptive mutex
+
+static const size_t ADAPTIVE_SPIN_LIMIT = 2000;
+
+enum ADAPTIVE_WAITER_STATE {
+	WAITER_IDLE,
+	WAITER_QUEUED,
+	WAITER_WOKEN
+};
+
+struct adaptive_mutex;
+
+struct adaptive_waiter {
+	HTHREAD thread;
+	adaptive_mutex* mutex;
+	volatile size_t state;
+	linked_list_node<adaptive_waiter*> listnode;
+};
+
+static linked_list_node<adaptive_waiter*>& get_adaptive_node(adaptive_waiter* waiter)
+{
+	return waiter->listnode;
+}
+
+static lock_class_key adaptive_mutex_key = { "adaptive_mutex" };
+
+struct adaptive_mutex {
+	volatile size_t owner;
+	volatile size_t waiters;
+	spinlock_t lock;
+	LinkedList<adaptive_waiter*> queue;
+};
+
+static void atomic_add(volatile size_t* value, size_t delta)
+{
+	size_t old;
+	do {
+		old = *value;
+	} while (!arch_cas(value, old, old + delta));
+}
+
+static bool adaptive_spin(adaptive_mutex* mtx, size_t self)
+{
+	for (size_t spins = 0; spins < ADAPTIVE_SPIN_LIMIT; ++spins)
+	{
+		size_t owner = mtx->owner;
+		if (owner == 0)
+		{
+			if (arch_cas(&mtx->owner, 0, self))
+				return true;
+			continue;
+		}
+		//Owner is a thread_t. Thread objects are never freed, so a stale owner is still safe to look at
+		if (!thread_is_running((thread_t)owner))
+			return false;
+		arch_pause();
+	}
+	return false;
+}
+
+static void dequeue_adaptive_waiter(adaptive_waiter* waiter)
+{
+	waiter->mutex->queue.remove(waiter);
+	waiter->state = WAITER_IDLE;
+	atomic_add(&waiter->mutex->waiters, (size_t)-1);
+}
+
+static uint8_t should_sleep_adaptive(spinlock_t lock, void* param)
+{
+	adaptive_waiter* waiter = (adaptive_waiter*)param;
+	adaptive_mutex* mtx = waiter->mutex;
+	if (waiter->state == WAITER_WOKEN)
+		return 0;
+	if (waiter->state == WAITER_IDLE)
+	{
+		mtx->queue.insert(waiter);
+		waiter->state = WAITER_QUEUED;
+		atomic_add(&mtx->waiters, 1);
+	}
+	//Recheck now we're visible to release_adaptive_mutex
+	if (mtx->owner == 0)
+	{
+		dequeue_adaptive_waiter(waiter);
+		return 0;
+	}
+	return 1;
+}
+
+EXTERN CHAIKRNL_FUNC adaptive_mutex_t create_adaptive_mutex()
+{
+	adaptive_mutex* mtx = new adaptive_mutex;
+	if (!mtx)
+		return nullptr;
+	mtx->owner = 0;
+	mtx->waiters = 0;
+	mtx->lock = create_spinlock_class(&adaptive_mutex_key);
+	if (!mtx->lock)
+	{
+		delete mtx;
+		return nullptr;
+	}
+	mtx->queue.init(&get_adaptive_node);
+	return (adaptive_mutex_t)mtx;
+}
+
+EXTERN CHAIKRNL_FUNC void delete_adaptive_mutex(adaptive_mutex_t mutex)
+{
+	adaptive_mutex* mtx = (adaptive_mutex*)mutex;
+	delete_spinlock(mtx->lock);
+	delete mtx;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t acquire_adaptive_mutex(adaptive_mutex_t mutex, size_t timeout)
+{
+	adaptive_mutex* mtx = (adaptive_mutex*)mutex;
+	size_t self = (size_t)current_thread_object();
+	if (arch_cas(&mtx->owner, 0, self))
+		return 1;
+	uint64_t start = arch_get_system_timer();
+	while (true)
+	{
+		if (adaptive_spin(mtx, self))
+			return 1;
+		size_t remaining = TIMEOUT_INFINITY;
+		if (timeout != TIMEOUT_INFINITY)
+		{
+			uint64_t elapsed = arch_get_system_timer() - start;
+			if (elapsed >= timeout)
+				return 0;
+			remaining = timeout - elapsed;
+		}
+		if (!isscheduler())
+			continue;
+		adaptive_waiter waiter;
+		waiter.thread = current_thread();
+		waiter.mutex = mtx;
+		waiter.state = WAITER_IDLE;
+		cpu_status_t st;
+		scheduler_wait(remaining, mtx->lock, &should_sleep_adaptive, &waiter, &st);
+		if (waiter.state == WAITER_QUEUED)
+			dequeue_adaptive_waiter(&waiter);
+		release_spinlock(mtx->lock, st);
+		if (arch_cas(&mtx->owner, 0, self))
+			return 1;
+	}
+}
+
+EXTERN CHAIKRNL_FUNC void release_adaptive_mutex(adaptive_mutex_t mutex)
+{
+	adaptive_mutex* mtx = (adaptive_mutex*)mutex;
+	//Locked CAS orders the owner store before the waiters load
+	size_t owner = mtx->owner;
+	if (!arch_cas(&mtx->owner, owner, 0))
+		mtx->owner = 0;
+	if (mtx->waiters == 0)
+		return;
+	auto st = acquire_spinlock(mtx->lock);
+	HTHREAD next = nullptr;
+	adaptive_waiter* waiter = mtx->queue.pop();
+	if (waiter)
+	{
+		atomic_add(&mtx->waiters, (size_t)-1);
+		next = waiter->thread;
+		waiter->state = WAITER_WOKEN;
+	}
+	release_spinlock(mtx->lock, st);
+	if (next)
+		wake_thread(next);
+}
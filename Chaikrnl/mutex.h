@@ -0,0 +1,42 @@
+#ifndef CHAIOS_MUTEX_H
+#define CHAIOS_MUTEX_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+typedef void* mutex_t;
+typedef void* adaptive_mutex_t;
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+#ifndef TIMEOUT_INFINITY
+#define TIMEOUT_INFINITY SIZE_MAX
+#endif
+
+/*
+Owner-tracking sleeping lock with priority inheritance.
+A thread waiting on a mutex lends its priority to the owner, and on through any mutex the owner is itself waiting on.
+Not recursive. Must be released by the owning thread.
+*/
+CHAIKRNL_FUNC mutex_t create_mutex();
+CHAIKRNL_FUNC void delete_mutex(mutex_t mutex);
+CHAIKRNL_FUNC uint8_t acquire_mutex(mutex_t mutex, size_t timeout);
+CHAIKRNL_FUNC void release_mutex(mutex_t mutex);
+
+/*
+Adaptive mutex for short critical sections that may still sleep.
+Uncontended acquire and release are a single CAS. Waiters spin while the owner is running on another CPU, and block otherwise.
+No priority inheritance.
+*/
+CHAIKRNL_FUNC adaptive_mutex_t create_adaptive_mutex();
+CHAIKRNL_FUNC void delete_adaptive_mutex(adaptive_mutex_t mutex);
+CHAIKRNL_FUNC uint8_t acquire_adaptive_mutex(adaptive_mutex_t mutex, size_t timeout);
+CHAIKRNL_FUNC void release_adaptive_mutex(adaptive_mutex_t mutex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
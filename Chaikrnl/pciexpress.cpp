@@ -4,6 +4,14 @@
 #include <arch/cpu.h>
 #include <kstdio.h>
 #include <redblack.h>
+#include <spinlock.h>
+#include <xcall.h>
+#include <scheduler.h>
+#include <waitaddr.h>
+#include <chaiatomic.h>
+#include <topology.h>
+#include <pmmngr.h>
+#include <string.h>
 
 static ACPI_TABLE_MCFG* mcfg = nullptr;
 
@@ -106,30 +114,58 @@ static bool write_pci_legacy(uint16_t segment, uint16_t bus, uint16_t device, ui
 	return success;
 }
 
-static paddr_t find_pci_device(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function)
+//One 1MiB ECAM window per bus, mapped on first use and kept
+struct ecam_segment {
+	ACPI_MCFG_ALLOCATION* alloc;
+	volatile size_t* buses;
+};
+static ecam_segment* ecam_segments = nullptr;
+static size_t ecam_segment_count = 0;
+
+static const size_t ECAM_BUS_SIZE = (1 << 20);
+
+static void* map_ecam_bus(ecam_segment* seg, uint16_t bus)
 {
-	if (bus > 255)
-		return 0;
-	if (device > 31)
-		return 0;
-	if (function > 7)
-		return 0;
-	ACPI_MCFG_ALLOCATION* allocs = mem_after<ACPI_MCFG_ALLOCATION*>(mcfg);
-	for (; raw_diff(allocs, mcfg) < mcfg->Header.Length; ++allocs)
+	volatile size_t* slot = &seg->buses[bus - seg->alloc->StartBusNumber];
+	if (*slot)
+		return (void*)*slot;
+	paddr_t paddr = seg->alloc->Address + ((paddr_t)bus << 20);
+	void* mapped = find_free_paging(ECAM_BUS_SIZE);
+	if (!mapped)
 	{
-		if (allocs->PciSegment == segment && allocs->StartBusNumber <= bus && bus <= allocs->EndBusNumber)
-			break;
+		kprintf(u"Error: no address space for PCI bus %d\n", bus);
+		return nullptr;
 	}
-	if (raw_diff(allocs, mcfg) >= mcfg->Header.Length)
-		return 0;
-	paddr_t paddr_page = allocs->Address + ((bus) << 20) | (device << 15) | (function << 12);
-	return paddr_page;
+	if (!paging_map(mapped, paddr, ECAM_BUS_SIZE, PAGE_ATTRIBUTE_WRITABLE | PAGE_ATTRIBUTE_NO_CACHING))
+	{
+		kprintf(u"Error mapping PCI memory: %x, %x\n", mapped, paddr);
+		return nullptr;
+	}
+	//Another CPU may have got there first
+	if (!arch_cas(slot, 0, (size_t)mapped))
+		paging_free(mapped, ECAM_BUS_SIZE, false);
+	return (void*)*slot;
 }
 
-static void unmap_config(void* addr)
+static void* find_pci_device(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function)
 {
-	if(addr != nullptr && addr != (void*)SIZE_MAX)
-		paging_free(addr, PAGESIZE, false);
+	if (bus > 255)
+		return nullptr;
+	if (device > 31)
+		return nullptr;
+	if (function > 7)
+		return nullptr;
+	for (size_t n = 0; n < ecam_segment_count; ++n)
+	{
+		ecam_segment* seg = &ecam_segments[n];
+		if (seg->alloc->PciSegment != segment || bus < seg->alloc->StartBusNumber || seg->alloc->EndBusNumber < bus)
+			continue;
+		void* window = map_ecam_bus(seg, bus);
+		if (!window)
+			return nullptr;
+		return raw_offset<void*>(window, (device << 15) | (function << 12));
+	}
+	return nullptr;
 }
 
 static void* internal_read_pci(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t reg, uint32_t width, uint64_t* result, void* mapped)
@@ -140,15 +176,9 @@ static void* internal_read_pci(uint16_t segment, uint16_t bus, uint16_t device,
 	}
 	if (!mapped)
 	{
-		paddr_t dev = find_pci_device(segment, bus, device, function);
-		if (dev == 0)
-			return nullptr;
-		mapped = find_free_paging(PAGESIZE);
-		if (!paging_map(mapped, dev, PAGESIZE, PAGE_ATTRIBUTE_WRITABLE | PAGE_ATTRIBUTE_NO_CACHING))
-		{
-			kprintf(u"Error mapping PCI memory: %x, %x\n", mapped, dev);
+		mapped = find_pci_device(segment, bus, device, function);
+		if (!mapped)
 			return nullptr;
-		}
 	}
 	bool written = true;
 	switch (width)
@@ -168,8 +198,6 @@ static void* internal_read_pci(uint16_t segment, uint16_t bus, uint16_t device,
 	default:
 		written = false;
 	}
-	if (!written)
-		unmap_config(mapped);
 	return written ? mapped : nullptr;
 }
 
@@ -181,15 +209,9 @@ static void* internal_write_pci(uint16_t segment, uint16_t bus, uint16_t device,
 	}
 	if (!mapped)
 	{
-		paddr_t dev = find_pci_device(segment, bus, device, function);
-		if (dev == 0)
-			return nullptr;
-		void* mapped = find_free_paging(PAGESIZE);
-		if (!paging_map(mapped, dev, PAGESIZE, PAGE_ATTRIBUTE_WRITABLE | PAGE_ATTRIBUTE_NO_CACHING))
-		{
-			kprintf(u"Error mapping PCI memory: %x, %x\n", mapped, dev);
+		mapped = find_pci_device(segment, bus, device, function);
+		if (!mapped)
 			return nullptr;
-		}
 	}
 	bool written = true;
 	switch (width)
@@ -209,30 +231,70 @@ static void* internal_write_pci(uint16_t segment, uint16_t bus, uint16_t device,
 	default:
 		written = false;
 	}
-	if (!written)
-		unmap_config(mapped);
 	return written ? mapped : nullptr;
 }
 
 bool read_pci_config(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t reg, uint32_t width, uint64_t* result)
 {
-	void* mapped = internal_read_pci(segment, bus, device, function, reg, width, result, nullptr);
-	unmap_config(mapped);
-	return mapped != nullptr;
+	return internal_read_pci(segment, bus, device, function, reg, width, result, nullptr) != nullptr;
 }
 
 bool write_pci_config(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t reg, uint32_t width, uint64_t value)
 {
-	void* mapped = internal_write_pci(segment, bus, device, function, reg, width, value, nullptr);
-	unmap_config(mapped);
-	return mapped != nullptr;
+	return internal_write_pci(segment, bus, device, function, reg, width, value, nullptr) != nullptr;
+}
+
+#define PCI_MSIX_VCTRL_MASK 0x0001
+#define PCI_MSIX_FUNCTION_MASK (1 << 30)
+#define PCI_MSIX_ENABLE (1 << 31)
+
+//Mapped MSI-X table of a device, kept for masking after allocation
+struct msix_table {
+	volatile uint32_t* entries;
+	size_t count;
+	//The BAR mapping the table lives in
+	void* mapping;
+	size_t mapsize;
+};
+static RedBlackTree<uint64_t, msix_table*> msix_tables;
+//Vectors a device currently sends to, freed when it is given new ones
+struct msi_allocation {
+	pci_msi_vector* vectors;
+	uint32_t count;
+};
+static RedBlackTree<uint64_t, msi_allocation*> msi_allocations;
+//Guards msix_tables and msi_allocations
+static spinlock_t msix_lock = nullptr;
+static lock_class_key msix_lock_key = { "pci_msix" };
+//Protects the driver probe queues built while scanning
+static spinlock_t probe_lock = nullptr;
+static lock_class_key probe_lock_key = { "pci_probe" };
+
+static uint64_t pci_address_key(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function)
+{
+	return ((uint64_t)segment << 48) | ((uint64_t)bus << 32) | ((uint64_t)device << 16) | function;
 }
 
 void initialize_pci_express()
 {
+	msix_lock = create_spinlock_class(&msix_lock_key);
+	probe_lock = create_spinlock_class(&probe_lock_key);
 	AcpiGetTable(ACPI_SIG_MCFG, 0, (ACPI_TABLE_HEADER**)&mcfg);
 	if (!mcfg)
 		return;
+	ACPI_MCFG_ALLOCATION* allocs = mem_after<ACPI_MCFG_ALLOCATION*>(mcfg);
+	size_t count = 0;
+	while (raw_diff(&allocs[count + 1], mcfg) <= mcfg->Header.Length)
+		++count;
+	ecam_segments = new ecam_segment[count];
+	for (size_t n = 0; n < count; ++n)
+	{
+		size_t buses = allocs[n].EndBusNumber - allocs[n].StartBusNumber + 1;
+		ecam_segments[n].alloc = &allocs[n];
+		ecam_segments[n].buses = new size_t[buses];
+		memset((void*)ecam_segments[n].buses, 0, buses * sizeof(size_t));
+	}
+	ecam_segment_count = count;
 }
 
 uint16_t pci_get_vendor_id(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function)
@@ -355,7 +417,6 @@ paddr_t read_pci_bar(uint16_t segment, uint16_t bus, uint16_t device, uint16_t f
 		*BARSIZE = szbits;
 	}
 end:
-	unmap_config(internalptr);
 	return ret;
 }
 
@@ -452,10 +513,98 @@ void pci_bus_scan(pci_scan_callback callback)
 	}
 }
 
-#define PCI_msix_vctrl_mask	0x0002
+struct msi_vector_request {
+	dispatch_interrupt_handler handler;
+	void* param;
+	pci_msi_vector result;
+};
 
-uint32_t PciAllocateMsi(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t numintrs, dispatch_interrupt_handler handler, void* param)
+//Runs on the target CPU, vectors and dispatch tables are per CPU
+static void allocate_msi_vector(void* p)
+{
+	msi_vector_request* req = (msi_vector_request*)p;
+	req->result.processor = pcpu_data.cpuid;
+	req->result.vector = arch_allocate_interrupt_vector();
+	if (req->result.vector == -1)
+		return;
+	arch_register_interrupt_handler(INTERRUPT_SUBSYSTEM_DISPATCH, req->result.vector, INTERRUPT_CURRENTCPU, req->handler, req->param);
+	arch_install_interrupt_post_event(INTERRUPT_SUBSYSTEM_DISPATCH, req->result.vector, INTERRUPT_CURRENTCPU, &arch_local_eoi);
+}
+
+static void free_msi_vector(void* p)
+{
+	arch_free_interrupt_vector(((pci_msi_vector*)p)->vector);
+}
+
+static void release_vectors(pci_msi_vector* vectors, uint32_t count)
+{
+	for (uint32_t n = 0; n < count; ++n)
+	{
+		if (!xcall_sync(vectors[n].processor, &free_msi_vector, &vectors[n]))
+		{
+			auto st = arch_disable_interrupts();
+			free_msi_vector(&vectors[n]);
+			arch_restore_state(st);
+		}
+	}
+}
+
+//Round robin placement covers this many online CPUs
+static const size_t MSI_MAX_CPUS = 256;
+
+static bool allocate_vector_on(uint32_t processor, dispatch_interrupt_handler handler, void* param, pci_msi_vector* vector)
+{
+	msi_vector_request req = { handler, param, { (uint32_t)-1, 0 } };
+	//CPUs not taking cross-calls yet get their interrupts sent here instead
+	if (processor == INTERRUPT_CURRENTCPU || !xcall_sync(processor, &allocate_msi_vector, &req))
+	{
+		auto st = arch_disable_interrupts();
+		allocate_msi_vector(&req);
+		arch_restore_state(st);
+	}
+	*vector = req.result;
+	return req.result.vector != -1;
+}
+
+//Once the device has been pointed at its new vectors, so the old ones no longer fire
+static void replace_msi_allocation(uint64_t key, const pci_msi_vector* vectors, uint32_t count)
+{
+	msi_allocation* alloc = new msi_allocation;
+	if (alloc)
+	{
+		alloc->vectors = new pci_msi_vector[count];
+		alloc->count = count;
+		if (!alloc->vectors)
+		{
+			delete alloc;
+			alloc = nullptr;
+		}
+		else
+		{
+			for (uint32_t n = 0; n < count; ++n)
+				alloc->vectors[n] = vectors[n];
+		}
+	}
+	msi_allocation* old = nullptr;
+	auto st = acquire_spinlock(msix_lock);
+	auto it = msi_allocations.find(key);
+	if (it != msi_allocations.end())
+		old = it->second;
+	//Untracked if we're out of memory, the old vectors go either way
+	msi_allocations[key] = alloc;
+	release_spinlock(msix_lock, st);
+	if (old)
+	{
+		release_vectors(old->vectors, old->count);
+		delete[] old->vectors;
+		delete old;
+	}
+}
+
+static uint32_t allocate_msi(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t numintrs, const uint32_t* processors, dispatch_interrupt_handler handler, void* const* params, void* param, pci_msi_vector* vectors)
 {
+	if (numintrs == 0)
+		return 0;
 	//Check device supports MSI
 	void* internalptr = nullptr;
 	uint64_t status;
@@ -485,22 +634,32 @@ uint32_t PciAllocateMsi(uint16_t segment, uint16_t bus, uint16_t device, uint16_
 		if (msireg == 0)	//No MSI support
 			goto fail;
 		//MSI supported
-		//Disable preemption
-		auto cpust = arch_disable_interrupts();
-		uint32_t vector = arch_allocate_interrupt_vector();
-		uint32_t cpu_num = pcpu_data.cpuid;
-		kprintf(u"MSI Interrupt Vector: %x (p%d)\n", vector, cpu_num);
-		//Setup EOI
-		arch_register_interrupt_handler(INTERRUPT_SUBSYSTEM_DISPATCH, vector, cpu_num, handler, param);
-		arch_install_interrupt_post_event(INTERRUPT_SUBSYSTEM_DISPATCH, vector, cpu_num, &arch_local_eoi);
-		//Now we have all per-CPU stuff sorted
-		arch_restore_state(cpust);
-		//Get MSI address
-		uint64_t msi_data = 0;
-		paddr_t msi_addr = arch_msi_address(&msi_data, vector, cpu_num);
-
 		internalptr = internal_read_pci(segment, bus, device, function, msireg, 32, &capreg, internalptr);
-		if ((capreg & 0xFF) == PCI_CAP_ID_MSIX)
+		bool msix = ((capreg & 0xFF) == PCI_CAP_ID_MSIX);
+		size_t tablecount = msix ? (((capreg >> 16) & 0x7FF) + 1) : 1;
+		if (numintrs > tablecount)
+			numintrs = tablecount;
+		//Round robin over the online CPUs when the caller didn't pick
+		uint32_t online[MSI_MAX_CPUS];
+		size_t onlinecount = 0;
+		if (!processors)
+			onlinecount = xcall_online_cpu_ids(online, MSI_MAX_CPUS);
+		uint32_t allocated = 0;
+		for (; allocated < numintrs; ++allocated)
+		{
+			uint32_t processor = INTERRUPT_CURRENTCPU;
+			if (processors)
+				processor = processors[allocated];
+			else if (onlinecount != 0)
+				processor = online[allocated % onlinecount];
+			if (!allocate_vector_on(processor, handler, params ? params[allocated] : param, &vectors[allocated]))
+				break;
+			kprintf(u"MSI Interrupt Vector: %x (p%d)\n", vectors[allocated].vector, vectors[allocated].processor);
+		}
+		if (allocated == 0)
+			goto fail;
+
+		if (msix)
 		{
 			kprintf(u"Using MSI-X\n");
 			//Find the correct BAR
@@ -519,47 +678,77 @@ uint32_t PciAllocateMsi(uint16_t segment, uint16_t bus, uint16_t device, uint16_
 			paddr_t msibar = read_pci_bar(segment, bus, device, function, bar, &barsize);
 
 			size_t offset = table_bir & (UINT32_MAX - 0x7);
-			size_t pageoffset = offset & (UINT32_MAX - 0xFFF);
-			size_t inoffset = offset & 0xFF8;
 
-			size_t tablecount = (((capreg>>16) & 0x7FF) + 1);
-			size_t tablesize = tablecount * 16;		//sizeof(table_entry) == 16
 			void* mappedtable = find_free_paging(barsize);
 #if DEBUG
 			kprintf(u"Mapping BAR%d to %x: address %x, length %x\n", bar, mappedtable, msibar, barsize);
 #endif
 			if (!paging_map(mappedtable, msibar, barsize, PAGE_ATTRIBUTE_NO_CACHING | PAGE_ATTRIBUTE_WRITABLE))
+			{
 				kprintf(u"MSI-X MAPPING FAILED\n");
+				//Undo whatever part of the BAR did get mapped
+				for (size_t off = 0; off < barsize; off += PAGESIZE)
+				{
+					void* page = raw_offset<void*>(mappedtable, off);
+					if (!check_free(page, PAGESIZE))
+						paging_free(page, PAGESIZE, false);
+				}
+				release_vectors(vectors, allocated);
+				goto fail;
+			}
 #if DEBUG
 			kprintf(u"MSI-X BIR %x, table BAR%d (%x), offset %x, count %d\n", table_bir, bar, msibar, offset, tablecount);
-			kprintf(u"Message address: %x, data: %x\n", msi_addr, msi_data);
 #endif
-			//Write upper address
-			internalptr = internal_write_pci(segment, bus, device, function, msireg + 1, 32, msi_addr >> 32, internalptr);
-			//kprintf(u"MSI-X desired: %x:%x\n", msi_data, msi_addr);
+			//Hold off every entry while the table is rewritten
+			internalptr = internal_write_pci(segment, bus, device, function, msireg, 32, capreg | PCI_MSIX_FUNCTION_MASK, internalptr);
 			volatile uint32_t* msitab = raw_offset<volatile uint32_t*>(mappedtable, offset);
-			for (int n = 0; n < tablecount; ++n)
+			for (size_t n = 0; n < tablecount; ++n)
 			{
-				msitab[0 + 4 * n] = msi_addr & (UINT32_MAX - 0x3);		//DWORD aligned
-				msitab[1 + 4 * n] = (msi_addr >> 32);
-				msitab[2 + 4 * n] = msi_data;
-				msitab[3 + 4 * n] = 0;			//Vector control: unmasked
+				volatile uint32_t* entry = &msitab[4 * n];
+				entry[3] = PCI_MSIX_VCTRL_MASK;
+				//Entries nobody asked for stay masked
+				if (n >= allocated)
+					continue;
+				uint64_t msi_data = 0;
+				paddr_t msi_addr = arch_msi_address(&msi_data, vectors[n].vector, vectors[n].processor);
+				entry[0] = msi_addr & (UINT32_MAX - 0x3);		//DWORD aligned
+				entry[1] = (msi_addr >> 32);
+				entry[2] = msi_data;
+				entry[3] = 0;			//Vector control: unmasked
 			}
 #if DEBUG
 			kprintf(u"MSI-X data mapped %x: %x:%x\n", msitab, msitab[1], msitab[0]);
 #endif
+			msix_table* table = new msix_table;
+			table->entries = msitab;
+			table->count = tablecount;
+			table->mapping = mappedtable;
+			table->mapsize = barsize;
+			msix_table* old = nullptr;
+			auto st = acquire_spinlock(msix_lock);
+			auto it = msix_tables.find(pci_address_key(segment, bus, device, function));
+			if (it != msix_tables.end())
+				old = it->second;
+			msix_tables[pci_address_key(segment, bus, device, function)] = table;
+			release_spinlock(msix_lock, st);
+			if (old)
+			{
+				paging_free(old->mapping, old->mapsize, false);
+				delete old;
+			}
 			//Enable MSI-X
-			capreg &= ~(1 << 30);
-			internalptr = internal_write_pci(segment, bus, device, function, msireg, 32, capreg | (1 << 31), internalptr);
+			capreg &= ~PCI_MSIX_FUNCTION_MASK;
+			internalptr = internal_write_pci(segment, bus, device, function, msireg, 32, capreg | PCI_MSIX_ENABLE, internalptr);
 		}
 		else
 		{
 			//Normal MSI
 			kprintf(u"Using MSI\n");
+			uint64_t msi_data = 0;
+			paddr_t msi_addr = arch_msi_address(&msi_data, vectors[0].vector, vectors[0].processor);
 			uint32_t msgctrl = (capreg >> 16);
 			bool maskcap = ((msgctrl & (1 << 8)) != 0);
 			bool bits64cap = ((msgctrl & (1 << 7)) != 0);
-			uint32_t requestedvecs = (msgctrl >> 1) & 0x7;
 			//Write message and data
 			internalptr = internal_write_pci(segment, bus, device, function, msireg + 1, 32, msi_addr & UINT32_MAX, internalptr);
 			uint32_t data_offset = 2;
@@ -571,17 +760,55 @@ uint32_t PciAllocateMsi(uint16_t segment, uint16_t bus, uint16_t device, uint16_
 			internalptr = internal_write_pci(segment, bus, device, function, msireg + data_offset, 32, msi_data, internalptr);
 			if(maskcap)
 				internalptr = internal_write_pci(segment, bus, device, function, msireg + 4, 32, 0, internalptr);
-			//Enable MSI
+			//Enable MSI, single message
+			msgctrl &= ~(0x7 << 4);
 			msgctrl |= 1;
 			capreg = (capreg & UINT16_MAX) | (msgctrl << 16);
 			internalptr = internal_write_pci(segment, bus, device, function, msireg, 32, capreg, internalptr);
 		}
-		unmap_config(internalptr);
-		return vector;
+		replace_msi_allocation(pci_address_key(segment, bus, device, function), vectors, allocated);
+		return allocated;
 	}
 fail:
-	unmap_config(internalptr);
-	return -1;
+	return 0;
+}
+
+uint32_t PciAllocateMsi(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t numintrs, dispatch_interrupt_handler handler, void* param)
+{
+	if (numintrs == 0)
+		numintrs = 1;
+	uint32_t* processors = new uint32_t[numintrs];
+	pci_msi_vector* vectors = new pci_msi_vector[numintrs];
+	for (uint32_t n = 0; n < numintrs; ++n)
+		processors[n] = INTERRUPT_CURRENTCPU;
+	uint32_t result = -1;
+	if (allocate_msi(segment, bus, device, function, numintrs, processors, handler, nullptr, param, vectors) != 0)
+		result = vectors[0].vector;
+	delete[] vectors;
+	delete[] processors;
+	return result;
+}
+
+uint32_t PciAllocateMsiVectors(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t numintrs, const uint32_t* processors, dispatch_interrupt_handler handler, void* const* params, pci_msi_vector* vectors)
+{
+	return allocate_msi(segment, bus, device, function, numintrs, processors, handler, params, nullptr, vectors);
+}
+
+bool PciMaskMsiVector(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t entry, bool masked)
+{
+	auto st = acquire_spinlock(msix_lock);
+	auto it = msix_tables.find(pci_address_key(segment, bus, device, function));
+	bool found = (it != msix_tables.end() && entry < it->second->count);
+	if (found)
+	{
+		volatile uint32_t* vctrl = &it->second->entries[4 * entry + 3];
+		if (masked)
+			*vctrl |= PCI_MSIX_VCTRL_MASK;
+		else
+			*vctrl &= ~PCI_MSIX_VCTRL_MASK;
+	}
+	release_spinlock(msix_lock, st);
+	return found;
 }
 
 #define PCI_TOKEN_BYVENDOR(vendor, device) \
@@ -592,23 +819,19 @@ fail:
 
 static bool driver_init = false;
 
-bool pci_driver_matcher(uint16_t segment, uint16_t bus, uint16_t device, uint8_t function)
+static pci_register_callback find_pci_driver(uint16_t segment, uint16_t bus, uint16_t device, uint8_t function)
 {
 	uint32_t vendortoken = pci_get_vendordev(segment, bus, device, function);
 	auto it = pci_by_vendor.find(vendortoken);
 	if (it != pci_by_vendor.end())
-	{
-		it->second(segment, bus, device, function);
-		return false;
-	}
+		return it->second;
 	
 	uint32_t classtoken = pci_get_classcode(segment, bus, device, function);
 	it = pci_by_class.find(classtoken);
 	if (it != pci_by_class.end())
 	{
 		//Perfect match on classcode
-		it->second(segment, bus, device, function);
-		return false;
+		return it->second;
 	}
 	//Try class:subclass only
 	classtoken |= 0xFF;
@@ -616,8 +839,7 @@ bool pci_driver_matcher(uint16_t segment, uint16_t bus, uint16_t device, uint8_t
 	if (it != pci_by_class.end())
 	{
 		//Matched
-		it->second(segment, bus, device, function);
-		return false;
+		return it->second;
 	}
 	//Try class only
 	classtoken |= 0xFFFF;
@@ -625,21 +847,171 @@ bool pci_driver_matcher(uint16_t segment, uint16_t bus, uint16_t device, uint8_t
 	if (it != pci_by_class.end())
 	{
 		//Matched
-		it->second(segment, bus, device, function);
-		return false;
+		return it->second;
 	}
 	//As a last resort, try vendor only
 	vendortoken |= PCI_TOKEN_BYVENDOR(0, 0xFFFF);
 	it = pci_by_vendor.find(vendortoken);
 	if (it != pci_by_vendor.end())
-	{
-		it->second(segment, bus, device, function);
+		return it->second;
+	//No driver
+	return nullptr;
+}
+
+//Devices matched to a driver. Each driver probes its devices in order on its own thread, so drivers run in parallel with each other but never with themselves
+struct pci_probe_device {
+	pci_address address;
+	uint8_t baseclass;
+	pci_probe_device* next;
+};
+struct pci_probe_driver {
+	pci_register_callback callback;
+	pci_probe_device* first;
+	pci_probe_device* last;
+	pci_probe_driver* next;
+};
+//Only a handful of drivers, so a list does
+static pci_probe_driver* probe_drivers = nullptr;
+//Probes yet to finish, by base class and in total
+static std::atomic<size_t> probes_pending[256];
+static std::atomic<size_t> probes_pending_all;
+static std::atomic<size_t> scans_pending;
+
+static bool pci_probe_matcher(uint16_t segment, uint16_t bus, uint16_t device, uint8_t function)
+{
+	pci_register_callback callback = find_pci_driver(segment, bus, device, function);
+	if (!callback)
 		return false;
+	pci_probe_device* dev = new pci_probe_device;
+	dev->address.segment = segment;
+	dev->address.bus = bus;
+	dev->address.device = device;
+	dev->address.function = function;
+	dev->baseclass = pci_get_base_class(segment, bus, device, function);
+	dev->next = nullptr;
+	auto st = acquire_spinlock(probe_lock);
+	pci_probe_driver* driver = probe_drivers;
+	while (driver && driver->callback != callback)
+		driver = driver->next;
+	if (!driver)
+	{
+		driver = new pci_probe_driver;
+		driver->callback = callback;
+		driver->first = nullptr;
+		driver->last = nullptr;
+		driver->next = probe_drivers;
+		probe_drivers = driver;
 	}
-	//No driver
+	if (driver->last)
+		driver->last->next = dev;
+	else
+		driver->first = dev;
+	driver->last = dev;
+	++probes_pending[dev->baseclass];
+	++probes_pending_all;
+	release_spinlock(probe_lock, st);
 	return false;
 }
 
+static void probe_done(std::atomic<size_t>& counter)
+{
+	if (--counter == 0)
+		wake_address(&counter, WAKE_ALL);
+}
+
+static void pci_probe_thread(void* param)
+{
+	pci_probe_driver* driver = (pci_probe_driver*)param;
+	pci_probe_device* dev = driver->first;
+	while (dev)
+	{
+		pci_address& addr = dev->address;
+		driver->callback(addr.segment, addr.bus, addr.device, addr.function);
+		pci_probe_device* next = dev->next;
+		probe_done(probes_pending[dev->baseclass]);
+		probe_done(probes_pending_all);
+		delete dev;
+		dev = next;
+	}
+	delete driver;
+}
+
+//One bus to scan. Bridges found on it get threads of their own, so the scan fans out along the hierarchy
+struct pci_scan_work {
+	uint16_t segment;
+	uint16_t bus;
+};
+
+static void scan_bus_async(uint16_t segment, uint16_t bus);
+
+static void scan_function(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function)
+{
+	if ((pci_get_classcode(segment, bus, device, function) >> 8) == 0x0604)
+		scan_bus_async(segment, getSecondaryBus(segment, bus, device, function));
+	else
+		pci_probe_matcher(segment, bus, device, function);
+}
+
+static void pci_scan_thread(void* param)
+{
+	pci_scan_work* work = (pci_scan_work*)param;
+	uint16_t segment = work->segment, bus = work->bus;
+	delete work;
+	for (uint16_t device = 0; device < 32; ++device)
+	{
+		if (pci_get_vendor_id(segment, bus, device, 0) == 0xFFFF)
+			continue;
+		scan_function(segment, bus, device, 0);
+		if ((pci_get_header_type(segment, bus, device, 0) & 0x80) == 0)
+			continue;
+		for (uint16_t function = 1; function < 8; ++function)
+		{
+			if (pci_get_vendor_id(segment, bus, device, function) != 0xFFFF)
+				scan_function(segment, bus, device, function);
+		}
+	}
+	probe_done(scans_pending);
+}
+
+//Counted before the thread starts, so the total can't reach zero while the parent is still scanning
+static void scan_bus_async(uint16_t segment, uint16_t bus)
+{
+	pci_scan_work* work = new pci_scan_work;
+	work->segment = segment;
+	work->bus = bus;
+	++scans_pending;
+	create_thread(&pci_scan_thread, work, THREAD_PRIORITY_NORMAL, DRIVER_TASK);
+}
+
+static void scan_segment_async(ACPI_MCFG_ALLOCATION* alloc)
+{
+	uint16_t segment = alloc->PciSegment, start = alloc->StartBusNumber;
+	if (start != 0 || (pci_get_header_type(segment, start, 0, 0) & 0x80) == 0)
+		return scan_bus_async(segment, start);
+	//Multiple host controllers, function n handles bus n
+	for (uint16_t function = 0; function < 8; ++function)
+	{
+		if (pci_get_vendor_id(segment, start, 0, function) != 0xFFFF)
+			scan_bus_async(segment, function);
+	}
+}
+
+static bool wait_counter(std::atomic<size_t>& counter, size_t timeout)
+{
+	size_t current;
+	while ((current = counter.load()) != 0)
+	{
+		if (!wait_on_address(&counter, &current, sizeof(size_t), timeout))
+			return false;
+	}
+	return true;
+}
+
+bool pci_wait_probes(uint8_t baseclass, size_t timeout)
+{
+	return wait_counter(baseclass == PCI_CLASS_ANY ? probes_pending_all : probes_pending[baseclass], timeout);
+}
+
 CHAIKRNL_FUNC void register_pci_driver(pci_device_registration* registr)
 {
 	pci_device_declaration* devids = registr->ids_list;
@@ -662,9 +1034,134 @@ CHAIKRNL_FUNC void register_pci_driver(pci_device_registration* registr)
 	}
 }
 
+//Devices the SRAT places directly, keyed by segment and BDF
+static RedBlackTree<uint32_t, numa_t> pci_device_nodes;
+//Root bridges from the namespace, keyed by segment and base bus
+static RedBlackTree<uint32_t, numa_t> pci_root_nodes;
+
+#define PCI_NODE_KEY(segment, bdf) \
+	(((uint32_t)(segment) << 16) | (bdf))
+
+#define SRAT_HANDLE_PCI 1
+#define SRAT_GENERIC_ENABLED 1
+
+static void read_srat_initiators()
+{
+	ACPI_TABLE_SRAT* srat = nullptr;
+	if (!ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_SRAT, 0, (ACPI_TABLE_HEADER**)&srat)))
+		return;
+	ACPI_SUBTABLE_HEADER* subtable = mem_after<ACPI_SUBTABLE_HEADER*>(srat);
+	while (raw_diff(subtable, srat) < srat->Header.Length)
+	{
+		if (subtable->Type == ACPI_SRAT_TYPE_GENERIC_AFFINITY)
+		{
+			ACPI_SRAT_GENERIC_AFFINITY* aff = (ACPI_SRAT_GENERIC_AFFINITY*)subtable;
+			if (aff->DeviceHandleType == SRAT_HANDLE_PCI && (aff->Flags & SRAT_GENERIC_ENABLED))
+			{
+				uint16_t segment = aff->DeviceHandle[0] | (aff->DeviceHandle[1] << 8);
+				uint16_t bdf = (aff->DeviceHandle[2] << 8) | aff->DeviceHandle[3];
+				pci_device_nodes[PCI_NODE_KEY(segment, bdf)] = aff->ProximityDomain;
+			}
+		}
+		subtable = raw_offset<ACPI_SUBTABLE_HEADER*>(subtable, subtable->Length);
+	}
+}
+
+static bool evaluate_integer(ACPI_HANDLE object, const char* method, uint64_t* value)
+{
+	ACPI_OBJECT result;
+	ACPI_BUFFER buffer;
+	buffer.Length = sizeof(result);
+	buffer.Pointer = &result;
+	if (!ACPI_SUCCESS(AcpiEvaluateObjectTyped(object, (ACPI_STRING)method, NULL, &buffer, ACPI_TYPE_INTEGER)))
+		return false;
+	*value = result.Integer.Value;
+	return true;
+}
+
+static ACPI_STATUS root_bridge_walker(ACPI_HANDLE Object, UINT32 NestingLevel, void* Context, void** ReturnValue)
+{
+	uint64_t proximity;
+	if (!evaluate_integer(Object, "_PXM", &proximity))
+		return AE_OK;
+	//Both default to 0 when absent
+	uint64_t segment = 0, bus = 0;
+	evaluate_integer(Object, "_SEG", &segment);
+	evaluate_integer(Object, "_BBN", &bus);
+	pci_root_nodes[PCI_NODE_KEY(segment, (bus & 0xFF) << 8)] = proximity;
+	return AE_OK;
+}
+
+//The namespace may not be loaded, in which case only the SRAT helps
+static void read_pci_locality()
+{
+	read_srat_initiators();
+	AcpiGetDevices((char*)"PNP0A08", &root_bridge_walker, nullptr, nullptr);
+	AcpiGetDevices((char*)"PNP0A03", &root_bridge_walker, nullptr, nullptr);
+}
+
+numa_t pci_device_node(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function)
+{
+	uint16_t bdf = ((bus & 0xFF) << 8) | ((device & 0x1F) << 3) | (function & 0x7);
+	auto devit = pci_device_nodes.find(PCI_NODE_KEY(segment, bdf));
+	if (devit != pci_device_nodes.end())
+		return devit->second;
+	//Buses below a root bridge are numbered from its base bus up to the next bridge's
+	numa_t node = NUMA_STRIPE;
+	uint32_t best = 0;
+	bool found = false;
+	for (auto it = pci_root_nodes.begin(); it != pci_root_nodes.end(); ++it)
+	{
+		uint32_t key = it->first;
+		if ((key >> 16) != segment || ((key >> 8) & 0xFF) > bus)
+			continue;
+		if (!found || key > best)
+		{
+			best = key;
+			node = it->second;
+			found = true;
+		}
+	}
+	return node;
+}
+
+paddr_t pci_allocate_dma(const pci_address* address, size_t pages, uint8_t region)
+{
+	numa_t node = pci_device_node(address->segment, address->bus, address->device, address->function);
+	return pmmngr_allocate(pages, region, node);
+}
+
+void* pci_allocate_local(const pci_address* address, size_t size)
+{
+	return node_alloc(size, pci_device_node(address->segment, address->bus, address->device, address->function));
+}
+
 void initialize_pci_drivers()
 {
-	pci_bus_scan(&pci_driver_matcher);
+	read_pci_locality();
+	//Buses are enumerated concurrently, then every driver gets a thread for its devices.
+	//Legacy config access goes through one shared address port, so it scans serially
+	if (mcfg)
+	{
+		//Held by us until every root bus is queued
+		scans_pending.store(1);
+		for (size_t n = 0; n < ecam_segment_count; ++n)
+			scan_segment_async(ecam_segments[n].alloc);
+		probe_done(scans_pending);
+		wait_counter(scans_pending, TIMEOUT_INFINITY);
+	}
+	else
+		checkAllBuses(0, 0, 255, &pci_probe_matcher);
+	auto st = acquire_spinlock(probe_lock);
+	pci_probe_driver* driver = probe_drivers;
+	probe_drivers = nullptr;
+	release_spinlock(probe_lock, st);
+	while (driver)
+	{
+		//The thread frees the driver's queue
+		pci_probe_driver* next = driver->next;
+		create_thread(&pci_probe_thread, driver, THREAD_PRIORITY_NORMAL, DRIVER_TASK);
+		driver = next;
+	}
 	driver_init = true;
 }
-
@@ -47,10 +47,38 @@ CHAIKRNL_FUNC uint8_t pci_get_subclass(uint16_t segment, uint8_t bus, uint8_t de
 CHAIKRNL_FUNC uint32_t pci_get_classcode(uint16_t segment, uint8_t bus, uint8_t device, uint8_t function);
 CHAIKRNL_FUNC uint8_t pci_get_header_type(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function);
 
+struct pci_msi_vector {
+	uint32_t vector;
+	uint32_t processor;
+};
+
+//Allocates numintrs vectors on the calling CPU, all with the same handler and param. Returns the first vector, or -1
 CHAIKRNL_FUNC uint32_t PciAllocateMsi(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t numintrs, dispatch_interrupt_handler handler, void* param);
+/*
+Allocates up to numintrs vectors, MSI-X table entry n raising handler(vector, params[n]) on processors[n].
+A null processors spreads the entries over the online CPUs, so numintrs = xcall_online_cpus() gives one vector per CPU.
+params may be null. Plain MSI devices get a single vector. Returns how many vectors were set up, written to vectors
+*/
+CHAIKRNL_FUNC uint32_t PciAllocateMsiVectors(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t numintrs, const uint32_t* processors, dispatch_interrupt_handler handler, void* const* params, pci_msi_vector* vectors);
+//Masks or unmasks one MSI-X table entry. Fails for devices without an MSI-X table set up by PciAllocateMsiVectors
+CHAIKRNL_FUNC bool PciMaskMsiVector(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function, uint32_t entry, bool masked);
+
 CHAIKRNL_FUNC void pci_bus_scan(pci_scan_callback callback);
 
+//NUMA node the device is attached to, from the SRAT or its root bridge's _PXM. NUMA_STRIPE if unknown
+CHAIKRNL_FUNC numa_t pci_device_node(uint16_t segment, uint16_t bus, uint16_t device, uint16_t function);
+//pmmngr_allocate on the device's node, for queues and DMA buffers
+CHAIKRNL_FUNC paddr_t pci_allocate_dma(const pci_address* address, size_t pages, uint8_t region = ARCH_PHY_REGION_PCIDMA);
+//node_alloc on the device's node. Page granular, free with node_free
+CHAIKRNL_FUNC void* pci_allocate_local(const pci_address* address, size_t size);
+
 CHAIKRNL_FUNC void register_pci_driver(pci_device_registration* registr);
+//Enumerates the buses and starts probing matched devices, without waiting for the probes
 void initialize_pci_drivers();
 
+#define PCI_BASECLASS_STORAGE 0x01
+#define PCI_BASECLASS_SERIAL 0x0C
+//Waits for probes of devices in baseclass to finish, or all of them with PCI_CLASS_ANY. Returns false on timeout
+CHAIKRNL_FUNC bool pci_wait_probes(uint8_t baseclass, size_t timeout);
+
 #endif
@@ -0,0 +1,33 @@
+#include <percpu.h>
+#include <string.h>
+
+static const size_t PERCPU_MAX_CPUS = 256;
+//Copies get their own cache lines, whatever the template's alignment
+static const size_t PERCPU_ALIGN = 64;
+
+//Bound the section. The linker sorts .pcpu$A, $M, $Z by name
+__declspec(allocate(".pcpu$A")) static uint64_t percpu_start = 0;
+__declspec(allocate(".pcpu$Z")) static uint64_t percpu_end = 0;
+
+static size_t volatile percpu_offsets[PERCPU_MAX_CPUS] = { 0 };
+
+void percpu_setup_cpu()
+{
+	uint8_t* start = (uint8_t*)&percpu_start;
+	size_t length = raw_diff(&percpu_end, &percpu_start);
+	uint8_t* block = new uint8_t[length + PERCPU_ALIGN - 1];
+	if (!block)
+		return;
+	//Keep the template's offset within a line, so variables stay aligned
+	size_t misalign = ((size_t)start - (size_t)block) & (PERCPU_ALIGN - 1);
+	block += misalign;
+	memcpy(block, start, length);
+	size_t offset = (size_t)block - (size_t)start;
+	percpu_offsets[pcpu_data.cpuid % PERCPU_MAX_CPUS] = offset;
+	pcpu_data.percpuoffset = offset;
+}
+
+size_t percpu_cpu_offset(uint32_t processor)
+{
+	return percpu_offsets[processor % PERCPU_MAX_CPUS];
+}
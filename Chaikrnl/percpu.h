@@ -0,0 +1,55 @@
+#ifndef CHAIOS_PERCPU_H
+#define CHAIOS_PERCPU_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+#include <arch/cpu.h>
+
+/*
+Per-CPU variables. Definitions go in the .pcpu section of the kernel image, which is copied for each CPU as it comes up.
+The variable as defined is the template. Until a CPU has its own copy, its accesses go to the template, and the copy starts from whatever the template holds.
+Finding this CPU's copy is one per-CPU data load and an add. Kernel image only, drivers have their own sections.
+*/
+#pragma section(".pcpu$A", read, write)
+#pragma section(".pcpu$M", read, write)
+#pragma section(".pcpu$Z", read, write)
+
+#define DEFINE_PER_CPU(type, name) __declspec(allocate(".pcpu$M")) type name
+#define DECLARE_PER_CPU(type, name) extern type name
+
+//Copies the template for the current CPU and points its per-CPU data at the copy
+void percpu_setup_cpu();
+//Offset from the template to processor's copy. Returns 0 if it has none yet
+size_t percpu_cpu_offset(uint32_t processor);
+
+//The current CPU's copy. Only stable while the thread can't migrate, see percpu_guard
+template <class T> T* this_cpu_ptr(T& var)
+{
+	return (T*)((uint8_t*)&var + (size_t)pcpu_data.percpuoffset);
+}
+
+template <class T> T* per_cpu_ptr(T& var, uint32_t processor)
+{
+	return (T*)((uint8_t*)&var + percpu_cpu_offset(processor));
+}
+
+//Holds interrupts off, so the thread stays on this CPU while it uses its copy
+template <class T> class percpu_guard {
+public:
+	percpu_guard(T& var)
+		:m_state(arch_disable_interrupts())
+	{
+		m_ptr = this_cpu_ptr(var);
+	}
+	~percpu_guard()
+	{
+		arch_restore_state(m_state);
+	}
+	T* operator->() { return m_ptr; }
+	T& operator*() { return *m_ptr; }
+private:
+	cpu_status_t m_state;
+	T* m_ptr;
+};
+
+#endif
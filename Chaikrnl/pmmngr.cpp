@@ -6,6 +6,7 @@
 #include <linkedlist.h>
 #include <string.h>
 #include <arch/paging.h>
+#include <spinlock.h>
 
 struct pmmngr_boot_info {
 	paddr_t* pgstack;
@@ -20,6 +21,9 @@ static paddr_t* allocated_stack;
 static paddr_t* allocated_stack_ptr;
 
 static bool early_mode = true;
+//Guards the free lists once out of early mode
+static spinlock_t pmm_lock = nullptr;
+static lock_class_key pmm_lock_key = { "pmmngr" };
 
 static paddr_t max_phy_addr = 0;
 static size_t num_colours = 1;
@@ -516,6 +520,8 @@ static void FillPageDatabase(paddr_t start, paddr_t length, bool usable, bool fr
 static void uefi_startup(void* memmap)
 {
 	EfiMemoryMap* map = (EfiMemoryMap*)memmap;
+	//First, while any pages it takes still go through the early stack below
+	pmm_lock = create_spinlock_class(&pmm_lock_key);
 	//NUMA information
 	ACPI_TABLE_SRAT* srat = nullptr;
 	AcpiGetTable(ACPI_SIG_SRAT, 0, (ACPI_TABLE_HEADER**)&srat);
@@ -594,6 +600,10 @@ paddr_t pmmngr_allocate(size_t pages, uint8_t region, numa_t domain, cache_colou
 	{
 		if (pages != 1)
 			return 0;
+		//Proximity domains from firmware aren't always ones we have memory in
+		if (domain != NUMA_STRIPE && domaininf.find(domain) == domaininf.end())
+			domain = NUMA_STRIPE;
+		auto st = acquire_spinlock(pmm_lock);
 		if (domain == NUMA_STRIPE)
 		{
 			domain = striper++;
@@ -621,13 +631,16 @@ paddr_t pmmngr_allocate(size_t pages, uint8_t region, numa_t domain, cache_colou
 				}
 			}
 		}
-		++(val->ref_count);
+		if (val)
+			++(val->ref_count);
+		release_spinlock(pmm_lock, st);
 		return val == nullptr ? 0 : GetPaddr(val);
 	}
 }
 
 void pmmngr_free(paddr_t addr, size_t length)
 {
+	auto st = acquire_spinlock(pmm_lock);
 	for (size_t n = 0; n < length; ++n, addr += PAGESIZE)
 	{
 		page* pg = GetPFD(addr);
@@ -640,6 +653,7 @@ void pmmngr_free(paddr_t addr, size_t length)
 			regions_allocator[region][domain][col].insert(pg);
 		}
 	}
+	release_spinlock(pmm_lock, st);
 }
 
 BOOL PmmngrLockPageDma(paddr_t paddr)
@@ -0,0 +1,200 @@
+#include <rcu.h>
+#include <spinlock.h>
+#include <semaphore.h>
+#include <scheduler.h>
+#include <arch/cpu.h>
+
+//Indexed by APIC ID, which MADT local APIC entries limit to 8 bits
+static const size_t RCU_MAX_CPUS = 256;
+
+struct __declspec(align(64)) rcu_cpu {
+	volatile size_t nesting;
+	//Bumped by this CPU only, at each quiescent state outside a read section
+	volatile uint64_t qs_count;
+	volatile size_t online;
+};
+
+static rcu_cpu rcu_cpus[RCU_MAX_CPUS];
+
+struct rcu_list {
+	rcu_head* head;
+	rcu_head* tail;
+};
+
+static void rcu_list_append(rcu_list& list, rcu_list& other)
+{
+	if (!other.head)
+		return;
+	if (list.tail)
+		list.tail->next = other.head;
+	else
+		list.head = other.head;
+	list.tail = other.tail;
+	other.head = other.tail = nullptr;
+}
+
+//Callbacks queued since the current grace period started, those waiting on it, and those ready to run
+static rcu_list pending = { nullptr, nullptr };
+static rcu_list waiting = { nullptr, nullptr };
+static rcu_list done = { nullptr, nullptr };
+static bool gp_active = false;
+static uint64_t gp_snapshot[RCU_MAX_CPUS];
+
+static spinlock_t rcu_lock = nullptr;
+static lock_class_key rcu_lock_key = { "rcu" };
+static semaphore_t rcu_sem = nullptr;
+static volatile bool rcu_ready = false;
+
+static spinlock_t get_rcu_lock()
+{
+	if (!rcu_lock)
+	{
+		spinlock_t lock = create_spinlock_class(&rcu_lock_key);
+		if (!arch_cas((volatile size_t*)&rcu_lock, 0, (size_t)lock))
+			delete_spinlock(lock);
+	}
+	return rcu_lock;
+}
+
+static rcu_cpu* this_rcu_cpu()
+{
+	return &rcu_cpus[pcpu_data.cpuid % RCU_MAX_CPUS];
+}
+
+EXTERN CHAIKRNL_FUNC void rcu_read_lock()
+{
+	rcu_cpu* cpu = this_rcu_cpu();
+	//First use on this CPU. The locked CAS orders it before our loads of protected pointers
+	if (!cpu->online)
+		arch_cas(&cpu->online, 0, 1);
+	++cpu->nesting;
+}
+
+EXTERN CHAIKRNL_FUNC void rcu_read_unlock()
+{
+	--this_rcu_cpu()->nesting;
+}
+
+uint8_t rcu_in_read_section()
+{
+	return this_rcu_cpu()->nesting != 0 ? 1 : 0;
+}
+
+void rcu_quiescent_state()
+{
+	rcu_cpu* cpu = this_rcu_cpu();
+	if (cpu->nesting != 0)
+		return;
+	if (!cpu->online)
+		arch_cas(&cpu->online, 0, 1);
+	++cpu->qs_count;
+}
+
+EXTERN CHAIKRNL_FUNC void call_rcu(rcu_head* head, rcu_callback func)
+{
+	head->next = nullptr;
+	head->func = func;
+	rcu_list single = { head, head };
+	auto st = acquire_spinlock(get_rcu_lock());
+	rcu_list_append(pending, single);
+	release_spinlock(rcu_lock, st);
+}
+
+static bool grace_period_elapsed()
+{
+	for (size_t n = 0; n < RCU_MAX_CPUS; ++n)
+	{
+		if (rcu_cpus[n].online && rcu_cpus[n].qs_count == gp_snapshot[n])
+			return false;
+	}
+	return true;
+}
+
+void rcu_timer_tick()
+{
+	//Racy peek, a callback missed here is picked up next tick
+	if (!rcu_ready || (!gp_active && !pending.head))
+		return;
+	bool wake = false;
+	auto st = acquire_spinlock(rcu_lock);
+	if (gp_active && grace_period_elapsed())
+	{
+		rcu_list_append(done, waiting);
+		gp_active = false;
+		wake = true;
+	}
+	if (!gp_active && pending.head)
+	{
+		rcu_list_append(waiting, pending);
+		for (size_t n = 0; n < RCU_MAX_CPUS; ++n)
+			gp_snapshot[n] = rcu_cpus[n].qs_count;
+		gp_active = true;
+	}
+	release_spinlock(rcu_lock, st);
+	if (wake)
+		signal_semaphore(rcu_sem, 1);
+}
+
+//Callbacks free memory, so they run in a thread rather than the timer interrupt
+static void rcu_thread(void*)
+{
+	while (1)
+	{
+		wait_semaphore(rcu_sem, 1, TIMEOUT_INFINITY);
+		auto st = acquire_spinlock(rcu_lock);
+		rcu_head* head = done.head;
+		done.head = done.tail = nullptr;
+		release_spinlock(rcu_lock, st);
+		while (head)
+		{
+			rcu_head* next = head->next;
+			head->func(head);
+			head = next;
+		}
+	}
+}
+
+struct rcu_sync {
+	rcu_head head;
+	semaphore_t sem;
+	//Set instead of signalling when there's no semaphore
+	volatile bool done;
+};
+
+static void rcu_sync_callback(rcu_head* head)
+{
+	rcu_sync* sync = (rcu_sync*)head;
+	//The waiter may return as soon as done is set, so don't touch sync after
+	if (sync->sem)
+		signal_semaphore(sync->sem, 1);
+	else
+		sync->done = true;
+}
+
+EXTERN CHAIKRNL_FUNC void synchronize_rcu()
+{
+	//Nothing can be preempted inside a read section before the scheduler runs
+	if (!rcu_ready)
+		return;
+	rcu_sync sync;
+	sync.sem = create_semaphore(0, u"synchronize_rcu");
+	sync.done = false;
+	call_rcu(&sync.head, &rcu_sync_callback);
+	if (!sync.sem)
+	{
+		//Couldn't get a semaphore, poll for the grace period instead
+		while (!sync.done)
+			scheduler_schedule(0);
+		return;
+	}
+	wait_semaphore(sync.sem, 1, TIMEOUT_INFINITY);
+	delete_semaphore(sync.sem);
+}
+
+void rcu_init()
+{
+	get_rcu_lock();
+	rcu_sem = create_semaphore(0, u"RCU callbacks");
+	create_thread(&rcu_thread, nullptr, THREAD_PRIORITY_NORMAL, KERNEL_TASK);
+	rcu_ready = true;
+}
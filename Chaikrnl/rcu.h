@@ -0,0 +1,53 @@
+#ifndef CHAIOS_RCU_H
+#define CHAIOS_RCU_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+/*
+Read-copy-update. Readers bracket lookups with rcu_read_lock/rcu_read_unlock, which are plain per-CPU increments.
+Writers publish a new copy with rcu_assign_pointer, then free the old one with call_rcu once every CPU has passed through a quiescent state:
+a context switch, the idle loop, or a timer tick that didn't interrupt a read section.
+Read sections may nest, and may be used in interrupt handlers, but must not block.
+*/
+typedef struct _rcu_head rcu_head;
+typedef void(*rcu_callback)(rcu_head* head);
+
+struct _rcu_head {
+	rcu_head* next;
+	rcu_callback func;
+};
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+CHAIKRNL_FUNC void rcu_read_lock();
+CHAIKRNL_FUNC void rcu_read_unlock();
+//Runs func(head) from the RCU thread after a grace period. head is usually embedded in the object being freed
+CHAIKRNL_FUNC void call_rcu(rcu_head* head, rcu_callback func);
+//Blocks until all read sections running at the time of the call have finished
+CHAIKRNL_FUNC void synchronize_rcu();
+
+#ifdef __cplusplus
+}
+
+//Volatile accesses keep the compiler from caching or reordering the pointer, x86 needs no fences
+template <class T> T* rcu_dereference(T* const volatile& p)
+{
+	return p;
+}
+template <class T> void rcu_assign_pointer(T* volatile& p, T* v)
+{
+	p = v;
+}
+#endif
+
+//Scheduler hooks
+void rcu_init();
+//Interrupts off. Does nothing inside a read section
+void rcu_quiescent_state();
+uint8_t rcu_in_read_section();
+void rcu_timer_tick();
+
+#endif
@@ -7,6 +7,9 @@
 #include <kstdio.h>
 #include <liballoc.h>
 #include <string.h>
+#include <rcu.h>
+#include <waitaddr.h>
+#include <kmem_cache.h>
 
 enum THREAD_STATE {
 	RUNNING,
@@ -17,6 +20,24 @@ enum THREAD_STATE {
 	TERMINATED
 };
 
+enum SCHED_CLASS {
+	SCHED_CLASS_NORMAL,
+	SCHED_CLASS_DEADLINE
+};
+
+//Constant bandwidth server reservation. Times are in system timer ticks
+struct deadline_params {
+	uint64_t runtime;
+	uint64_t deadline;
+	uint64_t period;
+	uint64_t bandwidth;
+	uint64_t period_start;
+	uint64_t abs_deadline;
+	int64_t remaining;
+	uint64_t last_update;
+	bool throttled;
+};
+
 static bool scheduler_ready = false;
 
 static const int INITTLSSIZE = 16;
@@ -57,8 +78,17 @@ typedef struct _thread {
 	void* timeout_event;
 	PTLSBLOCK threadlocal;
 	size_t priority;
+	thread_pi_state pi_state;
+	SCHED_CLASS sched_class;
+	deadline_params dl;
+	//On one of the ready lists, under ready_lock. READY alone doesn't say, a thread is READY before it's queued and after it's popped
+	bool queued;
+	//Set while the thread's context is loaded on a CPU. Read without locks by adaptive mutexes
+	volatile uint8_t on_cpu;
 }THREAD, *PTHREAD;
 
+static lock_class_key thread_lock_key = { "thread" };
+
 #define CURRENT_THREAD() \
 ((PTHREAD)(void*)pcpu_data.runningthread)
 
@@ -77,13 +107,178 @@ static linked_list_node < PTHREAD>& get_node(PTHREAD thread)
 typedef RedBlackTree<HTHREAD, PTHREAD> thread_map;
 
 static spinlock_t allthreads_lock;
+static lock_class_key allthreads_lock_key = { "all_threads" };
 static thread_map all_threads;
 
 typedef LinkedList<PTHREAD> thread_list;
 
 static spinlock_t ready_lock;
+static lock_class_key ready_lock_key = { "ready_queue" };
 static thread_list ready;
 
+//Deadline threads, also under ready_lock
+static thread_list dl_ready;
+static thread_list dl_throttled;
+static volatile uint64_t dl_ready_earliest = UINT64_MAX;
+static uint64_t dl_total_bandwidth = 0;
+static size_t dl_thread_count = 0;
+
+static const uint64_t DL_BW_SHIFT = 20;
+//Share of a CPU deadline threads may reserve, leaves headroom for the normal class
+static const uint64_t DL_BW_LIMIT_PERCENT = 95;
+static const uint64_t DL_BW_LIMIT = (DL_BW_LIMIT_PERCENT << DL_BW_SHIFT) / 100;
+//Admission limit on deadline threads, which keeps the linear EDF scans short
+static const size_t DL_MAX_THREADS = 64;
+
+//Indexed by processor ID, like the rest of the per-CPU tables
+static const size_t SCHED_MAX_CPUS = 256;
+//Each CPU's idle thread. Never queued, it runs when a CPU has nothing else
+static PTHREAD idle_threads[SCHED_MAX_CPUS];
+
+static void update_dl_earliest()
+{
+	uint64_t earliest = UINT64_MAX;
+	for (auto it = dl_ready.begin(); it != dl_ready.end(); ++it)
+	{
+		if (it->dl.abs_deadline < earliest)
+			earliest = it->dl.abs_deadline;
+	}
+	dl_ready_earliest = earliest;
+}
+
+//ready_lock must be held
+static void enqueue_ready(PTHREAD thread)
+{
+	if (thread->threadtype == KERNEL_IDLE)
+		return;
+	thread->queued = true;
+	if (thread->sched_class != SCHED_CLASS_DEADLINE)
+		ready.insert(thread);
+	else if (thread->dl.throttled)
+		dl_throttled.insert(thread);
+	else
+	{
+		dl_ready.insert(thread);
+		if (thread->dl.abs_deadline < dl_ready_earliest)
+			dl_ready_earliest = thread->dl.abs_deadline;
+	}
+}
+
+static void dequeue_ready(PTHREAD thread)
+{
+	thread->queued = false;
+	if (thread->sched_class != SCHED_CLASS_DEADLINE)
+		ready.remove(thread);
+	else if (thread->dl.throttled)
+		dl_throttled.remove(thread);
+	else
+	{
+		dl_ready.remove(thread);
+		update_dl_earliest();
+	}
+}
+
+//Earliest deadline first, then round robin. dl_ready holds at most DL_MAX_THREADS, so a scan beats keeping it sorted
+static PTHREAD pop_ready()
+{
+	PTHREAD best = nullptr;
+	for (auto it = dl_ready.begin(); it != dl_ready.end(); ++it)
+	{
+		if (!best || it->dl.abs_deadline < best->dl.abs_deadline)
+			best = *it;
+	}
+	if (best)
+	{
+		dl_ready.remove(best);
+		update_dl_earliest();
+	}
+	else
+		best = ready.pop();
+	if (best)
+		best->queued = false;
+	return best;
+}
+
+//CBS wakeup rule: keep the old deadline only if the remaining budget can't overrun the reserved bandwidth
+static void deadline_wakeup(PTHREAD thread, uint64_t now)
+{
+	if (thread->sched_class != SCHED_CLASS_DEADLINE || thread->dl.throttled)
+		return;
+	deadline_params& dl = thread->dl;
+	//An overrun isn't budget. Left at zero, the next charge throttles it
+	if (dl.remaining < 0)
+		dl.remaining = 0;
+	if (now >= dl.abs_deadline || (uint64_t)dl.remaining * dl.period > (dl.abs_deadline - now) * dl.runtime)
+	{
+		dl.period_start = now;
+		dl.abs_deadline = now + dl.deadline;
+		dl.remaining = dl.runtime;
+	}
+}
+
+static void deadline_replenish(uint64_t now)
+{
+	if (dl_throttled.length() == 0)
+		return;
+	auto st = acquire_spinlock(ready_lock);
+	for (auto it = dl_throttled.begin(); it != dl_throttled.end();)
+	{
+		PTHREAD thread = *it;
+		++it;
+		deadline_params& dl = thread->dl;
+		if (now < dl.period_start + dl.period)
+			continue;
+		dl_throttled.remove(thread);
+		dl.period_start = now;
+		dl.abs_deadline = now + dl.deadline;
+		dl.remaining = dl.runtime;
+		dl.throttled = false;
+		enqueue_ready(thread);
+	}
+	release_spinlock(ready_lock, st);
+}
+
+//Charges the running deadline thread on this CPU. Returns true if we should reschedule now
+static bool deadline_update_current(PTHREAD thread, uint64_t now)
+{
+	uint64_t current_deadline = UINT64_MAX;
+	if (thread && thread->sched_class == SCHED_CLASS_DEADLINE)
+	{
+		deadline_params& dl = thread->dl;
+		dl.remaining -= (int64_t)(now - dl.last_update);
+		dl.last_update = now;
+		if (dl.remaining <= 0 && !dl.throttled)
+		{
+			dl.throttled = true;
+			return true;
+		}
+		if (!dl.throttled)
+			current_deadline = dl.abs_deadline;
+	}
+	return dl_ready_earliest < current_deadline;
+}
+
+static bool keep_current(PTHREAD thread, PTHREAD next)
+{
+	if (thread->state != RUNNING)
+		return false;
+	//RCU read sections are not preemptible
+	if (rcu_in_read_section())
+		return true;
+	if (thread->sched_class == SCHED_CLASS_DEADLINE)
+	{
+		//Out of budget, it waits for replenishment whatever else is ready
+		if (thread->dl.throttled)
+			return false;
+		if (next->sched_class != SCHED_CLASS_DEADLINE)
+			return true;
+		return thread->dl.abs_deadline <= next->dl.abs_deadline;
+	}
+	if (next->sched_class == SCHED_CLASS_DEADLINE)
+		return false;
+	return next->priority < thread->priority;
+}
+
 static void ap_startup_routine(void* data)
 {
 	while (1)
@@ -93,12 +288,23 @@ static void ap_startup_routine(void* data)
 static void idle_thread(void*)
 {
 	while (1)
+	{
+		//The idle loop holds no RCU references. Interrupts off, so a tick can't race the count
+		auto st = arch_disable_interrupts();
+		rcu_quiescent_state();
+		arch_restore_state(st);
 		arch_halt();
+	}
+}
+
+static void create_idle_thread(uint32_t processor)
+{
+	idle_threads[processor % SCHED_MAX_CPUS] = (PTHREAD)create_thread(&idle_thread, nullptr, THREAD_PRIORITY_IDLE, KERNEL_IDLE);
 }
 
 static bool tap_callback(uint32_t apid)
 {
-	create_thread(&idle_thread, nullptr, THREAD_PRIORITY_IDLE, KERNEL_IDLE);
+	create_idle_thread(apid);
 	ap_run_routine(apid, &ap_startup_routine, nullptr);
 	return false;
 }
@@ -122,12 +328,15 @@ void destroy_thread(HTHREAD thread)
 	auto oldstate = pt->state;
 	pt->state = TERMINATING;
 	release_spinlock(pt->thread_lock, st);
-	if (oldstate == READY)
+	st = acquire_spinlock(ready_lock);
+	if (pt->queued)
+		dequeue_ready(pt);
+	if (pt->sched_class == SCHED_CLASS_DEADLINE)
 	{
-		st = acquire_spinlock(ready_lock);
-		ready.remove(pt);
-		release_spinlock(ready_lock, st);
+		dl_total_bandwidth -= pt->dl.bandwidth;
+		--dl_thread_count;
 	}
+	release_spinlock(ready_lock, st);
 }
 
 struct timeout_event {
@@ -143,6 +352,8 @@ linked_list_node<timeout_event*>& timeout_nodef(timeout_event* e)
 
 LinkedList<timeout_event*> timeouts;
 spinlock_t timeout_lock;
+static lock_class_key timeout_lock_key = { "timeouts" };
+static kmem_cache_t timeout_cache = nullptr;
 
 void scheduler_timer_tick()
 {
@@ -161,8 +372,10 @@ void scheduler_timer_tick()
 			thread->timeout_event = nullptr;
 			release_spinlock(thread->thread_lock, st2);
 			st2 = acquire_spinlock(ready_lock);
-			ready.insert(thread);
+			deadline_wakeup(thread, arch_get_system_timer());
+			enqueue_ready(thread);
 			release_spinlock(ready_lock, st2);
+			//The waiter frees the event. Freeing can refill the cache's magazines, which isn't for interrupt context
 			auto rem = *it;
 			++it;
 			timeouts.remove(rem);
@@ -172,38 +385,53 @@ void scheduler_timer_tick()
 	}
 	release_spinlock(timeout_lock, st);
 #endif
+	deadline_replenish(arch_get_system_timer());
+	//Interrupts are off, so only a read section the tick interrupted stops this counting
+	rcu_quiescent_state();
+	rcu_timer_tick();
 }
 
 void scheduler_schedule(uint64_t tick)
 {
 	if (!scheduler_ready)
 		return;
-	if (tick > 0 && tick % quantum != 0)
+	uint64_t now = arch_get_system_timer();
+	auto cpustat = arch_disable_interrupts();
+	PTHREAD thread = CURRENT_THREAD();
+	bool dl_resched = deadline_update_current(thread, now);
+	if (!dl_resched && tick > 0 && tick % quantum != 0)
+	{
+		arch_restore_state(cpustat);
 		return;
+	}
+	//About to switch. Ticks in between are counted by scheduler_timer_tick
+	rcu_quiescent_state();
 	uint32_t current_irql = pcpu_data.irql;
 	//kprintf(u"SCHEDULING\b\b\b\b\b\b\b\b\b\b");
-	auto cpustat = arch_disable_interrupts();
-	PTHREAD thread = CURRENT_THREAD();
 get_ready:
 	//kprintf(u"READY LOCK\b\b\b\b\b\b\b\b\b\b");
 	auto stat = acquire_spinlock(ready_lock);
-	PTHREAD next = ready.pop();
+	PTHREAD next = pop_ready();
 	release_spinlock(ready_lock, stat);
 	//kprintf(u"UNLOCKINGR\b\b\b\b\b\b\b\b\b\b");
 	if (!next)
 	{
-		goto sched_end;
+		//Nothing queued. A thread that can't carry on, because it's blocking or a deadline thread out of budget, gives way to the idle thread
+		PTHREAD idle = idle_threads[pcpu_data.cpuid % SCHED_MAX_CPUS];
+		if (!idle || idle == thread || (thread && thread->state == RUNNING && !(thread->sched_class == SCHED_CLASS_DEADLINE && thread->dl.throttled)))
+			goto sched_end;
+		next = idle;
 	}
-	if (next->state != READY)
+	else if (next->state != READY)
 	{
 		goto get_ready;
 	}
 #if 1
-	if (thread != 0 && next->priority < thread->priority && thread->state == RUNNING)
+	if (thread != 0 && keep_current(thread, next))
 	{
 		//kprintf(u"READY SPIN\b\b\b\b\b\b\b\b\b\b");
 		stat = acquire_spinlock(ready_lock);
-		ready.insert(next);
+		enqueue_ready(next);
 		release_spinlock(ready_lock, stat);
 		//kprintf(u"UNLOCKINGS\b\b\b\b\b\b\b\b\b\b");
 		goto sched_end;
@@ -216,6 +444,9 @@ get_ready:
 			//kprintf(u"MAIN SWITCH\b\b\b\b\b\b\b\b\b\b\b");
 			stat = acquire_spinlock(ready_lock);
 			next->state = RUNNING;
+			next->dl.last_update = now;
+			next->on_cpu = 1;
+			thread->on_cpu = 0;
 			pcpu_data.runningthread = next;
 			//kprintf(u"LOCK THREAD\b\b\b\b\b\b\b\b\b\b\b");
 			auto dstat = acquire_spinlock(thread->thread_lock);
@@ -229,7 +460,7 @@ get_ready:
 				break;
 			case RUNNING:
 				thread->state = READY;
-				ready.insert(thread);
+				enqueue_ready(thread);
 			}
 			release_spinlock(thread->thread_lock, dstat);
 			release_spinlock(ready_lock, stat);
@@ -242,6 +473,8 @@ get_ready:
 	else
 	{
 		next->state = RUNNING;
+		next->dl.last_update = now;
+		next->on_cpu = 1;
 		pcpu_data.runningthread = next;
 		//kprintf(u"THREAD SWITCH: %x\n", next->handle);
 		arch_write_tls_base(next->threadlocal, 0);
@@ -263,33 +496,43 @@ sched_end:
 #include <kernelinfo.h>
 EXTERN PKERNEL_BOOT_INFO getBootInfo();
 
+//Static, so mutexes taken before the scheduler starts already have their owner's object
+static THREAD boot_thread;
+
 void scheduler_init(void(*eoi)())
 {
 	the_eoi = eoi;
 	//Create thread database
-	PTHREAD kthread = new THREAD;	//Initial kernel thread
+	PTHREAD kthread = &boot_thread;	//Initial kernel thread
 	memset(kthread, 0, sizeof(THREAD));
 	kthread->cpu_id = arch_current_processor_id();
 	kthread->state = RUNNING;
+	kthread->on_cpu = 1;
 	kthread->kernel_stack = getBootInfo()->bootstack;
 	kthread->user_stack = nullptr;
 	kthread->timeout_event = nullptr;
 	kthread->handle = (HTHREAD)1;
 	kthread->threadctxt = context_factory();
-	kthread->thread_lock = create_spinlock();
+	kthread->thread_lock = create_spinlock_class(&thread_lock_key);
 	kthread->priority = THREAD_PRIORITY_NORMAL;
+	kthread->pi_state.base_priority = THREAD_PRIORITY_NORMAL;
 	kthread->threadtype = KERNEL_MAIN;
 	kthread->threadlocal = tls_block_factory();
 	arch_write_tls_base(kthread->threadlocal, 0);
 	all_threads[kthread->handle] = kthread;
-	allthreads_lock = create_spinlock();
+	allthreads_lock = create_spinlock_class(&allthreads_lock_key);
 	//arch_set_breakpoint(allthreads_lock, 4, BREAKPOINT_WRITE);
 	pcpu_data.runningthread = kthread;
 	ready.init(&get_node);
-	ready_lock = create_spinlock();
-	timeout_lock = create_spinlock();
+	dl_ready.init(&get_node);
+	dl_throttled.init(&get_node);
+	ready_lock = create_spinlock_class(&ready_lock_key);
+	timeout_lock = create_spinlock_class(&timeout_lock_key);
 	timeouts.init(&timeout_nodef);
-	create_thread(&idle_thread, nullptr, THREAD_PRIORITY_IDLE, KERNEL_IDLE);
+	timeout_cache = kmem_cache_create("timeout_event", sizeof(timeout_event), 0, nullptr, nullptr, nullptr);
+	create_idle_thread(pcpu_data.cpuid);
+	waitaddr_init();
+	rcu_init();
 	scheduler_ready = true;
 	iterate_aps(&tap_callback);
 }
@@ -335,7 +578,7 @@ EXTERN CHAIKRNL_FUNC HTHREAD create_thread(thread_proc proc, void* param, size_t
 		return nullptr;
 	if (!(thread->kernel_stack = arch_create_stack(0, 0)))
 		return nullptr;
-	if (!(thread->thread_lock = create_spinlock()))
+	if (!(thread->thread_lock = create_spinlock_class(&thread_lock_key)))
 		return nullptr;
 	if (type >= THREAD_TYPE::USER_THREAD)
 	{
@@ -347,10 +590,17 @@ EXTERN CHAIKRNL_FUNC HTHREAD create_thread(thread_proc proc, void* param, size_t
 
 
 	thread->timeout_event = nullptr;
+	thread->on_cpu = 0;
 	thread->handle = (HTHREAD)thread;
 	thread->proc = proc;
 	thread->ctxt = param;
 	thread->priority = priority;
+	thread->pi_state.base_priority = priority;
+	thread->pi_state.blocked_on = nullptr;
+	thread->pi_state.held_locks = nullptr;
+	thread->sched_class = SCHED_CLASS_NORMAL;
+	memset(&thread->dl, 0, sizeof(deadline_params));
+	thread->queued = false;
 	thread->threadtype = (THREAD_TYPE)type;
 	thread->threadlocal = tls_block_factory();
 	thread->threadlocal->selfptr = thread->threadlocal;
@@ -362,7 +612,7 @@ EXTERN CHAIKRNL_FUNC HTHREAD create_thread(thread_proc proc, void* param, size_t
 	//Now create the initial thread context
 	arch_new_thread(thread->threadctxt, thread->kernel_stack, &inital_thread_proc);
 	auto stat = acquire_spinlock(ready_lock);
-	ready.insert(thread);
+	enqueue_ready(thread);
 	release_spinlock(ready_lock, stat);
 	return thread->handle;
 }
@@ -380,7 +630,8 @@ EXTERN CHAIKRNL_FUNC void wake_thread(HTHREAD thread)
 	if (oldstate == BLOCKED)
 	{
 		st = acquire_spinlock(ready_lock);
-		ready.insert(pt);
+		deadline_wakeup(pt, arch_get_system_timer());
+		enqueue_ready(pt);
 		release_spinlock(ready_lock, st);
 	}
 }
@@ -397,9 +648,16 @@ uint8_t scheduler_wait(size_t timeout, spinlock_t lock, sched_should_wait _shoul
 	PTHREAD current = CURRENT_THREAD();
 	//kprintf(u"Thread %x waiting, CPU %d\n", runningt, pcpu_data.cpuid);
 
+	timeout_event* tout = nullptr;
 	if (timeout != TIMEOUT_INFINITY)
 	{
-		timeout_event* tout = new timeout_event;
+		tout = (timeout_event*)kmem_cache_alloc(timeout_cache);
+		if (!tout)
+		{
+			//Can't time the wait, so treat it as timed out. Callers expect the lock back either way
+			*stat = acquire_spinlock(lock);
+			return 0;
+		}
 		tout->thread = current;
 		tout->timeout = arch_get_system_timer() + timeout;
 		current->timeout_event = tout;
@@ -413,7 +671,10 @@ uint8_t scheduler_wait(size_t timeout, spinlock_t lock, sched_should_wait _shoul
 	{
 		release_spinlock(lock, *stat);
 		if (timeout != TIMEOUT_INFINITY && (current->timeout_event == nullptr))
+		{
+			*stat = acquire_spinlock(lock);
 			break;
+		}
 		scheduler_schedule(0);
 		*stat = acquire_spinlock(lock);
 		current->state = BLOCKED;
@@ -423,22 +684,143 @@ uint8_t scheduler_wait(size_t timeout, spinlock_t lock, sched_should_wait _shoul
 	if (timeout != TIMEOUT_INFINITY)
 	{
 		auto st = acquire_spinlock(timeout_lock);
-		if (current->timeout_event == nullptr)
-		{
-			release_spinlock(timeout_lock, st);
+		bool timed_out = (current->timeout_event == nullptr);
+		//Already off the list if the timer got there first
+		if (!timed_out)
+			timeouts.remove(tout);
+		current->timeout_event = nullptr;
+		release_spinlock(timeout_lock, st);
+		kmem_cache_free(timeout_cache, tout);
+		return timed_out ? 0 : 1;
+	}
+	return 1;
+}
+
+static PTHREAD lookup_thread(HTHREAD thread)
+{
+	if (!isscheduler())
+		return nullptr;
+	auto st = acquire_spinlock(allthreads_lock);
+	auto it = all_threads.find(thread);
+	PTHREAD pt = (it == all_threads.end()) ? nullptr : it->second;
+	release_spinlock(allthreads_lock, st);
+	return pt;
+}
+
+thread_t current_thread_object()
+{
+	PTHREAD current = CURRENT_THREAD();
+	return current ? current : &boot_thread;
+}
+
+HTHREAD get_thread_handle(thread_t thread)
+{
+	return thread->handle;
+}
+
+thread_pi_state* get_thread_pi_state(thread_t thread)
+{
+	return &thread->pi_state;
+}
+
+size_t get_thread_priority(thread_t thread)
+{
+	return thread->priority;
+}
+
+void set_thread_priority(thread_t thread, size_t priority)
+{
+	if (!isscheduler())
+	{
+		thread->priority = priority;
+		return;
+	}
+	auto st = acquire_spinlock(ready_lock);
+	bool boosted = priority > thread->priority;
+	thread->priority = priority;
+	//The ready queue is FIFO, so a boost only helps if the thread runs next. Deadline threads go by deadline anyway
+	if (boosted && thread->queued && thread->sched_class == SCHED_CLASS_NORMAL)
+	{
+		ready.remove(thread);
+		ready.insert_front(thread);
+	}
+	release_spinlock(ready_lock, st);
+}
+
+uint8_t thread_is_running(thread_t thread)
+{
+	return thread->on_cpu;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t set_thread_deadline(HTHREAD thread, size_t runtime, size_t deadline, size_t period)
+{
+	PTHREAD pt = lookup_thread(thread);
+	if (!pt)
+		return 0;
+	if (period == 0)
+		period = deadline;
+	uint64_t bandwidth = 0;
+	if (runtime != 0)
+	{
+		if (runtime > deadline || deadline > period)
 			return 0;
-		}
-		else
-		{
-			timeouts.remove((timeout_event*)current->timeout_event);
-			release_spinlock(timeout_lock, st);
-			current->timeout_event = nullptr;
-			return 1;
-		}
+		bandwidth = ((uint64_t)runtime << DL_BW_SHIFT) / period;
+	}
+	auto st = acquire_spinlock(ready_lock);
+	bool was_deadline = (pt->sched_class == SCHED_CLASS_DEADLINE);
+	uint64_t oldbw = was_deadline ? pt->dl.bandwidth : 0;
+	//Admission control. Every deadline thread shares one EDF queue served by the BSP, so admit against one CPU until there are per-CPU queues
+	if (dl_total_bandwidth - oldbw + bandwidth > DL_BW_LIMIT || (runtime != 0 && !was_deadline && dl_thread_count >= DL_MAX_THREADS))
+	{
+		release_spinlock(ready_lock, st);
+		return 0;
 	}
+	dl_total_bandwidth = dl_total_bandwidth - oldbw + bandwidth;
+	if (runtime != 0 && !was_deadline)
+		++dl_thread_count;
+	else if (runtime == 0 && was_deadline)
+		--dl_thread_count;
+	bool queued = pt->queued;
+	if (queued)
+		dequeue_ready(pt);
+	if (runtime == 0)
+	{
+		pt->sched_class = SCHED_CLASS_NORMAL;
+		memset(&pt->dl, 0, sizeof(deadline_params));
+	}
+	else
+	{
+		uint64_t now = arch_get_system_timer();
+		pt->sched_class = SCHED_CLASS_DEADLINE;
+		pt->dl.runtime = runtime;
+		pt->dl.deadline = deadline;
+		pt->dl.period = period;
+		pt->dl.bandwidth = bandwidth;
+		pt->dl.period_start = now;
+		pt->dl.abs_deadline = now + deadline;
+		pt->dl.remaining = runtime;
+		pt->dl.last_update = now;
+		pt->dl.throttled = false;
+	}
+	if (queued)
+		enqueue_ready(pt);
+	release_spinlock(ready_lock, st);
 	return 1;
 }
 
+EXTERN CHAIKRNL_FUNC void deadline_yield()
+{
+	if (!isscheduler())
+		return;
+	PTHREAD current = CURRENT_THREAD();
+	if (current->sched_class != SCHED_CLASS_DEADLINE)
+		return;
+	auto st = arch_disable_interrupts();
+	current->dl.throttled = true;
+	arch_restore_state(st);
+	scheduler_schedule(0);
+}
+
 static tls_data_t* get_tls_slot(PTLSBLOCK block, tls_slot_t slot)
 {
 	return raw_offset<tls_data_t*>(block, sizeof(TLSBLOCK) + slot * sizeof(tls_data_t));
@@ -28,6 +28,14 @@ EXTERN CHAIKRNL_FUNC HTHREAD create_thread(thread_proc proc, void* param, size_t
 EXTERN CHAIKRNL_FUNC HTHREAD create_thread(thread_proc proc, void* param, size_t priority, size_t type);
 #endif
 
+/*
+Deadline class (EDF with constant bandwidth servers). The thread gets runtime ticks every period, to be used before deadline.
+Returns 0 if the reservation is refused by admission control. A runtime of 0 returns the thread to the normal class.
+*/
+EXTERN CHAIKRNL_FUNC uint8_t set_thread_deadline(HTHREAD thread, size_t runtime, size_t deadline, size_t period);
+//Gives up the rest of this period's runtime
+EXTERN CHAIKRNL_FUNC void deadline_yield();
+
 void scheduler_schedule(uint64_t tick);
 void scheduler_timer_tick();
 uint8_t isscheduler();
@@ -36,8 +44,28 @@ EXTERN CHAIKRNL_FUNC HTHREAD current_thread();
 stack_t getThreadStack(HTHREAD thread, uint8_t user);
 #define TIMEOUT_INFINITY SIZE_MAX
 typedef uint8_t(*sched_should_wait)(spinlock_t lock, void* param);
+//Returns with lock held, 0 on timeout
 uint8_t scheduler_wait(size_t timeout, spinlock_t lock, sched_should_wait _should_wait, void* fparam, cpu_status_t* st);
 
+//The scheduler's thread object. Kernel locks keep these rather than handles, so they never go through the thread table
+typedef struct _thread* thread_t;
+//The boot thread's object before the scheduler starts
+thread_t current_thread_object();
+HTHREAD get_thread_handle(thread_t thread);
+
+//Priority inheritance. State is owned by the lock implementation (mutex.cpp)
+typedef struct _thread_pi_state {
+	size_t base_priority;
+	void* blocked_on;		//Lock the thread is waiting for
+	void* held_locks;		//Chain of PI locks owned by the thread
+}thread_pi_state;
+thread_pi_state* get_thread_pi_state(thread_t thread);
+size_t get_thread_priority(thread_t thread);
+//A raised priority moves a ready thread to the front of the ready queue
+void set_thread_priority(thread_t thread, size_t priority);
+//Whether the thread is currently on a CPU, used by adaptive locks to decide whether to spin
+uint8_t thread_is_running(thread_t thread);
+
 
 
 typedef uint64_t tls_data_t;
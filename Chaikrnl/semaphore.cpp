@@ -2,175 +2,253 @@
 #include <spinlock.h>
 #include <linkedlist.h>
 #include <scheduler.h>
-#include <kstdio.h>
+#include <arch/cpu.h>
+#include <chaiatomic.h>
+#include <dispatcher.h>
+#include <kmem_cache.h>
+#include <string.h>
 
-#define kprintf(...)
-#define TEST_BEHAVIOUR 1
+//Threads woken per pass of the wait queue, lives on the signaller's stack
+#define SEM_WAKE_BATCH 16
 
-struct wait_queue_entry {
-	HTHREAD waiting;
-	linked_list_node<wait_queue_entry*> listnode;
+enum SEM_WAITER_STATE {
+	SEM_WAITER_IDLE,
+	SEM_WAITER_QUEUED,
+	SEM_WAITER_GRANTED
 };
 
-static linked_list_node<wait_queue_entry*>& get_wait_node(wait_queue_entry* ent)
+//Lives on the waiting thread's stack for the duration of the wait
+struct sem_waiter {
+	HTHREAD thread;
+	size_t count;
+	volatile SEM_WAITER_STATE state;
+	struct semaphore* sem;
+	linked_list_node<sem_waiter*> listnode;
+};
+
+static linked_list_node<sem_waiter*>& get_wait_node(sem_waiter* ent)
 {
 	return ent->listnode;
 }
 
 struct semaphore {
+	//Must be first, so wait_multiple can take a semaphore_t
+	dispatch_header header;
+	std::atomic<size_t> value;
+	std::atomic<size_t> waiters;
 	spinlock_t spinlock;
-	size_t value;
-	LinkedList<wait_queue_entry*>* wait_queue;
+	LinkedList<sem_waiter*> wait_queue;
 	const char16_t* semname;
 };
 
+static bool try_take(semaphore* sem, size_t count)
+{
+	size_t value = sem->value.load(std::memory_order_relaxed);
+	while (value >= count)
+	{
+		if (sem->value.compare_exchange_weak(value, value - count, std::memory_order_acquire))
+			return true;
+		arch_pause();
+	}
+	return false;
+}
+
+static void dequeue_waiter(sem_waiter* waiter)
+{
+	waiter->sem->wait_queue.remove(waiter);
+	waiter->sem->waiters.fetch_sub(1);
+}
+
+//Hand units to queued waiters in FIFO order, waking as many as can be satisfied
+static void dispatch_waiters(semaphore* sem)
+{
+	HTHREAD towake[SEM_WAKE_BATCH];
+	size_t nwake;
+	do {
+		nwake = 0;
+		auto st = acquire_spinlock(sem->spinlock);
+		while (nwake < SEM_WAKE_BATCH)
+		{
+			auto it = sem->wait_queue.begin();
+			if (it == sem->wait_queue.end())
+				break;
+			sem_waiter* waiter = *it;
+			if (!try_take(sem, waiter->count))
+				break;
+			dequeue_waiter(waiter);
+			//Node may vanish once the state is visible, so copy the thread first
+			towake[nwake++] = waiter->thread;
+			waiter->state = SEM_WAITER_GRANTED;
+		}
+		release_spinlock(sem->spinlock, st);
+		for (size_t n = 0; n < nwake; ++n)
+			wake_thread(towake[n]);
+	} while (nwake == SEM_WAKE_BATCH);
+}
+
+//Queued waiters are owed units first, so wait_multiple doesn't barge past them
+static bool sem_ready(dispatch_header* hdr)
+{
+	semaphore* sem = (semaphore*)hdr;
+	return sem->waiters.load(std::memory_order_relaxed) == 0 && sem->value.load(std::memory_order_relaxed) != 0;
+}
+
+static bool sem_acquire(dispatch_header* hdr)
+{
+	semaphore* sem = (semaphore*)hdr;
+	return sem->waiters.load(std::memory_order_relaxed) == 0 && try_take(sem, 1);
+}
+
+static void sem_unacquire(dispatch_header* hdr)
+{
+	signal_semaphore((semaphore_t)hdr, 1);
+}
+
+static const dispatch_ops sem_ops = { &sem_ready, &sem_acquire, &sem_unacquire, nullptr };
+
+//Semaphores go back to the cache with their locks, so those are only created once per object
+static lock_class_key semaphore_lock_key = { "semaphore" };
+
+static void semaphore_ctor(void* obj, void* context)
+{
+	semaphore* sem = (semaphore*)obj;
+	memset(sem, 0, sizeof(semaphore));
+	sem->wait_queue.init(&get_wait_node);
+	sem->spinlock = create_spinlock_class(&semaphore_lock_key);
+	dispatch_init(&sem->header, &sem_ops);
+}
+
+static void semaphore_dtor(void* obj, void* context)
+{
+	semaphore* sem = (semaphore*)obj;
+	dispatch_destroy(&sem->header);
+	delete_spinlock(sem->spinlock);
+}
+
+static kmem_cache_t semaphore_cache = nullptr;
+
+static kmem_cache_t get_semaphore_cache()
+{
+	if (!semaphore_cache)
+	{
+		kmem_cache_t cache = kmem_cache_create("semaphore", sizeof(semaphore), 0, &semaphore_ctor, &semaphore_dtor, nullptr);
+		if (cache && !arch_cas((volatile size_t*)&semaphore_cache, 0, (size_t)cache))
+			kmem_cache_destroy(cache);
+	}
+	return semaphore_cache;
+}
 
 EXTERN CHAIKRNL_FUNC semaphore_t create_semaphore(size_t count, const char16_t* name)
 {
-	semaphore* sem = new semaphore;
+	kmem_cache_t cache = get_semaphore_cache();
+	if (!cache)
+		return nullptr;
+	semaphore* sem = (semaphore*)kmem_cache_alloc(cache);
 	if (!sem)
 		return nullptr;
-	sem->spinlock = create_spinlock();
-	sem->value = count;
-	sem->semname = name;
+	//The constructor can't fail, so its locks may be missing. Try again here, rather than hand out or keep recycling a broken object
 	if (!sem->spinlock)
+		sem->spinlock = create_spinlock_class(&semaphore_lock_key);
+	if (!sem->header.watch_lock)
+		sem->header.watch_lock = create_spinlock_class(&dispatch_watch_key);
+	if (!sem->spinlock || !sem->header.watch_lock)
+	{
+		//Whatever was made stays with the object, the next allocation retries the rest
+		kmem_cache_free(cache, sem);
 		return nullptr;
-	sem->wait_queue = new LinkedList<wait_queue_entry*>(&get_wait_node);
+	}
+	sem->value.store(count, std::memory_order_relaxed);
+	sem->waiters.store(0, std::memory_order_relaxed);
+	sem->semname = name;
 	return (semaphore_t)sem;
 }
 EXTERN CHAIKRNL_FUNC void delete_semaphore(semaphore_t lock)
 {
-	delete (semaphore*)lock;
+	kmem_cache_free(semaphore_cache, lock);
 }
 EXTERN CHAIKRNL_FUNC void signal_semaphore(semaphore_t lock, size_t count)
 {
 	semaphore* sem = (semaphore*)lock;
-#if 1
-	if (isscheduler())
-		kprintf(u"Signalling semaphore %s, %x (spinlock: %x)\n", sem->semname, count, *(size_t*)sem->spinlock);
-#endif
-	auto st = acquire_spinlock(sem->spinlock);
-	sem->value += count;
-	//See about the wait queue
-#if TEST_BEHAVIOUR
-	if (isscheduler())
-	{
-		for (size_t n = 0; n < count; ++n)
-		{
-			wait_queue_entry* ent = sem->wait_queue->pop();
-			if (ent)
-			{
-				//kprintf(u"Thread %x waking\n", ent->waiting);
-				release_spinlock(sem->spinlock, st);
-				wake_thread(ent->waiting);
-				return;
-			}
-		}
-	}
-#endif
-	release_spinlock(sem->spinlock, st);
+	//Locked add orders the value store before the waiters load, pairs with should_sleep_sem
+	sem->value.fetch_add(count, std::memory_order_release);
+	if (sem->waiters.load(std::memory_order_relaxed) != 0)
+		dispatch_waiters(sem);
+	dispatch_signal(&sem->header);
 }
 
-struct sem_wait_data {
-	semaphore* sem;
-	size_t count;
-};
-
 static uint8_t should_sleep_sem(spinlock_t lock, void* param)
 {
-	sem_wait_data* sem = (sem_wait_data*)param;
-	uint8_t res = sem->sem->value < sem->count ? 1 : 0;
-	if (res == 1)
+	sem_waiter* waiter = (sem_waiter*)param;
+	semaphore* sem = waiter->sem;
+	if (waiter->state == SEM_WAITER_GRANTED)
+		return 0;
+	if (waiter->state == SEM_WAITER_IDLE)
 	{
-		wait_queue_entry* queueent = new wait_queue_entry;
-		queueent->waiting = current_thread();
-		sem->sem->wait_queue->insert(queueent);
+		sem->wait_queue.insert(waiter);
+		waiter->state = SEM_WAITER_QUEUED;
+		sem->waiters.fetch_add(1);
 	}
-	return res;
-}
-
-static auto get_debug_flags()
-{
-	auto flags = arch_disable_interrupts();
-	arch_restore_state(flags);
-	return flags;
+	//Recheck now we're visible to signal_semaphore, only the head may take units
+	if (*sem->wait_queue.begin() == waiter && try_take(sem, waiter->count))
+	{
+		dequeue_waiter(waiter);
+		waiter->state = SEM_WAITER_GRANTED;
+		return 0;
+	}
+	return 1;
 }
 
 CHAIKRNL_FUNC void write_semaphore(semaphore_t lock, size_t count)
 {
 	semaphore* sem = (semaphore*)lock;
-	auto st = acquire_spinlock(sem->spinlock);
-	sem->value = count;
-	release_spinlock(sem->spinlock, st);
+	sem->value.exchange(count);
+	if (sem->waiters.load(std::memory_order_relaxed) != 0)
+		dispatch_waiters(sem);
+	dispatch_signal(&sem->header);
 }
 
 CHAIKRNL_FUNC size_t peek_semaphore(semaphore_t lock)
 {
 	semaphore* sem = (semaphore*)lock;
-	return sem->value;
+	return sem->value.load(std::memory_order_relaxed);
 }
 
 EXTERN CHAIKRNL_FUNC uint8_t wait_semaphore(semaphore_t lock, size_t count, size_t timeout)
 {
 	semaphore* sem = (semaphore*)lock;
-	cpu_status_t st;
-#if 0
-	if (isscheduler())
-		kprintf(u"Waiting semaphore %s, %x, %dms\n", sem->semname, count, timeout);
-#endif
+	//Uncontended: a single CAS on the count. Queued waiters go first
+	if (sem->waiters.load(std::memory_order_relaxed) == 0 && try_take(sem, count))
+		return 1;
 
-#if TEST_BEHAVIOUR
-	if (isscheduler())
-	{
-		kprintf(u"Waiting on semaphore %s with value %x (spinlock: %x), %x\n", sem->semname, *(size_t*)sem->spinlock, sem->value, count);
-		sem_wait_data waitdat;
-		waitdat.count = count;
-		waitdat.sem = sem;
-		if (scheduler_wait(timeout, sem->spinlock, &should_sleep_sem, &waitdat, &st) == 0)
-		{
-			release_spinlock(sem->spinlock, st);
-			return 0;	//Timeout
-		}
-		kprintf(u"Semaphore %s stopped waiting\n", sem->semname);
-	}
-	else
+	if (!isscheduler())
 	{
-		st = acquire_spinlock(sem->spinlock);
-	}
-#else
-	auto time = arch_get_system_timer();
-	int live = 0;
-	while (1)
-	{
-		while (sem->value < count)
+		auto time = arch_get_system_timer();
+		while (!try_take(sem, count))
 		{
-			if (false) /*isscheduler()*/
-			{
-				uint64_t timer = arch_get_system_timer();
-				kprintf(u"%d, IF%d, %d", timer, (get_debug_flags() >> 9) & 1, live);
-				live = (live + 1) % 2;
-				kputs(u"\b\b\b\b\b\b\b\b");
-				if (timer == 0)
-					kputs(u"\b");
-				for (; timer != 0; timer /= 10)
-				{
-					kputs(u"\b");
-				}
-			}
 			if (timeout != TIMEOUT_INFINITY && arch_get_system_timer() > time + timeout)
 				return 0;
 			arch_pause();
 		}
-		st = acquire_spinlock(sem->spinlock);
-		if (sem->value >= count)
-		{
-			break;
-		}
-		release_spinlock(sem->spinlock, st);
-
+		return 1;
 	}
-#endif
-	sem->value -= count;
+
+	sem_waiter waiter;
+	waiter.thread = current_thread();
+	waiter.count = count;
+	waiter.state = SEM_WAITER_IDLE;
+	waiter.sem = sem;
+	cpu_status_t st;
+	scheduler_wait(timeout, sem->spinlock, &should_sleep_sem, &waiter, &st);
+	bool granted = waiter.state == SEM_WAITER_GRANTED;
+	if (waiter.state == SEM_WAITER_QUEUED)
+		dequeue_waiter(&waiter);
 	release_spinlock(sem->spinlock, st);
-	return 1;
-}
\ No newline at end of file
+	//Leftover units (or a timed out head) may unblock the next waiters, or wait_multiple once the queue is empty
+	if (sem->value.load(std::memory_order_relaxed) != 0)
+	{
+		if (sem->waiters.load(std::memory_order_relaxed) != 0)
+			dispatch_waiters(sem);
+		dispatch_signal(&sem->header);
+	}
+	return granted ? 1 : 0;
+}
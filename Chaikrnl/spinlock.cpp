@@ -1,9 +1,34 @@
 #include <spinlock.h>
 #include <arch/cpu.h>
 #include <kstdio.h>
+#include <chaiatomic.h>
+#include <lockdep.h>
+
+#undef __midl
+#include <intrin.h>
+#pragma intrinsic(_ReturnAddress)
+
+//Per-lock contention counters. Costs a TSC read on every acquire and release
+#ifndef SPINLOCK_STATISTICS
+#define SPINLOCK_STATISTICS 0
+#endif
+
+//MCS queue node. Only referenced while its owner is waiting, so it can live on the waiter's stack
+typedef struct __declspec(align(64)) _mcs_node {
+	struct _mcs_node* volatile next;
+	volatile size_t waiting;
+}mcs_node;
 
 typedef struct _spinlock {
-	size_t value;
+	std::atomic<size_t> value;
+	mcs_node* volatile tail;
+#if SPINLOCK_STATISTICS
+	spinlock_stats stats;
+	uint64_t acquired_at;
+#endif
+#if LOCKDEP
+	lock_class* lclass;
+#endif
 }spinlock, *pspinlock;
 
 static spinlock s_lock = { 0 };
@@ -17,53 +42,159 @@ static const int num_locks = 16;
 static spinlock early_locks[num_locks];
 static int offset = 0;
 
-EXTERN CHAIKRNL_FUNC spinlock_t create_spinlock()
+static void init_spinlock(pspinlock lock)
+{
+	lock->value.store(0, std::memory_order_relaxed);
+	lock->tail = nullptr;
+#if SPINLOCK_STATISTICS
+	lock->stats.acquisitions = 0;
+	lock->stats.contended = 0;
+	lock->stats.spins = 0;
+	lock->stats.max_hold_ticks = 0;
+	lock->acquired_at = 0;
+#endif
+#if LOCKDEP
+	lock->lclass = nullptr;
+#endif
+}
+
+static pspinlock new_spinlock()
 {
 	pspinlock lock = new spinlock;
 	if (!lock)
 	{
-		if (offset < num_locks)
-		{
-			early_locks[offset].value = 0;
-			return &early_locks[offset++];
-		}
-		return nullptr;
+		if (offset >= num_locks)
+			return nullptr;
+		lock = &early_locks[offset++];
 	}
-	lock->value = 0;
+	init_spinlock(lock);
+	return lock;
+}
+
+EXTERN CHAIKRNL_FUNC spinlock_t create_spinlock()
+{
+	pspinlock lock = new_spinlock();
+#if LOCKDEP
+	//No key, so locks created at the same place share a class
+	if (lock)
+		lock->lclass = lockdep_register(_ReturnAddress(), nullptr);
+#endif
+	return (spinlock_t)lock;
+}
+EXTERN CHAIKRNL_FUNC spinlock_t create_spinlock_class(lock_class_key* key)
+{
+	pspinlock lock = new_spinlock();
+#if LOCKDEP
+	if (lock)
+		lock->lclass = lockdep_register(key, key->name);
+#endif
 	return (spinlock_t)lock;
 }
 EXTERN CHAIKRNL_FUNC void delete_spinlock(spinlock_t lock)
 {
-	delete lock;
+	delete (pspinlock)lock;
 }
-#undef __midl
-#include <intrin.h>
-#pragma intrinsic(_ReturnAddress)
+
+static mcs_node* exchange_tail(pspinlock slock, mcs_node* node)
+{
+	mcs_node* prev;
+	do {
+		prev = slock->tail;
+	} while (!arch_cas((volatile size_t*)&slock->tail, (size_t)prev, (size_t)node));
+	return prev;
+}
+
+//Queue up behind other waiters. Only the head of the queue touches the lock word
+static size_t acquire_spinlock_slow(pspinlock slock)
+{
+	mcs_node node;
+	node.next = nullptr;
+	node.waiting = 1;
+	size_t spins = 0;
+	mcs_node* prev = exchange_tail(slock, &node);
+	if (prev)
+	{
+		prev->next = &node;
+		while (node.waiting)
+		{
+			arch_pause();
+			++spins;
+		}
+	}
+	//Head of the queue
+	while (true)
+	{
+		size_t expected = 0;
+		if (slock->value.load(std::memory_order_relaxed) == 0 && slock->value.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+			break;
+		arch_pause();
+		++spins;
+	}
+	//Pass the head on. After this nobody references our node
+	if (!arch_cas((volatile size_t*)&slock->tail, (size_t)&node, 0))
+	{
+		while (!node.next)
+			arch_pause();
+		node.next->waiting = 0;
+	}
+	return spins;
+}
+
 EXTERN CHAIKRNL_FUNC cpu_status_t acquire_spinlock(spinlock_t lock)
 {
 	pspinlock slock = (pspinlock)lock;
 	cpu_status_t v = arch_disable_interrupts();
-	if (slock->value > 1)
+	if (slock->value.load(std::memory_order_relaxed) > 1)
 	{
-		kprintf(u"SPINLOCK CORRUPTED: %x (value: %d, caller %x)\n", slock, slock->value, _ReturnAddress());
-		slock->value = 0;
+		kprintf(u"SPINLOCK CORRUPTED: %x (value: %d, caller %x)\n", slock, slock->value.load(std::memory_order_relaxed), _ReturnAddress());
+		slock->value.store(0, std::memory_order_relaxed);
 	}
 	//We won't be preempted, so we're only contending with other CPUs
-	do
+	size_t spins = 0;
+	size_t expected = 0;
+#if LOCKDEP
+	lockdep_acquire(slock->lclass, slock);
+	uint64_t wait_start = arch_get_cpu_ticks();
+#endif
+	if (slock->tail != nullptr || !slock->value.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+		spins = acquire_spinlock_slow(slock);
+#if LOCKDEP
+	lockdep_acquired(slock->lclass, slock, arch_get_cpu_ticks() - wait_start, spins != 0);
+#endif
+#if SPINLOCK_STATISTICS
+	++slock->stats.acquisitions;
+	if (spins != 0)
 	{
-		if (arch_cas(&slock->value, 0, 1)) {
-			break;
-		}
-		arch_pause();
-		volatile size_t* lockd = &slock->value;
-		while (*lockd == 1);
-	} while (true);
+		++slock->stats.contended;
+		slock->stats.spins += spins;
+	}
+	slock->acquired_at = arch_get_cpu_ticks();
+#endif
 	return v;
 }
 EXTERN CHAIKRNL_FUNC void release_spinlock(spinlock_t lock, cpu_status_t status)
 {
 	pspinlock slock = (pspinlock)lock;
-	if (!arch_cas(&slock->value, 1, 0))
-		slock->value = 0;		//Should never be necessary, but this prevents freezing due to memory corruption.
+#if SPINLOCK_STATISTICS
+	uint64_t held = arch_get_cpu_ticks() - slock->acquired_at;
+	if (held > slock->stats.max_hold_ticks)
+		slock->stats.max_hold_ticks = held;
+#endif
+#if LOCKDEP
+	lockdep_release(slock->lclass, slock);
+#endif
+	//Plain store is enough on release, the locked CAS here was a full fence on every unlock
+	slock->value.store(0, std::memory_order_release);
 	arch_restore_state(status);
-}
\ No newline at end of file
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t spinlock_get_statistics(spinlock_t lock, spinlock_stats* stats)
+{
+#if SPINLOCK_STATISTICS
+	pspinlock slock = (pspinlock)lock;
+	*stats = slock->stats;
+	return 1;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,246 @@
+#include <topology.h>
+#include <acpi.h>
+#include <arch/cpu.h>
+#include <redblack.h>
+#include <kstdio.h>
+#include <string.h>
+#include <arch/paging.h>
+
+struct topology_cpu {
+	uint32_t acpi_id;
+	numa_t node;
+};
+
+static RedBlackTree<uint32_t, topology_cpu*> cpus;
+//Processors in each node
+static RedBlackTree<numa_t, size_t> nodes;
+static arch_topology_shifts shifts = { 0, 0 };
+static uint8_t llc_shift = 0;
+//Copy of the SLIT matrix
+static uint8_t* distances = nullptr;
+static size_t locality_count = 0;
+
+static topology_cpu* get_cpu(uint32_t processor)
+{
+	auto it = cpus.find(processor);
+	return it == cpus.end() ? nullptr : it->second;
+}
+
+static void add_cpu(uint32_t processor, uint32_t acpi_id)
+{
+	if (get_cpu(processor))
+		return;
+	topology_cpu* cpu = new topology_cpu;
+	cpu->acpi_id = acpi_id;
+	cpu->node = 0;
+	cpus[processor] = cpu;
+}
+
+static void read_madt()
+{
+	ACPI_TABLE_MADT* madt = nullptr;
+	if (!ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_MADT, 0, (ACPI_TABLE_HEADER**)&madt)))
+		return;
+	ACPI_SUBTABLE_HEADER* subtable = mem_after<ACPI_SUBTABLE_HEADER*>(madt);
+	while (raw_diff(subtable, madt) < madt->Header.Length)
+	{
+		if (subtable->Type == ACPI_MADT_TYPE_LOCAL_X2APIC)
+		{
+			ACPI_MADT_LOCAL_X2APIC* lapic = (ACPI_MADT_LOCAL_X2APIC*)subtable;
+			if (lapic->LapicFlags & ACPI_MADT_ENABLED)
+				add_cpu(lapic->LocalApicId, lapic->Uid);
+		}
+		else if (subtable->Type == ACPI_MADT_TYPE_LOCAL_APIC)
+		{
+			ACPI_MADT_LOCAL_APIC* lapic = (ACPI_MADT_LOCAL_APIC*)subtable;
+			if (lapic->LapicFlags & ACPI_MADT_ENABLED)
+				add_cpu(lapic->Id, lapic->ProcessorId);
+		}
+		subtable = raw_offset<ACPI_SUBTABLE_HEADER*>(subtable, subtable->Length);
+	}
+}
+
+static void set_node(uint32_t processor, numa_t node)
+{
+	if (topology_cpu* cpu = get_cpu(processor))
+		cpu->node = node;
+}
+
+static void read_srat()
+{
+	ACPI_TABLE_SRAT* srat = nullptr;
+	if (!ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_SRAT, 0, (ACPI_TABLE_HEADER**)&srat)))
+		return;
+	ACPI_SUBTABLE_HEADER* subtable = mem_after<ACPI_SUBTABLE_HEADER*>(srat);
+	while (raw_diff(subtable, srat) < srat->Header.Length)
+	{
+		if (subtable->Type == ACPI_SRAT_TYPE_CPU_AFFINITY)
+		{
+			ACPI_SRAT_CPU_AFFINITY* aff = (ACPI_SRAT_CPU_AFFINITY*)subtable;
+			numa_t node = aff->ProximityDomainLo | (aff->ProximityDomainHi[0] << 8) | (aff->ProximityDomainHi[1] << 16) | (aff->ProximityDomainHi[2] << 24);
+			if (aff->Flags & ACPI_SRAT_CPU_USE_AFFINITY)
+				set_node(aff->ApicId, node);
+		}
+		else if (subtable->Type == ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY)
+		{
+			ACPI_SRAT_X2APIC_CPU_AFFINITY* aff = (ACPI_SRAT_X2APIC_CPU_AFFINITY*)subtable;
+			if (aff->Flags & ACPI_SRAT_CPU_ENABLED)
+				set_node(aff->ApicId, aff->ProximityDomain);
+		}
+		subtable = raw_offset<ACPI_SUBTABLE_HEADER*>(subtable, subtable->Length);
+	}
+}
+
+static void read_slit()
+{
+	ACPI_TABLE_SLIT* slit = nullptr;
+	if (!ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_SLIT, 0, (ACPI_TABLE_HEADER**)&slit)))
+		return;
+	size_t count = slit->LocalityCount;
+	//Guard against a matrix that runs off the table
+	if (count == 0 || sizeof(ACPI_TABLE_SLIT) - 1 + count * count > slit->Header.Length)
+		return;
+	distances = new uint8_t[count * count];
+	memcpy(distances, slit->Entry, count * count);
+	locality_count = count;
+}
+
+//Last level cache, the outermost unified cache CPUID describes
+static void read_llc()
+{
+	llc_shift = shifts.package_shift;
+	for (uint8_t level = 3; level >= 2; --level)
+	{
+		size_t sharing = cpu_get_cache_sharing(level, CACHE_TYPE_UNIFIED);
+		if (sharing == 0)
+			continue;
+		llc_shift = 0;
+		while ((1ui64 << llc_shift) < sharing)
+			++llc_shift;
+		return;
+	}
+}
+
+void topology_init()
+{
+	read_madt();
+	//At least the boot CPU, whatever the firmware says
+	add_cpu(arch_current_processor_id(), 0);
+	read_srat();
+	read_slit();
+	arch_get_topology_shifts(&shifts);
+	read_llc();
+	for (auto it = cpus.begin(); it != cpus.end(); ++it)
+	{
+		numa_t node = it->second->node;
+		auto nodeit = nodes.find(node);
+		nodes[node] = (nodeit == nodes.end()) ? 1 : nodeit->second + 1;
+	}
+}
+
+EXTERN CHAIKRNL_FUNC numa_t cpu_to_node(uint32_t processor)
+{
+	topology_cpu* cpu = get_cpu(processor);
+	return cpu ? cpu->node : 0;
+}
+
+EXTERN CHAIKRNL_FUNC uint32_t node_distance(numa_t from, numa_t to)
+{
+	if (from < locality_count && to < locality_count)
+		return distances[from * locality_count + to];
+	return from == to ? NODE_DISTANCE_LOCAL : NODE_DISTANCE_REMOTE;
+}
+
+EXTERN CHAIKRNL_FUNC size_t cpu_siblings(uint32_t processor, uint32_t* ids, size_t max)
+{
+	uint32_t core = processor >> shifts.smt_shift;
+	size_t count = 0;
+	for (auto it = cpus.begin(); it != cpus.end(); ++it)
+	{
+		if ((it->first >> shifts.smt_shift) != core)
+			continue;
+		if (count < max)
+			ids[count] = it->first;
+		++count;
+	}
+	return count;
+}
+
+EXTERN CHAIKRNL_FUNC uint32_t llc_domain(uint32_t processor)
+{
+	return processor >> llc_shift;
+}
+
+EXTERN CHAIKRNL_FUNC uint32_t cpu_package(uint32_t processor)
+{
+	return processor >> shifts.package_shift;
+}
+
+EXTERN CHAIKRNL_FUNC size_t node_cpus(numa_t node, uint32_t* ids, size_t max)
+{
+	size_t count = 0;
+	for (auto it = cpus.begin(); it != cpus.end(); ++it)
+	{
+		if (it->second->node != node)
+			continue;
+		if (count < max)
+			ids[count] = it->first;
+		++count;
+	}
+	return count;
+}
+
+EXTERN CHAIKRNL_FUNC size_t topology_node_count()
+{
+	size_t count = 0;
+	for (auto it = nodes.begin(); it != nodes.end(); ++it)
+		++count;
+	return count ? count : 1;
+}
+
+EXTERN CHAIKRNL_FUNC void* node_alloc(size_t size, numa_t node)
+{
+	size_t pages = DIV_ROUND_UP(size, PAGESIZE);
+	if (pages == 0)
+		return nullptr;
+	void* vaddr = find_free_paging(pages * PAGESIZE);
+	if (!vaddr)
+		return nullptr;
+	for (size_t n = 0; n < pages; ++n)
+	{
+		paddr_t frame = pmmngr_allocate(1, ARCH_PHY_REGION_NORMAL, node);
+		if (frame == 0 || !paging_map(raw_offset<void*>(vaddr, n * PAGESIZE), frame, PAGESIZE, PAGE_ATTRIBUTE_WRITABLE))
+		{
+			if (frame != 0)
+				pmmngr_free(frame, 1);
+			if (n != 0)
+				paging_free(vaddr, n * PAGESIZE);
+			return nullptr;
+		}
+	}
+	return vaddr;
+}
+
+EXTERN CHAIKRNL_FUNC void node_free(void* ptr, size_t size)
+{
+	if (ptr)
+		paging_free(ptr, DIV_ROUND_UP(size, PAGESIZE) * PAGESIZE);
+}
+
+EXTERN CHAIKRNL_FUNC void topology_report()
+{
+	kprintf(u"Topology: SMT shift %d, package shift %d, LLC shift %d\n", shifts.smt_shift, shifts.package_shift, llc_shift);
+	for (auto it = cpus.begin(); it != cpus.end(); ++it)
+	{
+		uint32_t id = it->first;
+		kprintf(u"  CPU %d (ACPI %d): node %d, package %d, core %d, thread %d, LLC %d\n", id, it->second->acpi_id, it->second->node,
+			cpu_package(id), (id & ((1u << shifts.package_shift) - 1)) >> shifts.smt_shift, id & ((1u << shifts.smt_shift) - 1), llc_domain(id));
+	}
+	for (auto from = nodes.begin(); from != nodes.end(); ++from)
+	{
+		kprintf(u"  Node %d: %d CPUs, distances", from->first, from->second);
+		for (auto to = nodes.begin(); to != nodes.end(); ++to)
+			kprintf(u" %d", node_distance(from->first, to->first));
+		kprintf(u"\n");
+	}
+}
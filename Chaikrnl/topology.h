@@ -0,0 +1,44 @@
+#ifndef CHAIOS_TOPOLOGY_H
+#define CHAIOS_TOPOLOGY_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+#include <pmmngr.h>
+
+/*
+CPU and NUMA topology, from the MADT, SRAT and SLIT plus CPUID's view of APIC IDs.
+Processors are APIC IDs and nodes are SRAT proximity domains, the same numbering pmmngr_allocate takes.
+Without an SRAT everything is node 0. Without a SLIT distances are 10 locally and 20 remotely, as ACPI defines.
+*/
+#define NODE_DISTANCE_LOCAL 10
+#define NODE_DISTANCE_REMOTE 20
+
+#ifdef __cplusplus
+void topology_init();
+#endif
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+CHAIKRNL_FUNC numa_t cpu_to_node(uint32_t processor);
+CHAIKRNL_FUNC uint32_t node_distance(numa_t from, numa_t to);
+//Writes up to max processors sharing a core with processor, itself included. Returns how many there are
+CHAIKRNL_FUNC size_t cpu_siblings(uint32_t processor, uint32_t* ids, size_t max);
+//Same value for every processor sharing the last level cache
+CHAIKRNL_FUNC uint32_t llc_domain(uint32_t processor);
+CHAIKRNL_FUNC uint32_t cpu_package(uint32_t processor);
+//Writes up to max processors in node. Returns how many there are
+CHAIKRNL_FUNC size_t node_cpus(numa_t node, uint32_t* ids, size_t max);
+CHAIKRNL_FUNC size_t topology_node_count();
+
+//Page granular memory backed by frames from node, or striped with NUMA_STRIPE. For rings, queues and other hot per-node data
+CHAIKRNL_FUNC void* node_alloc(size_t size, numa_t node);
+CHAIKRNL_FUNC void node_free(void* ptr, size_t size);
+CHAIKRNL_FUNC void topology_report();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,6 +8,7 @@
 #include <endian.h>
 #include <guid.h>
 #include <ReadersWriterLock.h>
+#include <mutex.h>
 
 static size_t handle_alloc = 1;
 
@@ -22,8 +23,10 @@ struct interested_filesystems {
 };
 
 static RedBlackTree<HDISK, internal_disk_info*> handle_translator;
-static sharespinlock_t treelock;
+static brlock_t treelock;
 static LinkedList<interested_filesystems*> interestedFilesystems;
+//Held across filesystem probes, which do disk I/O
+static adaptive_mutex_t fslock;
 
 static linked_list_node <interested_filesystems*>& get_node(interested_filesystems* node)
 {
@@ -335,7 +338,8 @@ void init_vds()
 	if (inited)
 		return;
 	inited = true;
-	treelock = SharedSpinlockCreate();
+	treelock = BigReaderLockCreate();
+	fslock = create_adaptive_mutex();
 
 	interestedFilesystems.init(get_node);
 	VdsRegisterFilesystem(partitionManagerCallback);
@@ -353,17 +357,17 @@ EXTERN CHAIKRNL_FUNC HDISK RegisterVdsDisk(PCHAIOS_VDS_DISK diskInfo)
 		return NULL;
 	intinfo->publicinfo = diskInfo;
 	intinfo->isbound = false;
-	auto st = SharedSpinlockAcquire(treelock, TRUE);
+	auto st = BigReaderLockAcquire(treelock, TRUE);
 	handle_translator[handle] = intinfo;
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 
 	return handle;
 }
 EXTERN CHAIKRNL_FUNC vds_err_t VdsReadDisk(HDISK disk, lba_t block, vds_length_t count, void* buffer, semaphore_t* completionEvent)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	auto it = handle_translator.find(disk);
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 	if (it == handle_translator.end())
 		return -1;
 	PCHAIOS_VDS_DISK diskinf = it->second->publicinfo;
@@ -373,9 +377,9 @@ EXTERN CHAIKRNL_FUNC vds_err_t VdsReadDisk(HDISK disk, lba_t block, vds_length_t
 }
 EXTERN CHAIKRNL_FUNC vds_err_t VdsWriteDisk(HDISK disk, lba_t block, vds_length_t count, void* buffer, semaphore_t* completionEvent)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	auto it = handle_translator.find(disk);
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 	if (it == handle_translator.end())
 		return -1;
 	PCHAIOS_VDS_DISK diskinf = it->second->publicinfo;
@@ -385,9 +389,9 @@ EXTERN CHAIKRNL_FUNC vds_err_t VdsWriteDisk(HDISK disk, lba_t block, vds_length_
 }
 EXTERN CHAIKRNL_FUNC vds_err_t VdsFlushDisk(HDISK disk, semaphore_t* completionEvent)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	auto it = handle_translator.find(disk);
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 	if (it == handle_translator.end())
 		return -1;
 	PCHAIOS_VDS_DISK diskinf = it->second->publicinfo;
@@ -397,9 +401,9 @@ EXTERN CHAIKRNL_FUNC vds_err_t VdsFlushDisk(HDISK disk, semaphore_t* completionE
 }
 EXTERN CHAIKRNL_FUNC vds_err_t VdsGetStatusAsync(HDISK disk, vds_err_t token, semaphore_t completionEvent)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	auto it = handle_translator.find(disk);
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 	if (it == handle_translator.end())
 		return -1;
 	PCHAIOS_VDS_DISK diskinf = it->second->publicinfo;
@@ -409,9 +413,9 @@ EXTERN CHAIKRNL_FUNC vds_err_t VdsGetStatusAsync(HDISK disk, vds_err_t token, se
 }
 EXTERN CHAIKRNL_FUNC PCHAIOS_VDS_PARAMS VdsGetParams(HDISK disk)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	auto it = handle_translator.find(disk);
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 	if (it == handle_translator.end())
 		return nullptr;
 	PCHAIOS_VDS_DISK diskinf = it->second->publicinfo;
@@ -420,21 +424,23 @@ EXTERN CHAIKRNL_FUNC PCHAIOS_VDS_PARAMS VdsGetParams(HDISK disk)
 
 EXTERN CHAIKRNL_FUNC void enumerate_disks(chaios_vds_enum_callback callback)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	auto it = handle_translator.begin();
 	while (it != handle_translator.end())
 	{
 		callback(it->first);
 		++it;
 	}
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 }
 
 EXTERN CHAIKRNL_FUNC void VdsRegisterFilesystem(chaios_vds_enum_callback callback)
 {
 	interested_filesystems* ifs = new interested_filesystems;
 	ifs->callback = callback;
+	acquire_adaptive_mutex(fslock, TIMEOUT_INFINITY);
 	interestedFilesystems.insert(ifs);
+	release_adaptive_mutex(fslock);
 }
 
 void vds_start_filesystem_matching()
@@ -450,6 +456,7 @@ void vds_start_filesystem_matching()
 
 			bool bound = false;
 
+			acquire_adaptive_mutex(fslock, TIMEOUT_INFINITY);
 			for (auto it = interestedFilesystems.begin(); it != interestedFilesystems.end(); ++it)
 			{
 				const chaios_vds_enum_callback& fsdrv = (*it)->callback;
@@ -468,6 +475,7 @@ void vds_start_filesystem_matching()
 				if (bound)		//No need for further FS checks
 					break;
 			}
+			release_adaptive_mutex(fslock);
 			diskdata->isbound = bound;
 			if (newdisks)		//Can't keep iterating now the tree is updated?
 				break;
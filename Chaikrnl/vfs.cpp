@@ -1,6 +1,9 @@
 #include <vfs.h>
 #include <redblack.h>
 #include <ReadersWriterLock.h>
+#include <rcu.h>
+#include <spinlock.h>
+#include <string.h>
 
 static size_t handle_alloc = 1;
 
@@ -15,11 +18,37 @@ struct internal_fs_info {
 };
 
 static RedBlackTree<_chaios_VFS_HANDLE, internal_fs_info*> handle_translator;
-static sharespinlock_t treelock;
+static brlock_t treelock;
 
-static RedBlackTree<char16_t, HFILESYSTEM> rootVolumes;
+//Volume letters A-Z. Replaced wholesale on mount, so lookups need no lock
+static const size_t VFS_MAX_VOLUMES = 26;
+struct volume_table {
+	rcu_head rcu;
+	HFILESYSTEM volumes[VFS_MAX_VOLUMES];
+};
+static volume_table* volatile rootVolumes = nullptr;
 size_t volumeAlloc = 'C';
-static sharespinlock_t volumelock;
+//Serialises mounts
+static spinlock_t volumelock;
+static lock_class_key volumelock_key = { "vfs_volumes" };
+
+static void free_volume_table(rcu_head* head)
+{
+	delete (volume_table*)head;
+}
+
+static HFILESYSTEM lookup_volume(char16_t letter)
+{
+	if (letter < u'A' || letter >= u'A' + VFS_MAX_VOLUMES)
+		return NULL;
+	HFILESYSTEM result = NULL;
+	rcu_read_lock();
+	volume_table* table = rcu_dereference(rootVolumes);
+	if (table)
+		result = table->volumes[letter - u'A'];
+	rcu_read_unlock();
+	return result;
+}
 
 static bool inited = false;
 
@@ -32,22 +61,35 @@ CHAIKRNL_FUNC HFILESYSTEM VfsRegisterFilesystem(PCHAIOS_FILESYSTEM_DRIVER fs)
 	char16_t valloc = volumeAlloc;
 	while (!arch_cas(&volumeAlloc, valloc, valloc + 1))
 		valloc = volumeAlloc;
+	if (valloc >= u'A' + VFS_MAX_VOLUMES)
+		return NULL;
 
 	HFILESYSTEM handle = (HFILESYSTEM)alloc;
 	internal_fs_info* intinfo = new internal_fs_info;
 	if (!intinfo)
 		return NULL;
 	intinfo->filesystemDriver = fs;
-	auto st = SharedSpinlockAcquire(treelock, TRUE);
+	auto st = BigReaderLockAcquire(treelock, TRUE);
 	handle_translator[handle] = intinfo;
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 
 	//This is the root directory
 	intinfo->fileInfo.internalFile = nullptr;
 
-	st = SharedSpinlockAcquire(volumelock, TRUE);
-	rootVolumes[valloc] = handle;
-	SharedSpinlockRelease(volumelock, st);
+	volume_table* newtable = new volume_table;
+	if (!newtable)
+		return NULL;
+	st = acquire_spinlock(volumelock);
+	volume_table* oldtable = rootVolumes;
+	if (oldtable)
+		memcpy(newtable->volumes, oldtable->volumes, sizeof(newtable->volumes));
+	else
+		memset(newtable->volumes, 0, sizeof(newtable->volumes));
+	newtable->volumes[valloc - u'A'] = handle;
+	rcu_assign_pointer(rootVolumes, newtable);
+	release_spinlock(volumelock, st);
+	if (oldtable)
+		call_rcu(&oldtable->rcu, &free_volume_table);
 	return handle;
 }
 #include <kstdio.h>
@@ -57,22 +99,17 @@ CHAIKRNL_FUNC HFILE VfsOpenFile(HFILE directory, const char16_t* name, uint32_t
 	if (!directory)
 	{
 		//Root volume
-		char16_t vol = name[0];
-		auto st = SharedSpinlockAcquire(volumelock, FALSE);
-		auto it = rootVolumes.find(vol);
-		if (it != rootVolumes.end())
-			directory = it->second;
-		SharedSpinlockRelease(volumelock, st);
+		directory = lookup_volume(name[0]);
 		//Knock off volume identifier
 		name += 3;
 	}
 	if (directory)
 	{
-		auto st = SharedSpinlockAcquire(treelock, FALSE);
+		auto st = BigReaderLockAcquire(treelock, FALSE);
 		auto it = handle_translator.find(directory);
 		if(it != handle_translator.end())
 			intInfo = it->second;
-		SharedSpinlockRelease(treelock, st);
+		BigReaderLockRelease(treelock, st);
 	}
 	
 	if (!intInfo)
@@ -96,18 +133,18 @@ CHAIKRNL_FUNC HFILE VfsOpenFile(HFILE directory, const char16_t* name, uint32_t
 	while (!arch_cas(&handle_alloc, alloc, alloc + 1))
 		alloc = handle_alloc;
 	HFILE fileHandle = (HFILE)alloc;
-	auto st = SharedSpinlockAcquire(treelock, TRUE);
+	auto st = BigReaderLockAcquire(treelock, TRUE);
 	handle_translator[fileHandle] = fileInfo;
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 
 	return fileHandle;
 }
 
 CHAIKRNL_FUNC ssize_t VfsReadFile(HFILE file, void* __user buffer, size_t requested, off_t offset, semaphore_t* asyncSem)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	internal_fs_info* intInfo = handle_translator[file];
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 
 	auto fs = intInfo->filesystemDriver;
 	return fs->read(fs->fsObject, intInfo->fileInfo.internalFile, buffer, requested, offset, asyncSem);
@@ -115,9 +152,9 @@ CHAIKRNL_FUNC ssize_t VfsReadFile(HFILE file, void* __user buffer, size_t reques
 
 CHAIKRNL_FUNC uint32_t VfsGetAttributes(HFILE file)
 {
-	auto st = SharedSpinlockAcquire(treelock, FALSE);
+	auto st = BigReaderLockAcquire(treelock, FALSE);
 	internal_fs_info* intInfo = handle_translator[file];
-	SharedSpinlockRelease(treelock, st);
+	BigReaderLockRelease(treelock, st);
 
 	auto fs = intInfo->filesystemDriver;
 	return fs->getAttributes(fs->fsObject, intInfo->fileInfo.internalFile);
@@ -126,17 +163,18 @@ CHAIKRNL_FUNC uint32_t VfsGetAttributes(HFILE file)
 EXTERN CHAIKRNL_FUNC char16_t VfsListRootVolumes(char16_t prev)
 {
 	char16_t retval = 0;
-	auto st = SharedSpinlockAcquire(volumelock, FALSE);
-	auto it = rootVolumes.find(prev);
-	if (it == rootVolumes.end())
-		it = rootVolumes.begin();
-	else
-		++it;
-	if (it == rootVolumes.end())
-		retval = 0;
-	else
-		retval = it->first;
-	SharedSpinlockRelease(volumelock, st);
+	size_t start = (prev >= u'A' && prev < u'A' + VFS_MAX_VOLUMES) ? prev - u'A' + 1 : 0;
+	rcu_read_lock();
+	volume_table* table = rcu_dereference(rootVolumes);
+	for (size_t n = start; table && n < VFS_MAX_VOLUMES; ++n)
+	{
+		if (table->volumes[n])
+		{
+			retval = u'A' + n;
+			break;
+		}
+	}
+	rcu_read_unlock();
 	return retval;
 }
 
@@ -145,6 +183,6 @@ void vfsInit()
 	if(inited)
 		return;
 	inited = true;
-	treelock = SharedSpinlockCreate();
-	volumelock = SharedSpinlockCreate();
+	treelock = BigReaderLockCreate();
+	volumelock = create_spinlock_class(&volumelock_key);
 }
\ No newline at end of file
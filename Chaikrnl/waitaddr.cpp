@@ -0,0 +1,169 @@
+#include <waitaddr.h>
+#include <spinlock.h>
+#include <linkedlist.h>
+#include <scheduler.h>
+#include <arch/cpu.h>
+#include <chaiatomic.h>
+
+#define WAIT_BUCKETS 256
+//Threads woken per pass of a bucket, lives on the waker's stack
+#define WAIT_WAKE_BATCH 16
+
+enum ADDR_WAITER_STATE {
+	ADDR_WAITER_IDLE,
+	ADDR_WAITER_QUEUED,
+	ADDR_WAITER_WOKEN
+};
+
+//Lives on the waiting thread's stack for the duration of the wait
+struct addr_waiter {
+	HTHREAD thread;
+	volatile void* addr;
+	const void* expected;
+	size_t size;
+	volatile ADDR_WAITER_STATE state;
+	struct wait_bucket* bucket;
+	linked_list_node<addr_waiter*> listnode;
+};
+
+static linked_list_node<addr_waiter*>& get_wait_node(addr_waiter* ent)
+{
+	return ent->listnode;
+}
+
+struct __declspec(align(64)) wait_bucket {
+	spinlock_t lock;
+	std::atomic<size_t> waiters;
+	LinkedList<addr_waiter*> queue;
+};
+
+static wait_bucket buckets[WAIT_BUCKETS];
+static lock_class_key wait_bucket_key = { "waitaddr_bucket" };
+static bool waitaddr_ready = false;
+
+static wait_bucket* bucket_for(volatile void* addr)
+{
+	//Fibonacci hashing spreads neighbouring words across buckets
+	size_t hash = ((size_t)addr >> 2) * 0x9E3779B97F4A7C15ui64;
+	return &buckets[hash >> 56];
+}
+
+static bool address_matches(volatile void* addr, const void* expected, size_t size)
+{
+	switch (size)
+	{
+	case 1:
+		return *(volatile uint8_t*)addr == *(const uint8_t*)expected;
+	case 2:
+		return *(volatile uint16_t*)addr == *(const uint16_t*)expected;
+	case 4:
+		return *(volatile uint32_t*)addr == *(const uint32_t*)expected;
+	case 8:
+		return *(volatile uint64_t*)addr == *(const uint64_t*)expected;
+	default:
+		return false;
+	}
+}
+
+void waitaddr_init()
+{
+	for (size_t n = 0; n < WAIT_BUCKETS; ++n)
+	{
+		buckets[n].lock = create_spinlock_class(&wait_bucket_key);
+		buckets[n].waiters.store(0, std::memory_order_relaxed);
+		buckets[n].queue.init(&get_wait_node);
+	}
+	waitaddr_ready = true;
+}
+
+static uint8_t should_sleep_addr(spinlock_t lock, void* param)
+{
+	addr_waiter* waiter = (addr_waiter*)param;
+	wait_bucket* bucket = waiter->bucket;
+	if (waiter->state == ADDR_WAITER_WOKEN)
+		return 0;
+	if (waiter->state == ADDR_WAITER_QUEUED)
+		return 1;
+	//Locked add orders the announcement before the value load, pairs with the fence in wake_address
+	bucket->waiters.fetch_add(1);
+	if (!address_matches(waiter->addr, waiter->expected, waiter->size))
+	{
+		bucket->waiters.fetch_sub(1);
+		return 0;
+	}
+	bucket->queue.insert(waiter);
+	waiter->state = ADDR_WAITER_QUEUED;
+	return 1;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t wait_on_address(volatile void* addr, const void* expected, size_t size, size_t timeout)
+{
+	if (!address_matches(addr, expected, size))
+		return 1;
+	if (!isscheduler() || !waitaddr_ready)
+	{
+		auto time = arch_get_system_timer();
+		while (address_matches(addr, expected, size))
+		{
+			if (timeout != TIMEOUT_INFINITY && arch_get_system_timer() > time + timeout)
+				return 0;
+			arch_pause();
+		}
+		return 1;
+	}
+
+	addr_waiter waiter;
+	waiter.thread = current_thread();
+	waiter.addr = addr;
+	waiter.expected = expected;
+	waiter.size = size;
+	waiter.state = ADDR_WAITER_IDLE;
+	waiter.bucket = bucket_for(addr);
+	cpu_status_t st;
+	scheduler_wait(timeout, waiter.bucket->lock, &should_sleep_addr, &waiter, &st);
+	bool timedout = waiter.state == ADDR_WAITER_QUEUED;
+	if (timedout)
+	{
+		waiter.bucket->queue.remove(&waiter);
+		waiter.bucket->waiters.fetch_sub(1);
+	}
+	release_spinlock(waiter.bucket->lock, st);
+	return timedout ? 0 : 1;
+}
+
+EXTERN CHAIKRNL_FUNC size_t wake_address(volatile void* addr, size_t count)
+{
+	if (!waitaddr_ready || count == 0)
+		return 0;
+	wait_bucket* bucket = bucket_for(addr);
+	//Order the caller's value update before the waiter check
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (bucket->waiters.load(std::memory_order_relaxed) == 0)
+		return 0;
+
+	size_t woken = 0;
+	HTHREAD towake[WAIT_WAKE_BATCH];
+	size_t nwake;
+	do {
+		nwake = 0;
+		auto st = acquire_spinlock(bucket->lock);
+		auto it = bucket->queue.begin();
+		while (it != bucket->queue.end() && nwake < WAIT_WAKE_BATCH && woken + nwake < count)
+		{
+			addr_waiter* waiter = *it;
+			++it;
+			if (waiter->addr != addr)
+				continue;
+			bucket->queue.remove(waiter);
+			bucket->waiters.fetch_sub(1);
+			//Node may vanish once the state is visible, so copy the thread first
+			towake[nwake++] = waiter->thread;
+			waiter->state = ADDR_WAITER_WOKEN;
+		}
+		release_spinlock(bucket->lock, st);
+		for (size_t n = 0; n < nwake; ++n)
+			wake_thread(towake[n]);
+		woken += nwake;
+	} while (nwake == WAIT_WAKE_BATCH && woken < count);
+	return woken;
+}
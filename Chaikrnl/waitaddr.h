@@ -0,0 +1,34 @@
+#ifndef CHAIOS_WAITADDR_H
+#define CHAIOS_WAITADDR_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+/*
+Futex-style sleeping on an arbitrary word. Waiters are kept in a fixed hashed table of wait queues, so any aligned 1, 2, 4 or 8 byte value can be waited on without allocating a semaphore.
+The caller owns the protocol: change the value, then wake. Waiters must recheck their condition, as wakeups may be shared with other addresses in the same bucket.
+*/
+
+#ifndef TIMEOUT_INFINITY
+#define TIMEOUT_INFINITY SIZE_MAX
+#endif
+
+#define WAKE_ALL SIZE_MAX
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+//Sleeps while the size byte value at addr equals *expected. Returns 0 on timeout, 1 if woken or the value had already changed
+CHAIKRNL_FUNC uint8_t wait_on_address(volatile void* addr, const void* expected, size_t size, size_t timeout);
+//Wakes up to count threads sleeping on addr in FIFO order. Returns the number woken
+CHAIKRNL_FUNC size_t wake_address(volatile void* addr, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+//Scheduler hook
+void waitaddr_init();
+
+#endif
@@ -0,0 +1,338 @@
+#include <waitobj.h>
+#include <dispatcher.h>
+#include <waitaddr.h>
+#include <arch/cpu.h>
+
+//Lives on the stack of the thread in wait_multiple
+struct multi_waiter {
+	std::atomic<size_t> fired;
+};
+
+//One per object waited on, queued on the object's watch list
+struct wait_block {
+	multi_waiter* waiter;
+	linked_list_node<wait_block*> listnode;
+};
+
+static linked_list_node<wait_block*>& get_watch_node(wait_block* ent)
+{
+	return ent->listnode;
+}
+
+lock_class_key dispatch_watch_key = { "dispatch_watch" };
+
+bool dispatch_init(dispatch_header* hdr, const dispatch_ops* ops)
+{
+	hdr->ops = ops;
+	hdr->watchers.store(0, std::memory_order_relaxed);
+	hdr->watch_lock = create_spinlock_class(&dispatch_watch_key);
+	hdr->watch_list.init(&get_watch_node);
+	return hdr->watch_lock != nullptr;
+}
+
+void dispatch_destroy(dispatch_header* hdr)
+{
+	delete_spinlock(hdr->watch_lock);
+}
+
+void dispatch_signal(dispatch_header* hdr)
+{
+	//Order the caller's state change before the watcher check, pairs with the add in watch
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (hdr->watchers.load(std::memory_order_relaxed) == 0)
+		return;
+	//Blocks are only unlinked under the lock, so their waiters are still in wait_multiple
+	auto st = acquire_spinlock(hdr->watch_lock);
+	for (auto it = hdr->watch_list.begin(); it != hdr->watch_list.end(); ++it)
+	{
+		multi_waiter* waiter = (*it)->waiter;
+		waiter->fired.store(1);
+		wake_address(&waiter->fired, 1);
+	}
+	release_spinlock(hdr->watch_lock, st);
+}
+
+static void watch(dispatch_header* hdr, wait_block* block)
+{
+	auto st = acquire_spinlock(hdr->watch_lock);
+	hdr->watch_list.insert(block);
+	hdr->watchers.fetch_add(1);
+	release_spinlock(hdr->watch_lock, st);
+}
+
+static void unwatch(dispatch_header* hdr, wait_block* block)
+{
+	auto st = acquire_spinlock(hdr->watch_lock);
+	hdr->watch_list.remove(block);
+	hdr->watchers.fetch_sub(1);
+	release_spinlock(hdr->watch_lock, st);
+}
+
+static size_t try_any(dispatch_header* const* hdrs, size_t count)
+{
+	for (size_t n = 0; n < count; ++n)
+	{
+		if (hdrs[n]->ops->acquire(hdrs[n]))
+			return n;
+	}
+	return WAIT_TIMEOUT;
+}
+
+static size_t try_all(dispatch_header* const* hdrs, size_t count)
+{
+	for (size_t n = 0; n < count; ++n)
+	{
+		if (!hdrs[n]->ops->ready(hdrs[n]))
+			return WAIT_TIMEOUT;
+	}
+	for (size_t n = 0; n < count; ++n)
+	{
+		if (hdrs[n]->ops->acquire(hdrs[n]))
+			continue;
+		//Lost a race, hand back what we took
+		while (n-- > 0)
+			hdrs[n]->ops->unacquire(hdrs[n]);
+		return WAIT_TIMEOUT;
+	}
+	return 0;
+}
+
+//Earliest time an object that isn't ready yet will signal itself
+static uint64_t next_deadline(dispatch_header* const* hdrs, size_t count)
+{
+	uint64_t earliest = UINT64_MAX;
+	for (size_t n = 0; n < count; ++n)
+	{
+		const dispatch_ops* ops = hdrs[n]->ops;
+		if (!ops->deadline || ops->ready(hdrs[n]))
+			continue;
+		uint64_t deadline = ops->deadline(hdrs[n]);
+		if (deadline < earliest)
+			earliest = deadline;
+	}
+	return earliest;
+}
+
+EXTERN CHAIKRNL_FUNC size_t wait_multiple(void* const* objects, size_t count, uint8_t all, size_t timeout)
+{
+	if (count == 0 || count > WAIT_MULTIPLE_MAX)
+		return WAIT_TIMEOUT;
+	dispatch_header* const* hdrs = (dispatch_header* const*)objects;
+	size_t result = all ? try_all(hdrs, count) : try_any(hdrs, count);
+	if (result != WAIT_TIMEOUT || timeout == 0)
+		return result;
+
+	multi_waiter waiter;
+	waiter.fired.store(0, std::memory_order_relaxed);
+	wait_block blocks[WAIT_MULTIPLE_MAX];
+	for (size_t n = 0; n < count; ++n)
+	{
+		blocks[n].waiter = &waiter;
+		watch(hdrs[n], &blocks[n]);
+	}
+	uint64_t start = arch_get_system_timer();
+	while (true)
+	{
+		//Cleared before retrying, so a signal from here on makes the sleep return at once
+		waiter.fired.store(0);
+		result = all ? try_all(hdrs, count) : try_any(hdrs, count);
+		if (result != WAIT_TIMEOUT)
+			break;
+		uint64_t now = arch_get_system_timer();
+		size_t remaining = TIMEOUT_INFINITY;
+		if (timeout != TIMEOUT_INFINITY)
+		{
+			if (now - start >= timeout)
+				break;
+			remaining = timeout - (now - start);
+		}
+		uint64_t deadline = next_deadline(hdrs, count);
+		if (deadline != UINT64_MAX)
+		{
+			size_t until = deadline > now ? deadline - now : 0;
+			if (until < remaining)
+				remaining = until;
+		}
+		size_t idle = 0;
+		wait_on_address(&waiter.fired, &idle, sizeof(size_t), remaining);
+	}
+	for (size_t n = 0; n < count; ++n)
+		unwatch(hdrs[n], &blocks[n]);
+	return result;
+}
+
+struct event {
+	dispatch_header header;
+	std::atomic<size_t> state;
+	bool manual_reset;
+};
+
+static bool event_ready(dispatch_header* hdr)
+{
+	return ((event*)hdr)->state.load(std::memory_order_acquire) != 0;
+}
+
+static bool event_acquire(dispatch_header* hdr)
+{
+	event* ev = (event*)hdr;
+	if (ev->manual_reset)
+		return event_ready(hdr);
+	size_t expected = 1;
+	return ev->state.load(std::memory_order_relaxed) != 0 && ev->state.compare_exchange_strong(expected, 0, std::memory_order_acquire);
+}
+
+static void event_unacquire(dispatch_header* hdr)
+{
+	event* ev = (event*)hdr;
+	if (!ev->manual_reset)
+		set_event(ev);
+}
+
+static const dispatch_ops event_ops = { &event_ready, &event_acquire, &event_unacquire, nullptr };
+
+EXTERN CHAIKRNL_FUNC event_t create_event(uint8_t manual_reset, uint8_t signalled)
+{
+	event* ev = new event;
+	if (!ev)
+		return nullptr;
+	if (!dispatch_init(&ev->header, &event_ops))
+	{
+		delete ev;
+		return nullptr;
+	}
+	ev->state.store(signalled ? 1 : 0, std::memory_order_relaxed);
+	ev->manual_reset = manual_reset != 0;
+	return (event_t)ev;
+}
+
+EXTERN CHAIKRNL_FUNC void delete_event(event_t evt)
+{
+	event* ev = (event*)evt;
+	dispatch_destroy(&ev->header);
+	delete ev;
+}
+
+EXTERN CHAIKRNL_FUNC void set_event(event_t evt)
+{
+	event* ev = (event*)evt;
+	ev->state.store(1);
+	wake_address(&ev->state, ev->manual_reset ? WAKE_ALL : 1);
+	dispatch_signal(&ev->header);
+}
+
+EXTERN CHAIKRNL_FUNC void reset_event(event_t evt)
+{
+	event* ev = (event*)evt;
+	ev->state.store(0, std::memory_order_release);
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t wait_event(event_t evt, size_t timeout)
+{
+	event* ev = (event*)evt;
+	uint64_t start = arch_get_system_timer();
+	while (!event_acquire(&ev->header))
+	{
+		size_t remaining = TIMEOUT_INFINITY;
+		if (timeout != TIMEOUT_INFINITY)
+		{
+			uint64_t elapsed = arch_get_system_timer() - start;
+			if (elapsed >= timeout)
+				return 0;
+			remaining = timeout - elapsed;
+		}
+		size_t unsignalled = 0;
+		wait_on_address(&ev->state, &unsignalled, sizeof(size_t), remaining);
+	}
+	return 1;
+}
+
+struct ktimer {
+	dispatch_header header;
+	//System time of the next expiry, 0 when disarmed
+	std::atomic<uint64_t> due;
+	std::atomic<size_t> period;
+};
+
+static bool timer_ready(dispatch_header* hdr)
+{
+	uint64_t due = ((ktimer*)hdr)->due.load(std::memory_order_acquire);
+	return due != 0 && arch_get_system_timer() >= due;
+}
+
+static bool timer_acquire(dispatch_header* hdr)
+{
+	ktimer* timer = (ktimer*)hdr;
+	uint64_t due = timer->due.load(std::memory_order_relaxed);
+	while (true)
+	{
+		uint64_t now = arch_get_system_timer();
+		if (due == 0 || now < due)
+			return false;
+		size_t period = timer->period.load(std::memory_order_relaxed);
+		uint64_t next = 0;
+		if (period != 0)
+		{
+			//Skip expiries nobody waited for rather than firing them back to back
+			next = due + period;
+			if (next <= now)
+				next = now + period;
+		}
+		if (timer->due.compare_exchange_weak(due, next, std::memory_order_acquire))
+			return true;
+	}
+}
+
+static void timer_unacquire(dispatch_header* hdr)
+{
+	ktimer* timer = (ktimer*)hdr;
+	//Expire again straight away, periodic timers pick their phase up from here
+	uint64_t now = arch_get_system_timer();
+	timer->due.store(now ? now : 1);
+	dispatch_signal(hdr);
+}
+
+static uint64_t timer_deadline(dispatch_header* hdr)
+{
+	uint64_t due = ((ktimer*)hdr)->due.load(std::memory_order_relaxed);
+	return due ? due : UINT64_MAX;
+}
+
+static const dispatch_ops timer_ops = { &timer_ready, &timer_acquire, &timer_unacquire, &timer_deadline };
+
+EXTERN CHAIKRNL_FUNC ktimer_t create_timer()
+{
+	ktimer* timer = new ktimer;
+	if (!timer)
+		return nullptr;
+	if (!dispatch_init(&timer->header, &timer_ops))
+	{
+		delete timer;
+		return nullptr;
+	}
+	timer->due.store(0, std::memory_order_relaxed);
+	timer->period.store(0, std::memory_order_relaxed);
+	return (ktimer_t)timer;
+}
+
+EXTERN CHAIKRNL_FUNC void delete_timer(ktimer_t tmr)
+{
+	ktimer* timer = (ktimer*)tmr;
+	dispatch_destroy(&timer->header);
+	delete timer;
+}
+
+EXTERN CHAIKRNL_FUNC void set_timer(ktimer_t tmr, size_t due, size_t period)
+{
+	ktimer* timer = (ktimer*)tmr;
+	timer->period.store(period, std::memory_order_relaxed);
+	uint64_t at = arch_get_system_timer() + due;
+	timer->due.store(at ? at : 1);
+	//Waiters recompute how long to sleep
+	dispatch_signal(&timer->header);
+}
+
+EXTERN CHAIKRNL_FUNC void cancel_timer(ktimer_t tmr)
+{
+	ktimer* timer = (ktimer*)tmr;
+	timer->due.store(0);
+}
@@ -0,0 +1,51 @@
+#ifndef CHAIOS_WAITOBJ_H
+#define CHAIOS_WAITOBJ_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+typedef void* event_t;
+typedef void* ktimer_t;
+
+#ifndef TIMEOUT_INFINITY
+#define TIMEOUT_INFINITY SIZE_MAX
+#endif
+
+#define WAIT_MULTIPLE_MAX 64
+#define WAIT_TIMEOUT SIZE_MAX
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+/*
+Blocks until one (all == 0) or every (all != 0) object is signalled, or timeout ms pass.
+Objects may be semaphores (takes one unit), events and timers, in any mix. With all set, nothing is consumed until every object can be.
+Returns the index of the object that satisfied the wait (0 when waiting for all), or WAIT_TIMEOUT.
+*/
+CHAIKRNL_FUNC size_t wait_multiple(void* const* objects, size_t count, uint8_t all, size_t timeout);
+
+/*
+Events. Manual reset events stay signalled and release every waiter until reset.
+Auto reset events release a single waiter, then reset themselves.
+*/
+CHAIKRNL_FUNC event_t create_event(uint8_t manual_reset, uint8_t signalled);
+CHAIKRNL_FUNC void delete_event(event_t event);
+CHAIKRNL_FUNC void set_event(event_t event);
+CHAIKRNL_FUNC void reset_event(event_t event);
+CHAIKRNL_FUNC uint8_t wait_event(event_t event, size_t timeout);
+
+/*
+Timers become signalled due ms after being set. A wait consumes the expiry, rearming periodic timers period ms later.
+A timer never set, or cancelled, is never signalled.
+*/
+CHAIKRNL_FUNC ktimer_t create_timer();
+CHAIKRNL_FUNC void delete_timer(ktimer_t timer);
+CHAIKRNL_FUNC void set_timer(ktimer_t timer, size_t due, size_t period);
+CHAIKRNL_FUNC void cancel_timer(ktimer_t timer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,194 @@
+#include <xcall.h>
+#include <mpmc_ring.h>
+#include <arch/cpu.h>
+#include <chaiatomic.h>
+
+static const size_t XCALL_MAX_CPUS = 256;
+static const size_t XCALL_QUEUE_DEPTH = 64;
+//Calls run per dequeue, lives on the handler's stack
+static const size_t XCALL_BATCH = 16;
+
+struct xcall_request {
+	xcall_func func;
+	void* param;
+	//Caller's completion count, null when nobody waits
+	std::atomic<size_t>* pending;
+};
+
+struct xcall_queue {
+	mpmc_ring<xcall_request, false, true> ring;
+	//Set once an IPI is on its way, cleared by the handler before it drains
+	std::atomic<size_t> kicked;
+};
+
+static xcall_queue* volatile queues[XCALL_MAX_CPUS];
+static std::atomic<size_t> online_cpus;
+
+static uint32_t this_cpu()
+{
+	return pcpu_data.cpuid;
+}
+
+static xcall_queue* get_queue(uint32_t processor)
+{
+	return queues[processor % XCALL_MAX_CPUS];
+}
+
+void xcall_cpu_init()
+{
+	xcall_queue* q = new xcall_queue;
+	if (!q || !q->ring.init(XCALL_QUEUE_DEPTH))
+		return;
+	q->kicked.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	queues[this_cpu() % XCALL_MAX_CPUS] = q;
+	online_cpus.fetch_add(1);
+}
+
+static void run_queue(xcall_queue* q)
+{
+	//Senders enqueueing after this will kick us again
+	q->kicked.store(0);
+	xcall_request batch[XCALL_BATCH];
+	size_t count;
+	while ((count = q->ring.dequeue_batch(batch, XCALL_BATCH)) != 0)
+	{
+		for (size_t n = 0; n < count; ++n)
+		{
+			batch[n].func(batch[n].param);
+			if (batch[n].pending)
+				batch[n].pending->fetch_sub(1);
+		}
+	}
+}
+
+void xcall_interrupt()
+{
+	if (xcall_queue* q = get_queue(this_cpu()))
+		run_queue(q);
+}
+
+//Keeps our own queue moving while we spin, so two CPUs calling each other can't deadlock.
+//The ring has a single consumer, so interrupts stay off: the IPI handler mustn't drain it under us
+static void poll_own_queue()
+{
+	auto st = arch_disable_interrupts();
+	xcall_queue* q = get_queue(this_cpu());
+	if (q && !q->ring.empty())
+		run_queue(q);
+	arch_restore_state(st);
+}
+
+static void wait_pending(std::atomic<size_t>& pending)
+{
+	while (pending.load(std::memory_order_acquire) != 0)
+	{
+		poll_own_queue();
+		arch_pause();
+	}
+}
+
+//Returns true if the caller needs to send the IPI
+static bool enqueue(xcall_queue* q, const xcall_request& req)
+{
+	while (!q->ring.try_enqueue(req))
+	{
+		//The target is behind. Make sure it knows, and keep our own queue moving meanwhile
+		poll_own_queue();
+		arch_pause();
+	}
+	return q->kicked.exchange(1) == 0;
+}
+
+static void run_local(xcall_func func, void* param)
+{
+	auto st = arch_disable_interrupts();
+	func(param);
+	arch_restore_state(st);
+}
+
+static uint8_t post(uint32_t processor, xcall_func func, void* param, std::atomic<size_t>* pending)
+{
+	xcall_queue* q = get_queue(processor);
+	if (!q)
+		return 0;
+	xcall_request req = { func, param, pending };
+	if (enqueue(q, req))
+		arch_send_ipi(processor, IPI_VECTOR_XCALL);
+	return 1;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t xcall_sync(uint32_t processor, xcall_func func, void* param)
+{
+	if (online_cpus.load(std::memory_order_relaxed) == 0)
+		return 0;
+	if (processor == this_cpu())
+	{
+		run_local(func, param);
+		return 1;
+	}
+	std::atomic<size_t> pending;
+	pending.store(1, std::memory_order_relaxed);
+	if (!post(processor, func, param, &pending))
+		return 0;
+	wait_pending(pending);
+	return 1;
+}
+
+EXTERN CHAIKRNL_FUNC uint8_t xcall_async(uint32_t processor, xcall_func func, void* param)
+{
+	if (online_cpus.load(std::memory_order_relaxed) == 0)
+		return 0;
+	if (processor == this_cpu())
+	{
+		run_local(func, param);
+		return 1;
+	}
+	return post(processor, func, param, nullptr);
+}
+
+EXTERN CHAIKRNL_FUNC void xcall_all(xcall_func func, void* param, uint8_t wait)
+{
+	//Early boot, before per-CPU data. Only this CPU is running
+	if (online_cpus.load(std::memory_order_relaxed) == 0)
+		return run_local(func, param);
+	uint32_t self = this_cpu();
+	std::atomic<size_t> pending;
+	pending.store(0, std::memory_order_relaxed);
+	xcall_request req = { func, param, wait ? &pending : nullptr };
+	for (uint32_t cpu = 0; cpu < XCALL_MAX_CPUS; ++cpu)
+	{
+		xcall_queue* q = queues[cpu];
+		if (!q || cpu == self)
+			continue;
+		if (wait)
+			pending.fetch_add(1);
+		//Only CPUs with a queue, a broadcast would also hit ones that haven't set theirs up
+		if (enqueue(q, req))
+			arch_send_ipi(cpu, IPI_VECTOR_XCALL);
+	}
+	run_local(func, param);
+	if (wait)
+		wait_pending(pending);
+}
+
+EXTERN CHAIKRNL_FUNC void xcall_poll()
+{
+	poll_own_queue();
+}
+
+EXTERN CHAIKRNL_FUNC size_t xcall_online_cpus()
+{
+	return online_cpus.load(std::memory_order_relaxed);
+}
+
+EXTERN CHAIKRNL_FUNC size_t xcall_online_cpu_ids(uint32_t* ids, size_t max)
+{
+	size_t count = 0;
+	for (uint32_t cpu = 0; cpu < XCALL_MAX_CPUS && count < max; ++cpu)
+	{
+		if (queues[cpu])
+			ids[count++] = cpu;
+	}
+	return count;
+}
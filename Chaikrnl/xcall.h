@@ -0,0 +1,39 @@
+#ifndef CHAIOS_XCALL_H
+#define CHAIOS_XCALL_H
+
+#include <stdheaders.h>
+#include <chaikrnl.h>
+
+/*
+Cross-calls: run a function on other CPUs with interrupts disabled, from their IPI handler or while they wait on cross-calls of their own.
+Each CPU has a lock-free queue of calls. A CPU is only sent an IPI when its queue goes from idle to busy, so a burst of calls costs one interrupt.
+Processors are architectural IDs. Calls must not block.
+*/
+typedef void(*xcall_func)(void* param);
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+//Runs func(param) on processor and waits for it to finish. Returns 0 if the processor isn't online
+CHAIKRNL_FUNC uint8_t xcall_sync(uint32_t processor, xcall_func func, void* param);
+//Queues func(param) for processor and returns at once
+CHAIKRNL_FUNC uint8_t xcall_async(uint32_t processor, xcall_func func, void* param);
+//Runs func(param) on every online CPU, the caller included, optionally waiting for all of them
+CHAIKRNL_FUNC void xcall_all(xcall_func func, void* param, uint8_t wait);
+//Number of CPUs taking cross-calls
+CHAIKRNL_FUNC size_t xcall_online_cpus();
+//Fills ids with up to max online processor IDs, returns how many were written
+CHAIKRNL_FUNC size_t xcall_online_cpu_ids(uint32_t* ids, size_t max);
+//Runs anything queued for this CPU, with interrupts disabled while it does. For code spinning on other CPUs, which may be waiting on us in turn
+CHAIKRNL_FUNC void xcall_poll();
+
+#ifdef __cplusplus
+}
+#endif
+
+//Arch hooks: set up the current CPU's queue, and drain it from the IPI handler
+void xcall_cpu_init();
+void xcall_interrupt();
+
+#endif
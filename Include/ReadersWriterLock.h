@@ -17,6 +17,18 @@ CHAIKRNL_FUNC void SharedSpinlockDelete(sharespinlock_t lock);
 CHAIKRNL_FUNC cpu_status_t SharedSpinlockAcquire(sharespinlock_t lock, BOOL exclusive);
 CHAIKRNL_FUNC void SharedSpinlockRelease(sharespinlock_t lock, cpu_status_t status);
 
+/*
+Big reader lock - readers only touch a per-CPU counter, writers sweep every CPU.
+Writers take priority: new readers back off while a writer waits.
+For read-mostly tables, writes are expensive
+*/
+typedef void* brlock_t;
+
+CHAIKRNL_FUNC brlock_t BigReaderLockCreate();
+CHAIKRNL_FUNC void BigReaderLockDelete(brlock_t lock);
+CHAIKRNL_FUNC cpu_status_t BigReaderLockAcquire(brlock_t lock, BOOL exclusive);
+CHAIKRNL_FUNC void BigReaderLockRelease(brlock_t lock, cpu_status_t status);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,9 +23,9 @@ CHAIKRNL_FUNC void arch_pause();		//Hyperthreading hint
 
 typedef size_t cpu_status_t;
 
-cpu_status_t arch_disable_interrupts();
+CHAIKRNL_FUNC cpu_status_t arch_disable_interrupts();
 cpu_status_t arch_enable_interrupts();
-void arch_restore_state(cpu_status_t val);
+CHAIKRNL_FUNC void arch_restore_state(cpu_status_t val);
 
 #define BREAKPOINT_CODE 0
 #define BREAKPOINT_WRITE 1
@@ -63,8 +63,15 @@ typedef struct _per_cpu_data {
 	void* running_thread;
 	uint64_t cpu_ticks;
 	uint32_t cpu_id;
+	uint32_t irql;
+	void* kstack;
+	//Added to the address of a per-CPU variable to find this CPU's copy, see percpu.h
+	size_t percpu_offset;
 }per_cpu_data;
 
+//cpu_id until the CPU's own per-CPU block is set up
+#define PCPU_ID_UNSET UINT32_MAX
+
 #ifdef __cplusplus
 static class _cpu_data {
 	static const uint32_t offset_ptr = 0;
@@ -73,7 +80,8 @@ static class _cpu_data {
 	static const uint32_t offset_id = 0x18;
 	static const uint32_t offset_irql = 0x1C;
 	static const uint32_t offset_kstack = 0x20;
-	static const uint32_t offset_max = 0x28;
+	static const uint32_t offset_percpu = 0x28;
+	static const uint32_t offset_max = 0x30;
 public:
 	static const size_t data_size = 0x38;
 	class cpu_id {
@@ -107,6 +115,12 @@ public:
 		void* operator = (void* i) { arch_write_per_cpu_data(offset_kstack, 64, (size_t)i); return i; }
 		operator void*() const { return (void*)arch_read_per_cpu_data(offset_kstack, 64); }
 	}kstack;
+
+	class cpu_percpu_offset {
+	public:
+		size_t operator = (size_t i) { arch_write_per_cpu_data(offset_percpu, 64, i); return i; }
+		operator size_t() const { return arch_read_per_cpu_data(offset_percpu, 64); }
+	}percpuoffset;
 }pcpu_data;
 uint64_t arch_msi_address(uint64_t* data, size_t vector, uint32_t processor, uint8_t edgetrigger = 1, uint8_t deassert = 0);
 #endif
@@ -116,15 +130,30 @@ CHAIKRNL_FUNC void arch_register_interrupt_subsystem(uint32_t subsystem, arch_in
 typedef uint8_t(*dispatch_interrupt_handler)(size_t vector, void* param);
 #define INTERRUPT_ALLCPUS (-1)
 #define INTERRUPT_CURRENTCPU (-2)
+//Replaces any handler already on the vector
 CHAIKRNL_FUNC void arch_register_interrupt_handler(uint32_t subsystem, size_t vector, uint32_t processor, void* fn, void* param);
+//Dispatch subsystem only. Adds fn to the vector's handlers, all of which run on each interrupt, for sources sharing a vector
+//Returns 0 if the processor isn't set up or the handler couldn't be allocated
+CHAIKRNL_FUNC uint8_t arch_register_shared_interrupt_handler(size_t vector, uint32_t processor, dispatch_interrupt_handler fn, void* param);
 CHAIKRNL_FUNC void arch_install_interrupt_post_event(uint32_t subsystem, size_t vector, uint32_t processor, void(*evt)());
 
+//Interrupts taken on vector by processor, and CPU ticks spent in its handlers. Returns 0 if the processor isn't set up
+CHAIKRNL_FUNC uint8_t arch_interrupt_stats(uint32_t processor, size_t vector, uint64_t* count, uint64_t* ticks);
+
 CHAIKRNL_FUNC uint32_t arch_allocate_interrupt_vector();
+//Current CPU. Unregisters the vector's handler and post event and makes it available again
+CHAIKRNL_FUNC void arch_free_interrupt_vector(uint32_t vector);
 CHAIKRNL_FUNC void arch_reserve_interrupt_range(uint32_t start, uint32_t end);
 
+//Fixed vector for cross-call IPIs, see xcall.h
+#define IPI_VECTOR_XCALL 0xF0
+//Sends vector to processor, or to every other CPU with INTERRUPT_ALLCPUS
+void arch_send_ipi(uint32_t processor, uint32_t vector);
+
 void arch_set_paging_root(size_t root);
 
-uint32_t arch_current_processor_id();
+//APIC ID of the current CPU. Cached in the per-CPU data once it's set up
+CHAIKRNL_FUNC uint32_t arch_current_processor_id();
 uint8_t arch_startup_cpu(uint32_t processor, void* address, volatile size_t* rendezvous, size_t rendezvousval);
 uint8_t arch_is_bsp();
 void arch_halt();
@@ -174,8 +203,17 @@ size_t cpu_get_cache_linesize(uint8_t cache_level, ARCH_CACHE_TYPE type);
 
 typedef void(*cpu_cache_callback)(uint8_t, ARCH_CACHE_TYPE);
 size_t iterate_cpu_caches(cpu_cache_callback callback);
+//Most logical processors that can share the cache, 0 if unknown
+size_t cpu_get_cache_sharing(uint8_t cache_level, ARCH_CACHE_TYPE type);
 #endif
 
+//How the boot CPU's APIC ID splits up. Below smt_shift numbers threads in a core, from package_shift up numbers packages
+struct arch_topology_shifts {
+	uint8_t smt_shift;
+	uint8_t package_shift;
+};
+void arch_get_topology_shifts(struct arch_topology_shifts* shifts);
+
 void cpu_print_information();
 CHAIKRNL_FUNC uint64_t arch_get_system_timer();
 
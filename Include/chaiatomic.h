@@ -1,27 +1,233 @@
 #ifndef CHAIOS_ATOMIC_H
 #define CHAIOS_ATOMIC_H
 
+#include <stdheaders.h>
+#include <chaikrnl.h>
 #include <arch/cpu.h>
 
 #ifdef __cplusplus
+EXTERN{
+#endif
+
+/*
+Wait/notify hooks for atomic::wait. Blocks while the size byte value at addr equals *expected.
+Kernel and drivers share one implementation, so a notify from either side reaches waiters on both.
+*/
+CHAIKRNL_FUNC void atomic_wait_address(volatile void* addr, const void* expected, size_t size);
+CHAIKRNL_FUNC void atomic_notify_address(volatile void* addr, BOOL all);
+
+#ifdef __cplusplus
+}
+
+#undef __midl
+#include <intrin.h>
 
+/*
+Freestanding std::atomic for x64 (TSO).
+Loads are plain moves at any order, stores only fence at seq_cst, and every read-modify-write is a locked instruction.
+Acquire and release orders only constrain the compiler.
+*/
 namespace std {
-	template <class T> class atomic {
+	enum memory_order {
+		memory_order_relaxed,
+		memory_order_consume,
+		memory_order_acquire,
+		memory_order_release,
+		memory_order_acq_rel,
+		memory_order_seq_cst
 	};
-	class atomic_size_t : public atomic<size_t>
+
+	inline void atomic_signal_fence(memory_order order)
 	{
+		if (order != memory_order_relaxed)
+			_ReadWriteBarrier();
+	}
+	inline void atomic_thread_fence(memory_order order)
+	{
+		if (order == memory_order_seq_cst)
+			_mm_mfence();
+		else if (order != memory_order_relaxed)
+			_ReadWriteBarrier();
+	}
+
+	namespace atomic_detail {
+		template <size_t N> struct ops;
+
+#define CHAIOS_ATOMIC_OPS(size, type, suffix) \
+		template <> struct ops<size> { \
+			typedef type storage; \
+			static storage exchange(volatile storage* p, storage v) { return _InterlockedExchange##suffix(p, v); } \
+			static storage cas(volatile storage* p, storage expected, storage desired) { return _InterlockedCompareExchange##suffix(p, desired, expected); } \
+			static storage fetch_add(volatile storage* p, storage v) { return _InterlockedExchangeAdd##suffix(p, v); } \
+			static storage fetch_and(volatile storage* p, storage v) { return _InterlockedAnd##suffix(p, v); } \
+			static storage fetch_or(volatile storage* p, storage v) { return _InterlockedOr##suffix(p, v); } \
+			static storage fetch_xor(volatile storage* p, storage v) { return _InterlockedXor##suffix(p, v); } \
+		};
+
+		CHAIOS_ATOMIC_OPS(1, char, 8)
+		CHAIOS_ATOMIC_OPS(2, short, 16)
+		CHAIOS_ATOMIC_OPS(4, long, )
+		CHAIOS_ATOMIC_OPS(8, __int64, 64)
+#undef CHAIOS_ATOMIC_OPS
+	}
+
+	//Integral, enum and pointer types of 1, 2, 4 or 8 bytes
+	template <class T> class atomic_base {
+	protected:
+		typedef atomic_detail::ops<sizeof(T)> ops;
+		typedef typename ops::storage storage;
 	public:
-		atomic_size_t()
+		atomic_base() = default;
+		constexpr atomic_base(T value) :m_value((storage)value) {}
+		atomic_base(const atomic_base&) = delete;
+		atomic_base& operator=(const atomic_base&) = delete;
+
+		static constexpr bool is_always_lock_free = true;
+		bool is_lock_free() const volatile { return true; }
+
+		T load(memory_order order = memory_order_seq_cst) const volatile
+		{
+			T value = (T)m_value;
+			atomic_signal_fence(order);
+			return value;
+		}
+		void store(T value, memory_order order = memory_order_seq_cst) volatile
+		{
+			if (order == memory_order_seq_cst)
+			{
+				ops::exchange(&m_value, (storage)value);
+				return;
+			}
+			atomic_signal_fence(order);
+			m_value = (storage)value;
+		}
+		T exchange(T value, memory_order = memory_order_seq_cst) volatile
+		{
+			return (T)ops::exchange(&m_value, (storage)value);
+		}
+		//Updates expected with the current value on failure
+		bool compare_exchange_strong(T& expected, T desired, memory_order = memory_order_seq_cst, memory_order = memory_order_seq_cst) volatile
 		{
-			internalValue = 0;
+			storage prev = ops::cas(&m_value, (storage)expected, (storage)desired);
+			if (prev == (storage)expected)
+				return true;
+			expected = (T)prev;
+			return false;
 		}
-		size_t operator =(size_t value)
+		//cmpxchg cannot fail spuriously
+		bool compare_exchange_weak(T& expected, T desired, memory_order success = memory_order_seq_cst, memory_order failure = memory_order_seq_cst) volatile
 		{
+			return compare_exchange_strong(expected, desired, success, failure);
+		}
+
+		operator T() const volatile { return load(); }
+		T operator=(T value) volatile { store(value); return value; }
 
+		//Blocks while the value equals old, until notified
+		void wait(T old, memory_order order = memory_order_seq_cst) const volatile
+		{
+			while (load(order) == old)
+				atomic_wait_address((volatile void*)&m_value, &old, sizeof(T));
 		}
-	private:
-		size_t internalValue;
+		void notify_one() volatile { atomic_notify_address(&m_value, FALSE); }
+		void notify_all() volatile { atomic_notify_address(&m_value, TRUE); }
+	protected:
+		volatile storage m_value;
+	};
+
+	template <class T> class atomic : public atomic_base<T> {
+		typedef atomic_base<T> base;
+		using typename base::ops;
+		using typename base::storage;
+	public:
+		atomic() = default;
+		constexpr atomic(T value) :base(value) {}
+		using base::operator=;
+
+		T fetch_add(T v, memory_order = memory_order_seq_cst) volatile { return (T)ops::fetch_add(&this->m_value, (storage)v); }
+		T fetch_sub(T v, memory_order = memory_order_seq_cst) volatile { return (T)ops::fetch_add(&this->m_value, (storage)(0 - v)); }
+		T fetch_and(T v, memory_order = memory_order_seq_cst) volatile { return (T)ops::fetch_and(&this->m_value, (storage)v); }
+		T fetch_or(T v, memory_order = memory_order_seq_cst) volatile { return (T)ops::fetch_or(&this->m_value, (storage)v); }
+		T fetch_xor(T v, memory_order = memory_order_seq_cst) volatile { return (T)ops::fetch_xor(&this->m_value, (storage)v); }
+
+		T operator++() volatile { return fetch_add(1) + 1; }
+		T operator++(int) volatile { return fetch_add(1); }
+		T operator--() volatile { return fetch_sub(1) - 1; }
+		T operator--(int) volatile { return fetch_sub(1); }
+		T operator+=(T v) volatile { return fetch_add(v) + v; }
+		T operator-=(T v) volatile { return fetch_sub(v) - v; }
+		T operator&=(T v) volatile { return fetch_and(v) & v; }
+		T operator|=(T v) volatile { return fetch_or(v) | v; }
+		T operator^=(T v) volatile { return fetch_xor(v) ^ v; }
 	};
+
+	//Pointer arithmetic is scaled by the pointee size
+	template <class T> class atomic<T*> : public atomic_base<T*> {
+		typedef atomic_base<T*> base;
+		using typename base::ops;
+		using typename base::storage;
+	public:
+		atomic() = default;
+		constexpr atomic(T* value) :base(value) {}
+		using base::operator=;
+
+		T* fetch_add(intptr_t v, memory_order = memory_order_seq_cst) volatile { return (T*)ops::fetch_add(&this->m_value, (storage)(v * (intptr_t)sizeof(T))); }
+		T* fetch_sub(intptr_t v, memory_order = memory_order_seq_cst) volatile { return fetch_add(-v); }
+		T* operator+=(intptr_t v) volatile { return fetch_add(v) + v; }
+		T* operator-=(intptr_t v) volatile { return fetch_sub(v) - v; }
+	};
+
+	template <> class atomic<bool> : public atomic_base<bool> {
+	public:
+		atomic() = default;
+		constexpr atomic(bool value) :atomic_base<bool>(value) {}
+		using atomic_base<bool>::operator=;
+	};
+
+	typedef atomic<bool> atomic_bool;
+	typedef atomic<int32_t> atomic_int32_t;
+	typedef atomic<uint32_t> atomic_uint32_t;
+	typedef atomic<int64_t> atomic_int64_t;
+	typedef atomic<uint64_t> atomic_uint64_t;
+	typedef atomic<size_t> atomic_size_t;
+	typedef atomic<intptr_t> atomic_intptr_t;
+	typedef atomic<uintptr_t> atomic_uintptr_t;
+};
+
+/*
+16 byte atomic via cmpxchg16b, for pointer + generation counter pairs in ABA-safe lock-free structures.
+Loads are a CAS too, so the line is always written. Keep it off read-mostly paths.
+*/
+typedef struct __declspec(align(16)) _atomic_u128 {
+	uint64_t lo;
+	uint64_t hi;
+}atomic_u128;
+
+class __declspec(align(16)) atomic128 {
+public:
+	atomic128() = default;
+	atomic128(atomic_u128 value) :m_value(value) {}
+	atomic128(const atomic128&) = delete;
+	atomic128& operator=(const atomic128&) = delete;
+
+	//Updates expected with the current value on failure
+	bool compare_exchange(atomic_u128& expected, atomic_u128 desired) volatile
+	{
+		return _InterlockedCompareExchange128((volatile __int64*)&m_value, (__int64)desired.hi, (__int64)desired.lo, (__int64*)&expected) != 0;
+	}
+	atomic_u128 load() volatile
+	{
+		atomic_u128 value = { 0, 0 };
+		compare_exchange(value, value);
+		return value;
+	}
+	void store(atomic_u128 value) volatile
+	{
+		atomic_u128 expected = { m_value.lo, m_value.hi };
+		while (!compare_exchange(expected, value));
+	}
+private:
+	volatile atomic_u128 m_value;
 };
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef CHAIOS_KMEM_CACHE_H
+#define CHAIOS_KMEM_CACHE_H
+
+#include <stdheaders.h>
+
+/*
+Object caches for hot fixed size kernel objects, after Solaris' kmem_cache. They share the per-CPU magazines, depot and slabs behind kmalloc.
+The constructor runs on each object when its slab is made, not on every allocation. Objects must be freed in their constructed state, so things like an embedded lock survive reuse.
+Each new slab starts its objects at the next cache colour, so the same object in different slabs doesn't always land on the same cache lines.
+*/
+typedef void* kmem_cache_t;
+typedef void(*kmem_ctor_func)(void* obj, void* context);
+typedef void(*kmem_dtor_func)(void* obj, void* context);
+
+typedef struct _kmem_cache_stats {
+	size_t object_size;
+	size_t objects_per_slab;
+	size_t slabs;
+	uint64_t allocations;
+	uint64_t frees;
+	//Magazines traded with the depot
+	uint64_t depot_exchanges;
+	//Allocations the magazines and depot couldn't satisfy
+	uint64_t slab_allocations;
+}kmem_cache_stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//align is a power of two up to 64, 0 for pointer alignment. Objects can be up to a page less the slab header. Returns NULL otherwise
+extern KCSTDLIB_FUNC kmem_cache_t kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_func ctor, kmem_dtor_func dtor, void* context);
+//Every object must have been freed, and no CPU may still be using the cache
+extern KCSTDLIB_FUNC void kmem_cache_destroy(kmem_cache_t cache);
+extern KCSTDLIB_FUNC void* kmem_cache_alloc(kmem_cache_t cache);
+extern KCSTDLIB_FUNC void kmem_cache_free(kmem_cache_t cache, void* obj);
+extern KCSTDLIB_FUNC void kmem_cache_get_stats(kmem_cache_t cache, kmem_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
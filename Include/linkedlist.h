@@ -39,6 +39,18 @@ public:
 			m_start = val;
 		++m_length;
 	}
+	//Next to be popped
+	void insert_front(T val)
+	{
+		set_prev(val, nullptr);
+		set_next(val, m_start);
+		if (m_start)
+			set_prev(m_start, val);
+		m_start = val;
+		if (!m_end)
+			m_end = val;
+		++m_length;
+	}
 	void join_existing_list(T start, T end, size_t length)
 	{
 		if (m_end != nullptr)
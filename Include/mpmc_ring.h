@@ -0,0 +1,300 @@
+#ifndef CHAIOS_MPMC_RING_H
+#define CHAIOS_MPMC_RING_H
+
+#ifdef CHAIOS_HOST_BUILD
+//Unit tests on the host only need the lock-free ring
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __cplusplus
+#include <atomic>
+#endif
+#else
+#include <stdheaders.h>
+#include <chaikrnl.h>
+#include <semaphore.h>
+#endif
+
+#ifndef CHAIOS_HOST_BUILD
+typedef void* msg_ring_t;
+
+#ifdef __cplusplus
+EXTERN{
+#endif
+
+/*
+Blocking pointer queue for C code, such as the lwIP mailboxes.
+Timeouts are in ms, 0 polls, TIMEOUT_INFINITY waits forever. Returns 0 on timeout or if full/empty.
+*/
+CHAIKRNL_FUNC msg_ring_t create_msg_ring(size_t capacity);
+CHAIKRNL_FUNC void delete_msg_ring(msg_ring_t ring);
+CHAIKRNL_FUNC uint8_t msg_ring_post(msg_ring_t ring, void* msg, size_t timeout);
+CHAIKRNL_FUNC uint8_t msg_ring_fetch(msg_ring_t ring, void** msg, size_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+#ifdef __cplusplus
+#ifndef CHAIOS_HOST_BUILD
+#include <chaiatomic.h>
+#endif
+
+/*
+Bounded lock-free queue (Vyukov). Each cell carries a sequence number saying whose turn it is, so producers and consumers only contend on their own position counter.
+With single_producer or single_consumer set, that side claims positions with a plain store instead of a CAS.
+Capacity is rounded up to a power of two.
+*/
+template <class T, bool single_producer = false, bool single_consumer = false> class mpmc_ring {
+public:
+	mpmc_ring()
+		:m_cells(nullptr), m_mask(0)
+	{
+		m_enqueue.store(0, std::memory_order_relaxed);
+		m_dequeue.store(0, std::memory_order_relaxed);
+	}
+	explicit mpmc_ring(size_t capacity)
+		:mpmc_ring()
+	{
+		init(capacity);
+	}
+	~mpmc_ring()
+	{
+		delete[] m_cells;
+	}
+	mpmc_ring(const mpmc_ring&) = delete;
+	mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+	bool init(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		m_cells = new cell[size];
+		if (!m_cells)
+			return false;
+		for (size_t n = 0; n < size; ++n)
+			m_cells[n].sequence.store(n, std::memory_order_relaxed);
+		m_mask = size - 1;
+		return true;
+	}
+	size_t capacity() const { return m_mask + 1; }
+
+	bool try_enqueue(const T& value)
+	{
+		return enqueue_batch(&value, 1) == 1;
+	}
+	bool try_dequeue(T& value)
+	{
+		return dequeue_batch(&value, 1) == 1;
+	}
+
+	//Enqueues up to count items in order with a single position claim. Returns the number enqueued
+	size_t enqueue_batch(const T* values, size_t count)
+	{
+		size_t pos = m_enqueue.load(std::memory_order_relaxed);
+		size_t claimed;
+		while (true)
+		{
+			claimed = free_run(pos, count, 0);
+			if (claimed == 0)
+			{
+				//Full, unless another producer moved on under us
+				size_t current = m_enqueue.load(std::memory_order_relaxed);
+				if (current == pos)
+					return 0;
+				pos = current;
+				continue;
+			}
+			if (single_producer)
+			{
+				m_enqueue.store(pos + claimed, std::memory_order_relaxed);
+				break;
+			}
+			if (m_enqueue.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+				break;
+		}
+		for (size_t n = 0; n < claimed; ++n)
+		{
+			cell& c = m_cells[(pos + n) & m_mask];
+			c.data = values[n];
+			c.sequence.store(pos + n + 1, std::memory_order_release);
+		}
+		return claimed;
+	}
+	//Dequeues up to count items in order. Returns the number dequeued
+	size_t dequeue_batch(T* values, size_t count)
+	{
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		size_t claimed;
+		while (true)
+		{
+			claimed = free_run(pos, count, 1);
+			if (claimed == 0)
+			{
+				size_t current = m_dequeue.load(std::memory_order_relaxed);
+				if (current == pos)
+					return 0;
+				pos = current;
+				continue;
+			}
+			if (single_consumer)
+			{
+				m_dequeue.store(pos + claimed, std::memory_order_relaxed);
+				break;
+			}
+			if (m_dequeue.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+				break;
+		}
+		for (size_t n = 0; n < claimed; ++n)
+		{
+			cell& c = m_cells[(pos + n) & m_mask];
+			values[n] = c.data;
+			c.sequence.store(pos + n + m_mask + 1, std::memory_order_release);
+		}
+		return claimed;
+	}
+	//Snapshot, may be stale by the time it returns
+	bool empty() const
+	{
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) != pos + 1;
+	}
+	bool full() const
+	{
+		size_t pos = m_enqueue.load(std::memory_order_relaxed);
+		return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) != pos;
+	}
+private:
+	struct cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+	//Number of consecutive cells from pos whose sequence says they're ready (pos + offset)
+	size_t free_run(size_t pos, size_t count, size_t offset) const
+	{
+		size_t run = 0;
+		while (run < count && run <= m_mask)
+		{
+			if (m_cells[(pos + run) & m_mask].sequence.load(std::memory_order_acquire) != pos + run + offset)
+				break;
+			++run;
+		}
+		return run;
+	}
+
+	cell* m_cells;
+	size_t m_mask;
+	alignas(64) std::atomic<size_t> m_enqueue;
+	alignas(64) std::atomic<size_t> m_dequeue;
+};
+
+#ifndef CHAIOS_HOST_BUILD
+#include <arch/cpu.h>
+
+/*
+Sleeping wrapper. Only touches the scheduler when the ring is empty (consumers) or full (producers).
+Sides announce they're about to sleep, then retry once, so the other side only signals when someone may be waiting.
+*/
+template <class T, bool single_producer = false, bool single_consumer = false> class blocking_ring {
+public:
+	blocking_ring()
+		:m_notempty(nullptr), m_notfull(nullptr)
+	{
+		m_consumers_waiting.store(0, std::memory_order_relaxed);
+		m_producers_waiting.store(0, std::memory_order_relaxed);
+	}
+	explicit blocking_ring(size_t capacity)
+		:blocking_ring()
+	{
+		init(capacity);
+	}
+	~blocking_ring()
+	{
+		if (m_notempty)
+			delete_semaphore(m_notempty);
+		if (m_notfull)
+			delete_semaphore(m_notfull);
+	}
+	bool init(size_t capacity)
+	{
+		m_notempty = create_semaphore(0, u"ring not empty");
+		m_notfull = create_semaphore(0, u"ring not full");
+		return m_notempty && m_notfull && m_ring.init(capacity);
+	}
+
+	bool enqueue(const T& value, size_t timeout = TIMEOUT_INFINITY)
+	{
+		return enqueue_batch(&value, 1, timeout) == 1;
+	}
+	bool dequeue(T& value, size_t timeout = TIMEOUT_INFINITY)
+	{
+		return dequeue_batch(&value, 1, timeout) == 1;
+	}
+	//Blocks until at least one item is enqueued
+	size_t enqueue_batch(const T* values, size_t count, size_t timeout = TIMEOUT_INFINITY)
+	{
+		size_t done = wait_for(timeout, m_producers_waiting, m_notfull, [&]() { return m_ring.enqueue_batch(values, count); });
+		if (done)
+			wake(m_consumers_waiting, m_notempty, done);
+		return done;
+	}
+	//Blocks until at least one item is dequeued
+	size_t dequeue_batch(T* values, size_t count, size_t timeout = TIMEOUT_INFINITY)
+	{
+		size_t done = wait_for(timeout, m_consumers_waiting, m_notempty, [&]() { return m_ring.dequeue_batch(values, count); });
+		if (done)
+			wake(m_producers_waiting, m_notfull, done);
+		return done;
+	}
+	mpmc_ring<T, single_producer, single_consumer>& ring() { return m_ring; }
+private:
+	template <class F> size_t wait_for(size_t timeout, std::atomic<size_t>& waiting, semaphore_t sem, F attempt)
+	{
+		size_t done = attempt();
+		if (done || timeout == 0)
+			return done;
+		uint64_t start = arch_get_system_timer();
+		while (true)
+		{
+			//Locked add orders the announcement before the retry, pairs with the fence in wake
+			waiting.fetch_add(1);
+			done = attempt();
+			if (done)
+			{
+				waiting.fetch_sub(1);
+				return done;
+			}
+			size_t remaining = TIMEOUT_INFINITY;
+			if (timeout != TIMEOUT_INFINITY)
+			{
+				uint64_t elapsed = arch_get_system_timer() - start;
+				remaining = elapsed >= timeout ? 0 : timeout - elapsed;
+			}
+			uint8_t signalled = remaining != 0 && wait_semaphore(sem, 1, remaining);
+			waiting.fetch_sub(1);
+			done = attempt();
+			if (done || !signalled)
+				return done;
+		}
+	}
+	//One wakeup per item moved, up to the number of sleepers
+	void wake(std::atomic<size_t>& waiting, semaphore_t sem, size_t items)
+	{
+		//Order our ring update before the waiter check
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		size_t sleepers = waiting.load(std::memory_order_relaxed);
+		if (sleepers != 0)
+			signal_semaphore(sem, sleepers < items ? sleepers : items);
+	}
+
+	mpmc_ring<T, single_producer, single_consumer> m_ring;
+	semaphore_t m_notempty;
+	semaphore_t m_notfull;
+	std::atomic<size_t> m_consumers_waiting;
+	std::atomic<size_t> m_producers_waiting;
+};
+#endif
+#endif
+
+#endif
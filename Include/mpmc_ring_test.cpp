@@ -0,0 +1,138 @@
+/*
+Host stress test for mpmc_ring. Not part of the kernel build.
+	g++ -std=c++17 -O2 -pthread -DCHAIOS_HOST_BUILD -I. mpmc_ring_test.cpp -o mpmc_ring_test && ./mpmc_ring_test
+Producers tag each item with their ID and a sequence number. Every item must come out exactly once,
+and each consumer must see any one producer's items in increasing order.
+*/
+#include "mpmc_ring.h"
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+static const uint64_t ITEMS_PER_PRODUCER = 1000000;
+static const size_t BATCH = 8;
+
+static uint64_t make_item(size_t producer, uint64_t seq)
+{
+	return ((uint64_t)producer << 40) | seq;
+}
+
+template <bool single_producer, bool single_consumer> static bool stress(size_t producers, size_t consumers, size_t capacity)
+{
+	mpmc_ring<uint64_t, single_producer, single_consumer> ring;
+	if (!ring.init(capacity))
+		return false;
+	std::atomic<uint64_t> consumed;
+	consumed.store(0);
+	const uint64_t total = ITEMS_PER_PRODUCER * producers;
+	//seen[producer][seq], written by whichever consumer got the item
+	std::vector<std::vector<uint8_t>> seen(producers, std::vector<uint8_t>(ITEMS_PER_PRODUCER, 0));
+	std::atomic<bool> failed;
+	failed.store(false);
+
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		threads.emplace_back([&, p]() {
+			uint64_t seq = 0;
+			uint64_t batch[BATCH];
+			while (seq < ITEMS_PER_PRODUCER)
+			{
+				//Alternate single and batched enqueues
+				size_t want = (seq & 1) ? 1 : BATCH;
+				if (want > ITEMS_PER_PRODUCER - seq)
+					want = ITEMS_PER_PRODUCER - seq;
+				for (size_t n = 0; n < want; ++n)
+					batch[n] = make_item(p, seq + n);
+				size_t done = ring.enqueue_batch(batch, want);
+				if (done == 0)
+					std::this_thread::yield();
+				seq += done;
+			}
+		});
+	}
+	for (size_t c = 0; c < consumers; ++c)
+	{
+		threads.emplace_back([&]() {
+			std::vector<uint64_t> last(producers, UINT64_MAX);
+			uint64_t batch[BATCH];
+			while (consumed.load(std::memory_order_relaxed) < total)
+			{
+				size_t done = ring.dequeue_batch(batch, BATCH);
+				if (done == 0)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+				for (size_t n = 0; n < done; ++n)
+				{
+					size_t producer = (size_t)(batch[n] >> 40);
+					uint64_t seq = batch[n] & ((1ull << 40) - 1);
+					if (producer >= producers || seq >= ITEMS_PER_PRODUCER || seen[producer][seq]++ != 0)
+					{
+						fprintf(stderr, "  bad or duplicate item %llx\n", (unsigned long long)batch[n]);
+						failed.store(true);
+						continue;
+					}
+					if (last[producer] != UINT64_MAX && seq <= last[producer])
+					{
+						fprintf(stderr, "  producer %zu out of order: %llu after %llu\n", producer, (unsigned long long)seq, (unsigned long long)last[producer]);
+						failed.store(true);
+					}
+					last[producer] = seq;
+				}
+				consumed.fetch_add(done);
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	if (!ring.empty())
+	{
+		fprintf(stderr, "  ring not empty at the end\n");
+		failed.store(true);
+	}
+	for (size_t p = 0; p < producers; ++p)
+	{
+		for (uint64_t seq = 0; seq < ITEMS_PER_PRODUCER; ++seq)
+		{
+			if (seen[p][seq] != 1)
+			{
+				fprintf(stderr, "  producer %zu item %llu seen %u times\n", p, (unsigned long long)seq, seen[p][seq]);
+				failed.store(true);
+				break;
+			}
+		}
+	}
+	return !failed.load();
+}
+
+struct test_case {
+	const char* name;
+	bool(*run)(size_t producers, size_t consumers, size_t capacity);
+	size_t producers;
+	size_t consumers;
+	size_t capacity;
+};
+
+int main()
+{
+	const test_case cases[] = {
+		{ "MPMC 4x4, capacity 64", &stress<false, false>, 4, 4, 64 },
+		{ "MPMC 8x2, capacity 8", &stress<false, false>, 8, 2, 8 },
+		{ "MPMC 2x8, capacity 2", &stress<false, false>, 2, 8, 2 },
+		{ "MPSC 4x1, capacity 64", &stress<false, true>, 4, 1, 64 },
+		{ "SPMC 1x4, capacity 64", &stress<true, false>, 1, 4, 64 },
+		{ "SPSC 1x1, capacity 16", &stress<true, true>, 1, 1, 16 },
+	};
+	int failures = 0;
+	for (const test_case& test : cases)
+	{
+		bool ok = test.run(test.producers, test.consumers, test.capacity);
+		printf("%s: %s\n", test.name, ok ? "ok" : "FAILED");
+		if (!ok)
+			++failures;
+	}
+	return failures == 0 ? 0 : 1;
+}
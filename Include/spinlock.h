@@ -7,16 +7,32 @@
 
 typedef void* spinlock_t;
 
+//Names a class of locks for lockdep, after Linux's lock_class_key. Define one static key per kind of lock and create every lock of that kind with it
+typedef struct _lock_class_key {
+	const char* name;
+}lock_class_key;
+
+typedef struct _spinlock_stats {
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t spins;
+	uint64_t max_hold_ticks;		//CPU ticks
+}spinlock_stats;
+
 #ifdef __cplusplus
 EXTERN {
 #endif
 
 
+//Lockdep puts locks created at the same call site in one class
 CHAIKRNL_FUNC spinlock_t create_spinlock();
+CHAIKRNL_FUNC spinlock_t create_spinlock_class(lock_class_key* key);
 CHAIKRNL_FUNC spinlock_t get_static_spinlock();
 CHAIKRNL_FUNC void delete_spinlock(spinlock_t lock);
 CHAIKRNL_FUNC cpu_status_t acquire_spinlock(spinlock_t lock);
 CHAIKRNL_FUNC void release_spinlock(spinlock_t lock, cpu_status_t status);
+//Returns 0 if the kernel was built without SPINLOCK_STATISTICS
+CHAIKRNL_FUNC uint8_t spinlock_get_statistics(spinlock_t lock, spinlock_stats* stats);
 
 #ifdef __cplusplus
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <endian.h>
 #include <kdraw.h>
+#include <mpmc_ring.h>
 
 #include <lwip/netifapi.h>
 #include <lwip/etharp.h>
@@ -366,10 +367,9 @@ struct PacketInfoBuf {
 	uint8_t status;
 };
 
-static semaphore_t printf_sem;
 static const int BUFFER_PACKETINF_SIZE = 128;
-static volatile int BufferPacketInfPtr = 0;
-static PacketInfoBuf BufferPacketInf[BUFFER_PACKETINF_SIZE];
+//Interrupt handler produces, the print thread consumes
+static blocking_ring<PacketInfoBuf, true, true>* BufferPacketInf;
 
 static uint8_t ethernet_interrupt(size_t vector, void* param)
 {
@@ -406,13 +406,11 @@ static uint8_t ethernet_interrupt(size_t vector, void* param)
 			else if(tp == 0x8100)
 				type = raw_offset<uint16_be*>(type, 4);
 			tp = BE_TO_CPU16((*type));
-			auto ptr = BufferPacketInfPtr++;
-			if (BufferPacketInfPtr == BUFFER_PACKETINF_SIZE)
-				BufferPacketInfPtr = 0;
-			BufferPacketInf[BufferPacketInfPtr].type = tp;
-			BufferPacketInf[BufferPacketInfPtr].length = len;
-			BufferPacketInf[BufferPacketInfPtr].status = dinfo->maprxdescs[dinfo->rxCur].status;
-			signal_semaphore(printf_sem, 1);
+			PacketInfoBuf inf;
+			inf.type = tp;
+			inf.length = len;
+			inf.status = dinfo->maprxdescs[dinfo->rxCur].status;
+			BufferPacketInf->enqueue(inf, 0);		//Drop the report if the printer is behind
 
 			// Here you should inject the received packet into your network stack
 			pbuf* p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
@@ -502,20 +500,14 @@ err_t i219_tx(struct netif *netif, struct pbuf *p)
 
 void i219_kprintf_thread(void* param)
 {
-	static int dequeuePtr = 0;
 	void* WndHandle = CreateStdioWindow(700, 700, 1000);
 	kprintf(u"Window Handle: %x\n", WndHandle);
 	while (true)
 	{
-		wait_semaphore(printf_sem, 1, TIMEOUT_INFINITY);
-		while (dequeuePtr != BufferPacketInfPtr)
-		{
-			dequeuePtr++;
-			if (dequeuePtr == BUFFER_PACKETINF_SIZE)
-				dequeuePtr = 0;
-			auto& inf = BufferPacketInf[dequeuePtr];
-			kprintf(u" Received a packet: type %x, length %d, status %d\n", inf.type, inf.length, inf.status);
-		}
+		PacketInfoBuf infs[16];
+		size_t count = BufferPacketInf->dequeue_batch(infs, 16);
+		for (size_t n = 0; n < count; ++n)
+			kprintf(u" Received a packet: type %x, length %d, status %d\n", infs[n].type, infs[n].length, infs[n].status);
 	}
 
 }
@@ -655,10 +647,17 @@ err_t i219_init(struct netif *netif)
 	dinfo->RX_DESC_COUNT = RX_DESC_COUNT;
 	dinfo->rxCur = 0;
 
+	BufferPacketInf = new blocking_ring<PacketInfoBuf, true, true>;
+	if (!BufferPacketInf || !BufferPacketInf->init(BUFFER_PACKETINF_SIZE))
+	{
+		kprintf(u"Error: could not create Intel Gigabit Controller packet queue\n");
+		delete BufferPacketInf;
+		BufferPacketInf = nullptr;
+		return ERR_MEM;
+	}
 	PciAllocateMsi(dinfo->address.segment, dinfo->address.bus, dinfo->address.device, dinfo->address.function, 1, &ethernet_interrupt, dinfo);
 
 	//Allocate PBUFs for receiving
-	printf_sem = create_semaphore(0, u"I219InterruptSem");
 	create_thread(&i219_kprintf_thread, NULL);
 
 	// Enable transmitter
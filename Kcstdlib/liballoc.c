@@ -1,5 +1,6 @@
 #include <liballoc.h>
 #include <spinlock.h>
+#include "slab.h"
 
 /**  Durand's Amazing Super Duper Memory functions.  */
 
@@ -256,6 +257,9 @@ static struct liballoc_major *allocate_new_page( unsigned int size )
 
 void *PREFIX(malloc)(size_t req_size)
 {
+	void* obj;
+	if (req_size <= SLAB_MAX_SIZE && (obj = slab_alloc(req_size)) != NULL)
+		return obj;
 	//DEBUG
 	return liballoc_alloc(DIV_ROUND_UP(req_size, l_pageSize));
 	int startedBet = 0;
@@ -611,6 +615,11 @@ void *PREFIX(malloc)(size_t req_size)
 
 void PREFIX(free)(void *ptr)
 {
+	if (ptr != NULL && SLAB_OBJECT(ptr))
+	{
+		slab_free(ptr);
+		return;
+	}
 	//DEBUG
 	return liballoc_free(ptr, l_pageSize);
 	struct liballoc_minor *min;
@@ -772,6 +781,20 @@ void*   PREFIX(realloc)(void *p, size_t size)
 	// In the case of a NULL pointer, return a simple malloc.
 	if ( p == NULL ) return PREFIX(malloc)( size );
 
+	// Slab objects know their size, and may already have room.
+	if ( SLAB_OBJECT(p) )
+	{
+		real_size = slab_object_size(p);
+		if ( real_size >= size ) return p;
+		ptr = PREFIX(malloc)( size );
+		if ( ptr != NULL )
+		{
+			liballoc_memcpy( ptr, p, real_size );
+			PREFIX(free)( p );
+		}
+		return ptr;
+	}
+
 	//TODO: fix DEBUG
 	ptr = PREFIX(malloc)(size);
 	liballoc_memcpy(ptr, p, size);
@@ -854,6 +877,7 @@ void*   PREFIX(realloc)(void *p, size_t size)
 }
 
 static spinlock_t the_liballoc_lock = NULL;
+static lock_class_key liballoc_lock_key = { "liballoc" };
 static cpu_status_t cpuflags = 0;
 
 int liballoc_lock()
@@ -880,10 +904,14 @@ int liballoc_free(void* ptr, size_t size)
 
 void setLiballocAllocator(void*(*a)(size_t), int(*f)(void*, size_t))
 {
+	allocate = a;
+	deallocate = f;
 	if (the_liballoc_lock == NULL)
 		the_liballoc_lock = get_static_spinlock();
 	else if (the_liballoc_lock == get_static_spinlock())
-		the_liballoc_lock = create_spinlock();
-	allocate = a;
-	deallocate = f;
+	{
+		//Pages are available now, so the slabs can come up
+		the_liballoc_lock = create_spinlock_class(&liballoc_lock_key);
+		slab_init();
+	}
 }
@@ -341,6 +341,7 @@ char16_t*  sztoa(size_t value, char16_t * str, int base)
 
 #include <spinlock.h>
 spinlock_t screenlock = nullptr;
+static lock_class_key screenlock_key = { "screen" };
 bool need_lock = false;
 
 EXTERN KCSTDLIB_FUNC void enable_screen_locking()
@@ -354,7 +355,7 @@ EXTERN KCSTDLIB_FUNC void kprintf(const char16_t* format, ...)
 	if (need_lock)
 	{
 		if (!screenlock)
-			screenlock = create_spinlock();
+			screenlock = create_spinlock_class(&screenlock_key);
 		st = acquire_spinlock(screenlock);
 	}
 	va_list args;
@@ -0,0 +1,465 @@
+#include "slab.h"
+#include <liballoc.h>
+#include <spinlock.h>
+#include <arch/cpu.h>
+
+extern void* memset(void* str, int c, size_t n);
+
+#define SLAB_MAGIC 0x51AB51AB
+//Objects per magazine
+#define MAGAZINE_ROUNDS 32
+//Processors with their own magazines. Any others go straight to the depot
+#define SLAB_CPUS 256
+//Successive slabs offset their objects by this much more, up to the slack at the end of the page
+#define SLAB_COLOUR_STEP 64
+
+typedef struct _slab_header {
+	uint32_t magic;
+	struct _kmem_cache* cache;
+	//Next slab with free objects
+	struct _slab_header* next;
+	//Next of every slab in the cache
+	struct _slab_header* next_all;
+	void* free_list;
+	uint8_t* first;
+	size_t inuse;
+}slab_header;
+
+//Objects start after the header, so they're never page aligned
+#define SLAB_HEADER_SIZE 64
+
+typedef struct _magazine {
+	struct _magazine* next;
+	size_t rounds;
+	void* objects[MAGAZINE_ROUNDS];
+}magazine;
+
+typedef struct __declspec(align(64)) _cpu_cache {
+	magazine* loaded;
+	magazine* previous;
+	uint64_t allocations;
+	uint64_t frees;
+}cpu_cache;
+
+typedef struct _kmem_cache {
+	const char* name;
+	size_t size;
+	//Distance between objects
+	size_t stride;
+	//Where a free object keeps its free list link. Past the object when it has constructed state to keep
+	size_t link_offset;
+	size_t per_slab;
+	size_t colour_max;
+	size_t colour_next;
+	kmem_ctor_func ctor;
+	kmem_dtor_func dtor;
+	void* context;
+	//Protects the depot, the slabs and the counters below
+	spinlock_t lock;
+	magazine* full;
+	magazine* empty;
+	//Slabs with free objects. Only the head is ever allocated from, so only the head fills up
+	slab_header* partial;
+	slab_header* slabs;
+	size_t slab_count;
+	uint64_t depot_exchanges;
+	uint64_t slab_allocations;
+	//Not DEFINE_PER_CPU: caches are made at run time, and per-CPU sections are only for the kernel image's own statics
+	cpu_cache cpus[SLAB_CPUS];
+}kmem_cache;
+
+//Every cache's depot lock is one class, they're never nested
+static lock_class_key cache_lock_key = { "kmem_cache" };
+
+#define FREE_LINK(cache, obj) \
+	(*(void**)((uint8_t*)(obj) + (cache)->link_offset))
+
+static const size_t class_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+static const char* class_names[] = { "kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64", "kmalloc-96", "kmalloc-128",
+	"kmalloc-192", "kmalloc-256", "kmalloc-384", "kmalloc-512", "kmalloc-768", "kmalloc-1024" };
+#define SLAB_CLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+static kmem_cache classes[SLAB_CLASSES];
+static int slab_ready = 0;
+
+//Magazines are carved from their own pages, so getting one never recurses into the slabs
+static spinlock_t magazine_lock = NULL;
+static lock_class_key magazine_lock_key = { "slab_magazines" };
+static magazine* magazine_pool = NULL;
+
+static int init_cache(kmem_cache* cache, const char* name, size_t size, size_t align, kmem_ctor_func ctor, kmem_dtor_func dtor, void* context)
+{
+	size_t slack, span;
+	memset(cache, 0, sizeof(kmem_cache));
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+	if ((align & (align - 1)) != 0 || align > SLAB_HEADER_SIZE)
+		return 0;
+	if (size == 0)
+		size = 1;
+	cache->name = name;
+	cache->size = size;
+	cache->link_offset = ctor ? ALIGN_UP(size, sizeof(void*)) : 0;
+	span = ctor ? cache->link_offset + sizeof(void*) : size;
+	cache->stride = ALIGN_UP(span, align);
+	if (cache->stride > SLAB_PAGE_SIZE - SLAB_HEADER_SIZE)
+		return 0;
+	cache->per_slab = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / cache->stride;
+	slack = SLAB_PAGE_SIZE - SLAB_HEADER_SIZE - cache->per_slab * cache->stride;
+	cache->colour_max = slack - slack % SLAB_COLOUR_STEP;
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+	cache->context = context;
+	cache->lock = create_spinlock_class(&cache_lock_key);
+	return cache->lock != NULL;
+}
+
+void slab_init()
+{
+	size_t n;
+	if (slab_ready)
+		return;
+	magazine_lock = create_spinlock_class(&magazine_lock_key);
+	for (n = 0; n < SLAB_CLASSES; ++n)
+		init_cache(&classes[n], class_names[n], class_sizes[n], 16, NULL, NULL, NULL);
+	slab_ready = 1;
+}
+
+static kmem_cache* find_class(size_t size)
+{
+	size_t n;
+	for (n = 0; n < SLAB_CLASSES; ++n)
+	{
+		if (size <= class_sizes[n])
+			return &classes[n];
+	}
+	return NULL;
+}
+
+static magazine* new_magazine()
+{
+	magazine* mag;
+	cpu_status_t st = acquire_spinlock(magazine_lock);
+	if (!magazine_pool)
+	{
+		size_t n;
+		magazine* page = (magazine*)liballoc_alloc(1);
+		if (!page)
+		{
+			release_spinlock(magazine_lock, st);
+			return NULL;
+		}
+		for (n = 0; n < SLAB_PAGE_SIZE / sizeof(magazine); ++n)
+		{
+			page[n].next = magazine_pool;
+			magazine_pool = &page[n];
+		}
+	}
+	mag = magazine_pool;
+	magazine_pool = mag->next;
+	release_spinlock(magazine_lock, st);
+	mag->next = NULL;
+	mag->rounds = 0;
+	return mag;
+}
+
+static void free_magazine(magazine* mag)
+{
+	cpu_status_t st = acquire_spinlock(magazine_lock);
+	mag->next = magazine_pool;
+	magazine_pool = mag;
+	release_spinlock(magazine_lock, st);
+}
+
+//Slab layer. Built outside the cache lock, so constructors can allocate
+static slab_header* new_slab(kmem_cache* cache, size_t colour)
+{
+	size_t n;
+	slab_header* slab = (slab_header*)liballoc_alloc(1);
+	if (!slab)
+		return NULL;
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free_list = NULL;
+	slab->first = (uint8_t*)slab + SLAB_HEADER_SIZE + colour;
+	for (n = cache->per_slab; n > 0; --n)
+	{
+		void* obj = slab->first + (n - 1) * cache->stride;
+		if (cache->ctor)
+			cache->ctor(obj, cache->context);
+		FREE_LINK(cache, obj) = slab->free_list;
+		slab->free_list = obj;
+	}
+	return slab;
+}
+
+static void* slab_take(kmem_cache* cache)
+{
+	void* obj;
+	slab_header* slab;
+	cpu_status_t st = acquire_spinlock(cache->lock);
+	while (!(slab = cache->partial))
+	{
+		size_t colour = cache->colour_next;
+		cache->colour_next = (colour + SLAB_COLOUR_STEP > cache->colour_max) ? 0 : colour + SLAB_COLOUR_STEP;
+		release_spinlock(cache->lock, st);
+		if (!(slab = new_slab(cache, colour)))
+			return NULL;
+		st = acquire_spinlock(cache->lock);
+		slab->next = cache->partial;
+		cache->partial = slab;
+		slab->next_all = cache->slabs;
+		cache->slabs = slab;
+		++cache->slab_count;
+	}
+	obj = slab->free_list;
+	slab->free_list = FREE_LINK(cache, obj);
+	++slab->inuse;
+	if (!slab->free_list)
+		cache->partial = slab->next;
+	++cache->slab_allocations;
+	release_spinlock(cache->lock, st);
+	return obj;
+}
+
+//Called with the cache lock held
+static void slab_give(kmem_cache* cache, void* obj)
+{
+	slab_header* slab = (slab_header*)((uintptr_t)obj & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+	if (!slab->free_list)
+	{
+		slab->next = cache->partial;
+		cache->partial = slab;
+	}
+	FREE_LINK(cache, obj) = slab->free_list;
+	slab->free_list = obj;
+	--slab->inuse;
+}
+
+static cpu_cache* current_cache(kmem_cache* cache)
+{
+	uint32_t cpu = arch_current_processor_id();
+	return cpu < SLAB_CPUS ? &cache->cpus[cpu] : NULL;
+}
+
+static void* cache_alloc(kmem_cache* cache)
+{
+	cpu_cache* cc;
+	cpu_status_t st, lst;
+	void* obj;
+	st = arch_disable_interrupts();
+	cc = current_cache(cache);
+	while (cc)
+	{
+		if (cc->loaded && cc->loaded->rounds > 0)
+		{
+			obj = cc->loaded->objects[--cc->loaded->rounds];
+			++cc->allocations;
+			arch_restore_state(st);
+			return obj;
+		}
+		if (cc->previous && cc->previous->rounds > 0)
+		{
+			magazine* tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+			continue;
+		}
+		//Both empty, trade one for a full magazine from the depot
+		lst = acquire_spinlock(cache->lock);
+		if (!cache->full)
+		{
+			release_spinlock(cache->lock, lst);
+			break;
+		}
+		if (cc->previous)
+		{
+			cc->previous->next = cache->empty;
+			cache->empty = cc->previous;
+		}
+		cc->previous = cc->loaded;
+		cc->loaded = cache->full;
+		cache->full = cache->full->next;
+		++cache->depot_exchanges;
+		release_spinlock(cache->lock, lst);
+	}
+	if (cc)
+		++cc->allocations;
+	arch_restore_state(st);
+	return slab_take(cache);
+}
+
+static void cache_free(kmem_cache* cache, void* obj)
+{
+	cpu_cache* cc;
+	cpu_status_t st, lst;
+	st = arch_disable_interrupts();
+	cc = current_cache(cache);
+	while (cc)
+	{
+		if (cc->loaded && cc->loaded->rounds < MAGAZINE_ROUNDS)
+		{
+			cc->loaded->objects[cc->loaded->rounds++] = obj;
+			++cc->frees;
+			arch_restore_state(st);
+			return;
+		}
+		if (cc->previous && cc->previous->rounds == 0)
+		{
+			magazine* tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+			continue;
+		}
+		//Both full, trade one for an empty magazine from the depot
+		lst = acquire_spinlock(cache->lock);
+		if (!cache->empty)
+		{
+			magazine* mag;
+			release_spinlock(cache->lock, lst);
+			if (!(mag = new_magazine()))
+				break;
+			lst = acquire_spinlock(cache->lock);
+			mag->next = cache->empty;
+			cache->empty = mag;
+		}
+		if (cc->previous)
+		{
+			cc->previous->next = cache->full;
+			cache->full = cc->previous;
+		}
+		cc->previous = cc->loaded;
+		cc->loaded = cache->empty;
+		cache->empty = cache->empty->next;
+		++cache->depot_exchanges;
+		release_spinlock(cache->lock, lst);
+	}
+	if (cc)
+		++cc->frees;
+	lst = acquire_spinlock(cache->lock);
+	slab_give(cache, obj);
+	release_spinlock(cache->lock, lst);
+	arch_restore_state(st);
+}
+
+void* slab_alloc(size_t size)
+{
+	kmem_cache* cls;
+	if (!slab_ready || !(cls = find_class(size)))
+		return NULL;
+	return cache_alloc(cls);
+}
+
+static slab_header* get_slab(void* ptr)
+{
+	return (slab_header*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+void slab_free(void* ptr)
+{
+	cache_free(get_slab(ptr)->cache, ptr);
+}
+
+size_t slab_object_size(void* ptr)
+{
+	return get_slab(ptr)->cache->size;
+}
+
+KCSTDLIB_FUNC kmem_cache_t kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_func ctor, kmem_dtor_func dtor, void* context)
+{
+	size_t pages = DIV_ROUND_UP(sizeof(kmem_cache), SLAB_PAGE_SIZE);
+	kmem_cache* cache = (kmem_cache*)liballoc_alloc(pages);
+	if (!cache)
+		return NULL;
+	if (!init_cache(cache, name, size, align, ctor, dtor, context))
+	{
+		if (cache->lock)
+			delete_spinlock(cache->lock);
+		liballoc_free(cache, pages);
+		return NULL;
+	}
+	return (kmem_cache_t)cache;
+}
+
+static void drain_magazine(kmem_cache* cache, magazine* mag)
+{
+	while (mag->rounds > 0)
+		slab_give(cache, mag->objects[--mag->rounds]);
+	free_magazine(mag);
+}
+
+KCSTDLIB_FUNC void kmem_cache_destroy(kmem_cache_t kcache)
+{
+	kmem_cache* cache = (kmem_cache*)kcache;
+	slab_header* slab;
+	size_t n;
+	cpu_status_t st = acquire_spinlock(cache->lock);
+	for (n = 0; n < SLAB_CPUS; ++n)
+	{
+		if (cache->cpus[n].loaded)
+			drain_magazine(cache, cache->cpus[n].loaded);
+		if (cache->cpus[n].previous)
+			drain_magazine(cache, cache->cpus[n].previous);
+	}
+	while (cache->full)
+	{
+		magazine* mag = cache->full;
+		cache->full = mag->next;
+		drain_magazine(cache, mag);
+	}
+	while (cache->empty)
+	{
+		magazine* mag = cache->empty;
+		cache->empty = mag->next;
+		free_magazine(mag);
+	}
+	release_spinlock(cache->lock, st);
+	slab = cache->slabs;
+	while (slab)
+	{
+		slab_header* next = slab->next_all;
+		if (cache->dtor)
+		{
+			for (n = 0; n < cache->per_slab; ++n)
+				cache->dtor(slab->first + n * cache->stride, cache->context);
+		}
+		liballoc_free(slab, 1);
+		slab = next;
+	}
+	delete_spinlock(cache->lock);
+	liballoc_free(cache, DIV_ROUND_UP(sizeof(kmem_cache), SLAB_PAGE_SIZE));
+}
+
+KCSTDLIB_FUNC void* kmem_cache_alloc(kmem_cache_t cache)
+{
+	return cache_alloc((kmem_cache*)cache);
+}
+
+KCSTDLIB_FUNC void kmem_cache_free(kmem_cache_t cache, void* obj)
+{
+	if (obj)
+		cache_free((kmem_cache*)cache, obj);
+}
+
+KCSTDLIB_FUNC void kmem_cache_get_stats(kmem_cache_t kcache, kmem_cache_stats* stats)
+{
+	kmem_cache* cache = (kmem_cache*)kcache;
+	size_t n;
+	cpu_status_t st;
+	stats->object_size = cache->size;
+	stats->objects_per_slab = cache->per_slab;
+	stats->allocations = 0;
+	stats->frees = 0;
+	//Per-CPU counts are read without their CPUs stopping, so they're a snapshot
+	for (n = 0; n < SLAB_CPUS; ++n)
+	{
+		stats->allocations += cache->cpus[n].allocations;
+		stats->frees += cache->cpus[n].frees;
+	}
+	st = acquire_spinlock(cache->lock);
+	stats->slabs = cache->slab_count;
+	stats->depot_exchanges = cache->depot_exchanges;
+	stats->slab_allocations = cache->slab_allocations;
+	release_spinlock(cache->lock, st);
+}
@@ -0,0 +1,27 @@
+#ifndef CHAIOS_KCSTDLIB_SLAB_H
+#define CHAIOS_KCSTDLIB_SLAB_H
+
+#include <stdheaders.h>
+#include <kmem_cache.h>
+
+/*
+Small object allocator behind kmalloc, after Bonwick's slab allocator with magazines. kmalloc's size classes are kmem_caches without constructors.
+Each cache keeps a pair of magazines per CPU, used with interrupts off and no lock. Full and empty magazines are exchanged with the cache's depot,
+and the depot falls back to slabs: single pages carved into objects of the cache's size, headed by a slab_header.
+The header means slab objects are never page aligned, while everything liballoc_alloc hands out is. kfree tells them apart that way.
+*/
+#define SLAB_MAX_SIZE 1024
+#define SLAB_PAGE_SIZE 4096
+
+//Sets up the classes. The page allocator must be working, allocations before this don't come from slabs
+void slab_init();
+//NULL if size is too big for a slab or the slabs aren't up yet
+void* slab_alloc(size_t size);
+void slab_free(void* ptr);
+//Object size of ptr's cache
+size_t slab_object_size(void* ptr);
+
+#define SLAB_OBJECT(ptr) \
+	(((uintptr_t)(ptr) & (SLAB_PAGE_SIZE - 1)) != 0)
+
+#endif
@@ -33,24 +33,20 @@
 #define LWIP_HDR_TEST_SYS_ARCH_H
 
 #include <semaphore.h>
-#include <spinlock.h>
+#include <mutex.h>
+#include <mpmc_ring.h>
 
 typedef semaphore_t sys_sem_t;
 
-typedef semaphore_t sys_mutex_t;
+typedef mutex_t sys_mutex_t;
 
 struct lwip_mbox {
-  sys_sem_t sem;
-  spinlock_t lock;
-  void** q_mem;
-  unsigned int head, tail;
-  int size;
-  int used;
+  msg_ring_t ring;
 };
 typedef struct lwip_mbox sys_mbox_t;
 #define SYS_MBOX_NULL NULL
-#define sys_mbox_valid(mbox) ((mbox != NULL) && ((mbox)->sem != NULL)  && ((mbox)->sem != (void*)-1))
-#define sys_mbox_valid_val(mbox) ((mbox).head != -1)
+#define sys_mbox_valid(mbox) ((mbox != NULL) && ((mbox)->ring != NULL))
+#define sys_mbox_valid_val(mbox) ((mbox).ring != NULL)
 
 /* DWORD (thread id) is used for sys_thread_t but we won't include windows.h */
 typedef void* sys_thread_t;
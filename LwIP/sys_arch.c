@@ -180,7 +180,9 @@ err_t
 sys_mutex_new(sys_mutex_t *mutex)
 {
   LWIP_ASSERT("mutex != NULL", mutex != NULL);
-  *mutex = sys_sem_new(mutex, 1);
+  *mutex = create_mutex();
+  if (*mutex == NULL)
+    return ERR_MEM;
   return ERR_OK;
 }
 
@@ -189,39 +191,37 @@ sys_mutex_free(sys_mutex_t *mutex)
 {
   /* parameter check */
   LWIP_ASSERT("mutex != NULL", mutex != NULL);
-  LWIP_ASSERT("*mutex >= 1", *mutex >= 1);
-  sys_sem_free(mutex);
+  LWIP_ASSERT("*mutex != NULL", *mutex != NULL);
+  delete_mutex(*mutex);
+  *mutex = NULL;
 }
 
 void
 sys_mutex_set_invalid(sys_mutex_t *mutex)
 {
   LWIP_ASSERT("mutex != NULL", mutex != NULL);
-  sys_sem_set_invalid(mutex);
+  *mutex = NULL;
 }
 
 int
 sys_mutex_valid(sys_mutex_t *mutex)
 {
 	LWIP_ASSERT("mutex != NULL", mutex != NULL);
-	return sys_sem_valid(mutex);
+	return (*mutex != NULL);
 }
 
 void
 sys_mutex_lock(sys_mutex_t *mutex)
 {
-  /* nothing to do, no multithreading supported */
   LWIP_ASSERT("mutex != NULL", mutex != NULL);
-  /* check that the mutext is valid and unlocked (no nested locking) */
-  sys_arch_sem_wait(mutex, 0);
+  acquire_mutex(*mutex, TIMEOUT_INFINITY);
 }
 
 void
 sys_mutex_unlock(sys_mutex_t *mutex)
 {
-  /* nothing to do, no multithreading supported */
   LWIP_ASSERT("mutex != NULL", mutex != NULL);
-  sys_sem_signal(mutex);
+  release_mutex(*mutex);
 }
 
 #include <scheduler.h>
@@ -246,14 +246,9 @@ sys_mbox_new(sys_mbox_t *mbox, int size)
   if (size == 0) {
     mboxsize = 1024;
   }
-  mbox->head = mbox->tail = 0;
-  sys_sem_new(&mbox->sem, 0);
-  mbox->lock = create_spinlock();
-  mbox->q_mem = (void**)kmalloc(sizeof(void*)*mboxsize);
-  mbox->size = mboxsize;
-  mbox->used = 0;
-
-  memset(mbox->q_mem, 0, sizeof(void*)*mboxsize);
+  mbox->ring = create_msg_ring(mboxsize);
+  if (mbox->ring == NULL)
+    return ERR_MEM;
   return ERR_OK;
 }
 
@@ -262,59 +257,36 @@ sys_mbox_free(sys_mbox_t *mbox)
 {
   /* parameter check */
   LWIP_ASSERT("mbox != NULL", mbox != NULL);
-  LWIP_ASSERT("mbox->sem != NULL", mbox->sem != NULL);
-  LWIP_ASSERT("mbox->sem == mbox", mbox->sem == mbox);
-  LWIP_ASSERT("mbox->q_mem != NULL", mbox->q_mem != NULL);
-  sys_sem_free(&mbox->sem);
-  delete_spinlock(mbox->lock);
-  kfree(mbox->q_mem);
-  mbox->q_mem = NULL;
+  LWIP_ASSERT("mbox->ring != NULL", mbox->ring != NULL);
+  delete_msg_ring(mbox->ring);
+  mbox->ring = NULL;
 }
 
 void
 sys_mbox_set_invalid(sys_mbox_t *mbox)
 {
   LWIP_ASSERT("mbox != NULL", mbox != NULL);
-  LWIP_ASSERT("mbox->q_mem == NULL", mbox->q_mem == NULL);
-  mbox->q_mem = NULL;
-  mbox->head = -1;
+  mbox->ring = NULL;
 }
 
 void
 sys_mbox_post(sys_mbox_t *q, void *msg)
 {
   LWIP_ASSERT("q != SYS_MBOX_NULL", q != SYS_MBOX_NULL);
-  LWIP_ASSERT("q->q_mem != NULL", q->q_mem != NULL);
-  LWIP_ASSERT("q->used >= 0", q->used >= 0);
-  LWIP_ASSERT("q->size > 0", q->size > 0);
-
-  LWIP_ASSERT("mbox already full", q->used < q->size);
-  cpu_status_t st = acquire_spinlock(q->lock);
-  q->q_mem[q->head] = msg;
-  q->head++;
-  if (q->head >= (unsigned int)q->size) {
-    q->head = 0;
-  }
-  LWIP_ASSERT("mbox is full!", q->head != q->tail);
-  q->used++;
-  release_spinlock(q->lock, st);
-  signal_semaphore(q->sem, 1);
+  LWIP_ASSERT("q->ring != NULL", q->ring != NULL);
+  /* blocks while full */
+  msg_ring_post(q->ring, msg, TIMEOUT_INFINITY);
 }
 
 err_t
 sys_mbox_trypost(sys_mbox_t *q, void *msg)
 {
   LWIP_ASSERT("q != SYS_MBOX_NULL", q != SYS_MBOX_NULL);
-  //LWIP_ASSERT("q->sem == q", q->sem == q);
-  LWIP_ASSERT("q->q_mem != NULL", q->q_mem != NULL);
-  LWIP_ASSERT("q->used >= 0", q->used >= 0);
-  LWIP_ASSERT("q->size > 0", q->size > 0);
-  LWIP_ASSERT("q->used <= q->size", q->used <= q->size);
+  LWIP_ASSERT("q->ring != NULL", q->ring != NULL);
 
-  if (q->used == q->size) {
+  if (!msg_ring_post(q->ring, msg, 0)) {
     return ERR_MEM;
   }
-  sys_mbox_post(q, msg);
   return ERR_OK;
 }
 
@@ -327,60 +299,24 @@ sys_mbox_trypost_fromisr(sys_mbox_t *q, void *msg)
 u32_t
 sys_arch_mbox_fetch(sys_mbox_t *q, void **msg, u32_t timeout)
 {
-  u32_t ret = 0;
-  u32_t ret2;
   LWIP_ASSERT("q != SYS_MBOX_NULL", q != SYS_MBOX_NULL);
-  LWIP_ASSERT("q->q_mem != NULL", q->q_mem != NULL);
-  LWIP_ASSERT("q->used >= 0", q->used >= 0);
-  LWIP_ASSERT("q->size > 0", q->size > 0);
+  LWIP_ASSERT("q->ring != NULL", q->ring != NULL);
 
-  if (sys_arch_sem_wait(&q->sem, timeout) == 0)
+  /* lwIP uses 0 for wait forever */
+  if (!msg_ring_fetch(q->ring, msg, timeout == 0 ? TIMEOUT_INFINITY : timeout))
 	  return SYS_ARCH_TIMEOUT;
-  cpu_status_t st = acquire_spinlock(q->lock);
-  if (q->used == 0) {
-	  release_spinlock(q->lock, st);
-	  return SYS_ARCH_TIMEOUT;
-  }
-  
-  if (msg) {
-	  *msg = q->q_mem[q->tail];
-  }
-
-  q->tail++;
-  if (q->tail >= (unsigned int)q->size) {
-	  q->tail = 0;
-  }
-  q->used--;
-
-  release_spinlock(q->lock, st);
-  
   return 0;
 }
 
 u32_t
 sys_arch_mbox_tryfetch(sys_mbox_t *q, void **msg)
 {
-	cpu_status_t st = acquire_spinlock(q->lock);
   LWIP_ASSERT("q != SYS_MBOX_NULL", q != SYS_MBOX_NULL);
-  LWIP_ASSERT("q->q_mem != NULL", q->q_mem != NULL);
-  LWIP_ASSERT("q->used >= 0", q->used >= 0);
-  LWIP_ASSERT("q->size > 0", q->size > 0);
+  LWIP_ASSERT("q->ring != NULL", q->ring != NULL);
 
-  if (!q->used) {
-	  release_spinlock(q->lock, st);
+  if (!msg_ring_fetch(q->ring, msg, 0)) {
     return SYS_ARCH_TIMEOUT;
   }
-  if(msg) {
-    *msg = q->q_mem[q->tail];
-  }
-
-  q->tail++;
-  if (q->tail >= (unsigned int)q->size) {
-    q->tail = 0;
-  }
-  q->used--;
-  LWIP_ASSERT("q->used >= 0", q->used >= 0);
-  release_spinlock(q->lock, st);
   return 0;
 }
 
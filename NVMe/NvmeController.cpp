@@ -254,7 +254,8 @@ void NVME::init()
 void* NVME::allocate_queue(size_t length, paddr_t & paddr)
 {
 	uint8_t memregion = ARCH_PHY_REGION_NORMAL;
-	paddr = pmmngr_allocate(DIV_ROUND_UP(length, PAGESIZE), memregion);
+	//Queues live on the controller's node
+	paddr = pci_allocate_dma(&m_busaddr, DIV_ROUND_UP(length, PAGESIZE), memregion);
 	if (paddr == NULL)
 		return nullptr;
 	void* alloc = find_free_paging(length);
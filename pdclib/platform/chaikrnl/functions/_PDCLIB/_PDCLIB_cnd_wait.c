@@ -0,0 +1,47 @@
+/* _PDCLIB_cnd_wait( cnd_t *, mtx_t *, size_t )
+
+   This file is part of the Public Domain C Library (PDCLib).
+   Permission is granted to use, modify, and / or redistribute at will.
+*/
+
+/* The sequence number is read before the mutex is released, so a signal
+   sent in between changes it and the wait returns immediately.
+*/
+
+#ifndef REGTEST
+
+#include "pdclib/_PDCLIB_threads.h"
+
+int _PDCLIB_cnd_wait( cnd_t * cond, mtx_t * mtx, _PDCLIB_size_t timeout )
+{
+    long seq = cond->_PDCLIB_cnd_seq;
+    unsigned char woken;
+
+    if ( mtx_unlock( mtx ) != thrd_success )
+    {
+        return thrd_error;
+    }
+
+    woken = wait_on_address( &cond->_PDCLIB_cnd_seq, &seq, sizeof( long ), timeout );
+
+    /* The mutex is reacquired even on timeout. */
+    _PDCLIB_mtx_acquire( mtx, _PDCLIB_TIMEOUT_INFINITY );
+
+    return woken ? thrd_success : thrd_timedout;
+}
+
+#endif
+
+#ifdef TEST
+
+#include "_PDCLIB_test.h"
+
+int main( void )
+{
+#ifndef REGTEST
+    TESTCASE( NO_TESTDRIVER );
+#endif
+    return TEST_RESULTS;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/* _PDCLIB_mtx_acquire( mtx_t *, size_t )
+
+   This file is part of the Public Domain C Library (PDCLib).
+   Permission is granted to use, modify, and / or redistribute at will.
+*/
+
+/* Uncontended locking is a single compare-and-swap. Once anybody has to
+   sleep, the state is set to 2 so the unlocking thread knows to wake them.
+*/
+
+#ifndef REGTEST
+
+#include "pdclib/_PDCLIB_threads.h"
+
+int _PDCLIB_mtx_acquire( mtx_t * mtx, _PDCLIB_size_t timeout )
+{
+    void * self = current_thread();
+    unsigned long long start;
+    long contended = 2;
+    long state;
+
+    if ( mtx->_PDCLIB_mtx_recursive && mtx->_PDCLIB_mtx_owner == self )
+    {
+        ++mtx->_PDCLIB_mtx_count;
+        return thrd_success;
+    }
+
+    state = _InterlockedCompareExchange( &mtx->_PDCLIB_mtx_state, 1, 0 );
+
+    if ( state != 0 )
+    {
+        start = arch_get_system_timer();
+
+        if ( state != 2 )
+        {
+            state = _InterlockedExchange( &mtx->_PDCLIB_mtx_state, 2 );
+        }
+
+        while ( state != 0 )
+        {
+            _PDCLIB_size_t remaining = timeout;
+
+            if ( timeout != _PDCLIB_TIMEOUT_INFINITY )
+            {
+                unsigned long long elapsed = arch_get_system_timer() - start;
+
+                if ( elapsed >= timeout )
+                {
+                    return thrd_timedout;
+                }
+
+                remaining = timeout - ( _PDCLIB_size_t )elapsed;
+            }
+
+            wait_on_address( &mtx->_PDCLIB_mtx_state, &contended, sizeof( long ), remaining );
+            state = _InterlockedExchange( &mtx->_PDCLIB_mtx_state, 2 );
+        }
+    }
+
+    mtx->_PDCLIB_mtx_owner = self;
+    mtx->_PDCLIB_mtx_count = 1;
+    return thrd_success;
+}
+
+#endif
+
+#ifdef TEST
+
+#include "_PDCLIB_test.h"
+
+int main( void )
+{
+    /* Tested by the mtx_lock test driver. */
+    return TEST_RESULTS;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/* _PDCLIB_timeout_ms( const struct timespec * )
+
+   This file is part of the Public Domain C Library (PDCLib).
+   Permission is granted to use, modify, and / or redistribute at will.
+*/
+
+#ifndef REGTEST
+
+#include "pdclib/_PDCLIB_threads.h"
+
+_PDCLIB_size_t _PDCLIB_timeout_ms( const struct timespec * ts )
+{
+    unsigned long long deadline = ( unsigned long long )ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+    unsigned long long now = arch_get_system_timer();
+
+    return deadline > now ? ( _PDCLIB_size_t )( deadline - now ) : 0;
+}
+
+#endif
+
+#ifdef TEST
+
+#include "_PDCLIB_test.h"
+
+int main( void )
+{
+#ifndef REGTEST
+    TESTCASE( NO_TESTDRIVER );
+#endif
+    return TEST_RESULTS;
+}
+
+#endif
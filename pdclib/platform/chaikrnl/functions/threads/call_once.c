@@ -6,22 +6,30 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casting the parameter. */
-extern int pthread_once( once_flag *, void ( * )( void ) );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 void call_once( once_flag * flag, void ( *func )( void ) )
 {
-    pthread_once( flag, func );
+    volatile long * state = ( volatile long * )flag;
+    long running = 1;
+
+    if ( *state == 2 )
+    {
+        return;
+    }
+
+    if ( _InterlockedCompareExchange( state, 1, 0 ) == 0 )
+    {
+        func();
+        _InterlockedExchange( state, 2 );
+        wake_address( state, _PDCLIB_WAKE_ALL );
+        return;
+    }
+
+    while ( *state != 2 )
+    {
+        wait_on_address( state, &running, sizeof( long ), _PDCLIB_TIMEOUT_INFINITY );
+    }
 }
 
 #endif
@@ -6,29 +6,13 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casting the parameter. */
-extern int pthread_cond_signal( cnd_t * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int cnd_signal( cnd_t * cond )
 {
-    if ( pthread_cond_signal( cond ) == 0 )
-    {
-        return thrd_success;
-    }
-    else
-    {
-        return thrd_error;
-    }
+    _InterlockedIncrement( &cond->_PDCLIB_cnd_seq );
+    wake_address( &cond->_PDCLIB_cnd_seq, 1 );
+    return thrd_success;
 }
 
 #endif
@@ -6,34 +6,11 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#include "/usr/include/errno.h"
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casing the parameters. */
-extern int pthread_cond_timedwait( cnd_t *, mtx_t *, const struct timespec * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int cnd_timedwait( cnd_t * _PDCLIB_restrict cond, mtx_t * _PDCLIB_restrict mtx, const struct timespec * _PDCLIB_restrict ts )
 {
-    switch ( pthread_cond_timedwait( cond, mtx, ts ) )
-    {
-        case 0:
-            return thrd_success;
-
-        case ETIMEDOUT:
-            return thrd_timedout;
-
-        default:
-            return thrd_error;
-    }
+    return _PDCLIB_cnd_wait( cond, mtx, _PDCLIB_timeout_ms( ts ) );
 }
 
 #endif
@@ -6,29 +6,11 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casting the parameters. */
-extern int pthread_cond_wait( cnd_t *, mtx_t * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int cnd_wait( cnd_t * cond, mtx_t * mtx )
 {
-    if ( pthread_cond_wait( cond, mtx ) == 0 )
-    {
-        return thrd_success;
-    }
-    else
-    {
-        return thrd_error;
-    }
+    return _PDCLIB_cnd_wait( cond, mtx, _PDCLIB_TIMEOUT_INFINITY );
 }
 
 #endif
@@ -8,20 +8,10 @@
 
 #include <threads.h>
 
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casting the parameter. */
-extern int pthread_mutex_destroy( mtx_t * );
-
-#ifdef __cplusplus
-}
-#endif
-
 void mtx_destroy( mtx_t * mtx )
 {
-    pthread_mutex_destroy( mtx );
+    /* Nothing was allocated. */
+    ( void )mtx;
 }
 
 #endif
@@ -6,29 +6,11 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casting the parameter. */
-extern int pthread_mutex_lock( mtx_t * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int mtx_lock( mtx_t * mtx )
 {
-    if ( pthread_mutex_lock( mtx ) == 0 )
-    {
-        return thrd_success;
-    }
-    else
-    {
-        return thrd_error;
-    }
+    return _PDCLIB_mtx_acquire( mtx, _PDCLIB_TIMEOUT_INFINITY );
 }
 
 #endif
@@ -6,34 +6,11 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#include "/usr/include/errno.h"
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicitly casting the first parameters. */
-extern int pthread_mutex_timedlock( mtx_t *, const struct timespec * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int mtx_timedlock( mtx_t * _PDCLIB_restrict mtx, const struct timespec * _PDCLIB_restrict ts )
 {
-    switch ( pthread_mutex_timedlock( mtx, ts ) )
-    {
-        case 0:
-            return thrd_success;
-
-        case ETIMEDOUT:
-            return thrd_timedout;
-
-        default:
-            return thrd_error;
-    }
+    return _PDCLIB_mtx_acquire( mtx, _PDCLIB_timeout_ms( ts ) );
 }
 
 #endif
@@ -6,34 +6,26 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#include "/usr/include/errno.h"
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicity casting the parameter. */
-extern int pthread_mutex_trylock( mtx_t * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int mtx_trylock( mtx_t * mtx )
 {
-    switch ( pthread_mutex_trylock( mtx ) )
-    {
-        case 0:
-            return thrd_success;
+    void * self = current_thread();
 
-        case EBUSY:
-            return thrd_busy;
+    if ( mtx->_PDCLIB_mtx_recursive && mtx->_PDCLIB_mtx_owner == self )
+    {
+        ++mtx->_PDCLIB_mtx_count;
+        return thrd_success;
+    }
 
-        default:
-            return thrd_error;
+    if ( _InterlockedCompareExchange( &mtx->_PDCLIB_mtx_state, 1, 0 ) != 0 )
+    {
+        return thrd_busy;
     }
+
+    mtx->_PDCLIB_mtx_owner = self;
+    mtx->_PDCLIB_mtx_count = 1;
+    return thrd_success;
 }
 
 #endif
@@ -6,29 +6,29 @@
 
 #ifndef REGTEST
 
-#include <threads.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/* Implicity casting the parameter. */
-extern int pthread_mutex_unlock( mtx_t * );
-
-#ifdef __cplusplus
-}
-#endif
+#include "pdclib/_PDCLIB_threads.h"
 
 int mtx_unlock( mtx_t * mtx )
 {
-    if ( pthread_mutex_unlock( mtx ) == 0 )
+    if ( mtx->_PDCLIB_mtx_owner != current_thread() )
+    {
+        return thrd_error;
+    }
+
+    if ( --mtx->_PDCLIB_mtx_count != 0 )
     {
         return thrd_success;
     }
-    else
+
+    mtx->_PDCLIB_mtx_owner = NULL;
+
+    /* Only go to the kernel if somebody may be sleeping. */
+    if ( _InterlockedExchange( &mtx->_PDCLIB_mtx_state, 0 ) == 2 )
     {
-        return thrd_error;
+        wake_address( &mtx->_PDCLIB_mtx_state, 1 );
     }
+
+    return thrd_success;
 }
 
 #endif
@@ -10,10 +10,25 @@
 
 #include "pdclib/_PDCLIB_defguard.h"
 
+extern unsigned long long arch_get_system_timer( void );
+
 int timespec_get( struct timespec * ts, int base )
 {
+    unsigned long long ms;
+
     /* Not supporting any other time base than TIME_UTC for now. */
-    return 0;
+    if ( base != TIME_UTC )
+    {
+        return 0;
+    }
+
+    /* There is no wall clock yet, so TIME_UTC counts from boot. The
+       <threads.h> timed waits use the same base for their deadlines.
+    */
+    ms = arch_get_system_timer();
+    ts->tv_sec = ( time_t )( ms / 1000 );
+    ts->tv_nsec = ( long )( ms % 1000 ) * 1000000;
+    return base;
 }
 
 #endif
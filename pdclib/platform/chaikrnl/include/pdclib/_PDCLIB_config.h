@@ -1061,54 +1061,27 @@ typedef unsigned int wint_t;
 /* can be copy & pasted here.                                                 */
 
 typedef unsigned long int _PDCLIB_thrd_t;
-typedef union { unsigned char _PDCLIB_cnd_t_data[ 48 ]; long long int _PDCLIB_cnd_t_align; } _PDCLIB_cnd_t;
-#if defined( __arm__ ) || defined( __ARM_NEON )
-typedef union { unsigned char _PDCLIB_mtx_t_data[ 24 ]; long int _PDCLIB_mtx_t_align; } _PDCLIB_mtx_t;
-#else
-typedef union { unsigned char _PDCLIB_mtx_t_data[ 40 ]; long int _PDCLIB_mtx_t_align; } _PDCLIB_mtx_t;
-#endif
+/* Mutexes, condition variables and once flags are plain words that sleep on  */
+/* the kernel's wait_on_address(), so they need no allocation and an all-zero */
+/* object is ready to use.                                                    */
+/* Mutex state is 0 unlocked, 1 locked, 2 locked with (possible) waiters.     */
+typedef struct { volatile long _PDCLIB_mtx_state; long _PDCLIB_mtx_recursive; void * volatile _PDCLIB_mtx_owner; unsigned long _PDCLIB_mtx_count; } _PDCLIB_mtx_t;
+/* Condition variables are a sequence number bumped by every signal.          */
+typedef struct { volatile long _PDCLIB_cnd_seq; } _PDCLIB_cnd_t;
 typedef unsigned int _PDCLIB_tss_t;
+/* Once flag state is 0 not run, 1 running, 2 done.                           */
 typedef int _PDCLIB_once_flag;
 #define _PDCLIB_ONCE_FLAG_INIT 0
-#define _PDCLIB_RECURSIVE_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define _PDCLIB_RECURSIVE_MUTEX_INIT _PDCLIB_MTX_RECURSIVE_INIT
 /* This one is actually hidden in <limits.h>, and only if __USE_POSIX is      */
 /* defined prior to #include <limits.h> (PTHREAD_DESTRUCTOR_ITERATIONS).      */
 #define _PDCLIB_TSS_DTOR_ITERATIONS 4
 /* The following are not made public in any header, but used internally for   */
 /* interfacing with the pthread API.                                          */
-typedef union { unsigned char _PDCLIB_cnd_attr_t_data[ 4 ]; int _PDCLIB_cnd_attr_t_align; } _PDCLIB_cnd_attr_t;
-typedef union { unsigned char _PDCLIB_mtx_attr_t_data[ 4 ]; int _PDCLIB_mtx_attr_t_align; } _PDCLIB_mtx_attr_t;
-#if defined( __arm__ ) || defined( __ARM_NEON )
-typedef union { unsigned char _PDCLIB_thrd_attr_t_data[ 36 ]; long int _PDCLIB_thrd_attr_t_align; } _PDCLIB_thrd_attr_t;
-#else
 typedef union { unsigned char _PDCLIB_thrd_attr_t_data[ 56 ]; long int _PDCLIB_thrd_attr_t_align; } _PDCLIB_thrd_attr_t;
-#endif
-/* Static initialization of recursive mutex.                                  */
-#if defined( __arm__ ) || defined( __ARM_NEON )
-#define _PDCLIB_MTX_RECURSIVE_INIT { {\
-         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-         0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,\
-         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } }
-/* Static initialization of plain / timeout mutex (identical with pthread).   */
-#define _PDCLIB_MTX_PLAIN_INIT { {\
-         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } }
-#else
-#define _PDCLIB_MTX_RECURSIVE_INIT { {\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } }
-/* Static initialization of plain / timeout mutex (identical with pthread).   */
-#define _PDCLIB_MTX_PLAIN_INIT { {\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,\
-     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } }
-#endif
+/* Static initialization of recursive and plain / timeout mutexes.            */
+#define _PDCLIB_MTX_RECURSIVE_INIT { 0, 1, 0, 0 }
+#define _PDCLIB_MTX_PLAIN_INIT { 0, 0, 0, 0 }
 
 /* Termux defines atexit in crtbegin_so.o leading to a multiple definition    */
 /* error from the linker. This is a crude workaround, which does NOT fix      */
@@ -0,0 +1,48 @@
+/* Kernel glue for <threads.h> <_PDCLIB_threads.h>
+
+   This file is part of the Public Domain C Library (PDCLib).
+   Permission is granted to use, modify, and / or redistribute at will.
+*/
+
+#ifndef _PDCLIB_THREADS_GLUE_H
+#define _PDCLIB_THREADS_GLUE_H _PDCLIB_THREADS_GLUE_H
+
+#include <threads.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define _PDCLIB_TIMEOUT_INFINITY ( ( _PDCLIB_size_t ) -1 )
+#define _PDCLIB_WAKE_ALL ( ( _PDCLIB_size_t ) -1 )
+
+/* Exported by the kernel, see Chaikrnl/waitaddr.h. */
+extern unsigned char wait_on_address( volatile void * addr, const void * expected, _PDCLIB_size_t size, _PDCLIB_size_t timeout );
+extern _PDCLIB_size_t wake_address( volatile void * addr, _PDCLIB_size_t count );
+extern void * current_thread( void );
+extern unsigned long long arch_get_system_timer( void );
+
+/* Declared here rather than through <intrin.h>, which drags in the host CRT. */
+long _InterlockedCompareExchange( long volatile * dest, long exchange, long comparand );
+long _InterlockedExchange( long volatile * dest, long value );
+long _InterlockedIncrement( long volatile * dest );
+#pragma intrinsic( _InterlockedCompareExchange, _InterlockedExchange, _InterlockedIncrement )
+
+/* Milliseconds until the TIME_UTC deadline ts, as reported by timespec_get(),
+   which counts from boot. Zero if it has already passed.
+*/
+_PDCLIB_size_t _PDCLIB_timeout_ms( const struct timespec * ts );
+
+/* Locks mtx, sleeping for at most timeout milliseconds.
+   Returns thrd_success or thrd_timedout.
+*/
+int _PDCLIB_mtx_acquire( mtx_t * mtx, _PDCLIB_size_t timeout );
+
+/* Waits for cond to be signalled, with mtx released for the duration. */
+int _PDCLIB_cnd_wait( cnd_t * cond, mtx_t * mtx, _PDCLIB_size_t timeout );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif